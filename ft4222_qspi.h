@@ -0,0 +1,46 @@
+#ifndef FT4222_QSPI_H
+#define FT4222_QSPI_H
+
+#include <stdint.h>
+
+// Session API of the SPI2AHB protocol layer, built as libft4222qspi.so
+// by make.sh. The protocol state is process wide, so a process drives
+// one session at a time.
+
+typedef struct ft4222_qspi_session ft4222_qspi_session;
+
+// division is the 80MHz divider (-d), vio the IO voltage (-v) and
+// swap_word the -W word swap mode. Returns NULL on failure.
+ft4222_qspi_session *ft4222_qspi_session_open(int division, double vio, int swap_word);
+void ft4222_qspi_session_close(ft4222_qspi_session *session);
+
+// Route following transfers to the target on SS<target>O (0~3).
+int ft4222_qspi_session_select(ft4222_qspi_session *session, int target);
+
+// Gather following writes into the largest legal bursts; pending words go
+// out timeout_ms after the first of them, from a session thread when the
+// caller is idle (0: only when read back, on another 4KB region, a lower
+// address or at a barrier), so program order is kept. A negative
+// timeout_ms turns combining off again. A deadline send that failed is
+// reported by the next barrier.
+int ft4222_qspi_session_combine(ft4222_qspi_session *session, int timeout_ms);
+// Send every pending combined write now.
+int ft4222_qspi_session_barrier(ft4222_qspi_session *session);
+
+// Return 1 on success, 0 on failure.
+int ft4222_qspi_session_read(ft4222_qspi_session *session, uint32_t mem_addr, void *buf, uint32_t len);
+int ft4222_qspi_session_write(ft4222_qspi_session *session, uint32_t mem_addr, const void *buf, uint32_t len);
+
+// Reserve host memory standing for len bytes of target memory at mem_addr
+// (both word aligned). Pages are read through userfaultfd on first touch,
+// with readahead on sequential access, and only written pages go back.
+// A page whose read fails is left out and the touching thread gets SIGBUS.
+// Needs userfaultfd write protection. Don't hand mapped memory to the
+// other session calls; copy it first. Returns NULL on failure.
+void *ft4222_qspi_session_map(ft4222_qspi_session *session, uint32_t mem_addr, uint32_t len);
+// Write the pages changed since the last sync back in coalesced bursts.
+int ft4222_qspi_session_sync(ft4222_qspi_session *session, void *map);
+// Sync, then release the mapping. session_close unmaps what is left.
+int ft4222_qspi_session_unmap(ft4222_qspi_session *session, void *map);
+
+#endif
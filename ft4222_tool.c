@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,12 +12,34 @@
 #include <getopt.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "version.h"
+#include "ft4222_qspi.h"
+#ifdef FT4222_QSPI_FUSE
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#endif
 
 // SPI Master can assert SS0O in single mode
 // SS0O and SS1O in dual mode, and
 // SS0O, SS1O, SS2O and SS3O in quad mode.
 #define SLAVE_SELECT(x)      (1 << (x))
+#define QSPI_TARGET_MAX      4
+// Bytes loaded into one target before a multi-target load moves on
+#define QSPI_MULTI_STRIPE    0x1000
 
 #define QSPI_SYS_CLK         80000000
 #define QSPI_ACCESS_WINDOW   0x02000000
@@ -26,10 +49,11 @@
 #define QSPI_CMD_DATA_MAX    128
 #define QSPI_CMD_WRITE_MAX   128
 #define QSPI_CMD_READ_MAX    128
-#define QSPI_DUMP_MAX_SIZE   4096
 #define QSPI_SCRIPT_MAX_SIZE 4096
 #define QSPI_DUMP_COL_NUM    4
 #define QSPI_DUMP_WORD       4
+#define QSPI_FRAME_HDR       4
+#define QSPI_BURST_MAX       256
 #define QSPI_MULTI_WR_DELAY  50
 #define QSPI_MULTI_WR_RETRY  50
 #define QSPI_W_SWAP_WORD     1
@@ -53,36 +77,420 @@
 #define QSPI_WAIT_CYCLE_MASK      (3<<3)
 #define QSPI_WAIT_CYCLE(n)        (n<<3)
 
+#define QSPI_WAIT_CYCLE_MAX       3
+#define QSPI_WAIT_READ_DATA       0
+#define QSPI_WAIT_READ_STATUS     1
+#define QSPI_WAIT_WRITE_STATUS    2
+#define QSPI_WAIT_OPS             3
+
 #define QSPI_DATA_LENGTH_MASK     0x07
 #define QSPI_READ_REQ_LEN         0x00
 
+#define QSPI_CACHE_BLOCK          QSPI_CMD_READ_MAX
+#define QSPI_CACHE_ENTRIES        1024
+#define QSPI_CACHE_REGION_MAX     16
+#define QSPI_CACHE_UNCACHED       0
+#define QSPI_CACHE_CACHEABLE      1
+#define QSPI_CACHE_READONCE       2
+
+struct qspi_cache_region {
+	uint32_t start;
+	uint32_t size;
+	int      policy;
+};
+
+struct qspi_cache_line {
+	int      valid;
+	int      target;
+	uint32_t addr;
+	uint8_t  data[QSPI_CACHE_BLOCK];
+};
+
+struct qspi_stats {
+	unsigned long cache_hit;
+	unsigned long cache_miss;
+	unsigned long cache_inval;
+	unsigned long read_burst;
+	unsigned long write_burst;
+	unsigned long status_poll;
+	unsigned long ready_event;
+	unsigned long ready_timeout;
+	unsigned long recovery;
+	unsigned long recovered;
+	unsigned long recovery_fail;
+	uint64_t      recovery_us;
+	unsigned long combine_write;
+	unsigned long combine_burst;
+	unsigned long posted_batch;
+	unsigned long posted_fail;
+};
+
+#define QSPI_ADAPT_ERRORS         2
+#define QSPI_ADAPT_CLEAN          64
+#define QSPI_ADAPT_MIN_BURST      16
+#define QSPI_ADAPT_MAX_DIV        512
+
+#define QSPI_READY_TIMEOUT_MS     100
+#define QSPI_READY_EVENTS         16
+#define QSPI_READY_POLL_US        100
+#define QSPI_VIO_I2C_KBPS         100
+
+#define QSPI_RECOVER_RETRY        3
+#define QSPI_RECOVER_BACKOFF_MS   2
+#define QSPI_RECOVER_BACKOFF_MAX  200
+
+#define QSPI_MAP_READAHEAD        32   // pages, reached by doubling on sequential faults
+#define QSPI_MAP_ABSENT           0
+#define QSPI_MAP_CLEAN            1
+#define QSPI_MAP_DIRTY            2
+
+#define QSPI_MANIFEST_MAX         64
+#define QSPI_ITEM_IMAGE           0
+#define QSPI_ITEM_WORD            1
+#define QSPI_ITEM_BARRIER         2
+
+#define QSPI_MEMTEST_MAX          16
+#define QSPI_MEMTEST_REPORT       16
+
+#define QSPI_PLAN_USB_US          125.0 // one USB 2.0 microframe per transaction
+
+#define QSPI_WATCH_MAX            64
+#define QSPI_WATCH_MAGIC          0x48435457 // "WTCH"
+#define QSPI_WATCH_LOG_BUF        (1 << 20)
+
+#define QSPI_RMW_MAX              256
+#define QSPI_RMW_SET              0
+#define QSPI_RMW_CLR              1
+#define QSPI_RMW_FIELD            2
+#define QSPI_RMW_MASK             3
+
+#define QSPI_JOURNAL_MAGIC        0x4a505351
+#define QSPI_JOURNAL_EVERY        64
+
+#define QSPI_STATE_DIR            "/tmp"
+#define QSPI_DEVICE_MAP           "ft4222-qspi.devices"
+#define QSPI_USB_SYSFS            "/sys/bus/usb/devices"
+
+#define QSPI_DUMP_BLOCK           4096
+#define QSPI_DUMP_SLOTS           8
+#define QSPI_DUMP_OUT_SIZE        (256 * 1024)
+#define QSPI_DUMP_ROW_MAX         1024
+#define QSPI_DUMP_COL_MAX         64
+#define QSPI_DUMP_FMT_HEX         0
+#define QSPI_DUMP_FMT_WORDS       1
+#define QSPI_DUMP_FMT_RAW         2
+#define QSPI_DUMP_FMT_IHEX        3
+
+#define QSPI_SNAP_MAGIC           0x504e5351
+#define QSPI_SNAP_BLOCK           4096
+#define QSPI_SNAP_RUN             0x80000000
+
+#define QSPI_TRACE_MAGIC          0x43525451
+#define QSPI_TRACE_RING           4096
+#define QSPI_TRACE_CMD            4
+#define QSPI_TRACE_SPIN_US        200
+
+#define QSPI_PIPE_BLOCK           0x10000
+#define QSPI_PIPE_BLOCKS          8
+#define QSPI_PIPE_FRAMES          1024
+#define QSPI_POST_DEPTH           4    // bursts the bridge buffers ahead of one write status
+#define QSPI_PIPE_SPIN            64   // yields before a ring wait sleeps
+#define QSPI_PIPE_WAIT_MS         10   // sleep bound, so an abort is seen
+
+#define QSPI_COMBINE_SIZE         4096
+
+struct qspi_snap_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t mem_addr;
+	uint32_t size;
+	uint32_t blocks;
+	uint32_t reserved;
+};
+
+// Per block FNV-1a hash of the raw data and where its packed words sit
+struct qspi_snap_index {
+	uint64_t hash;
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct qspi_snap_range {
+	int      open;
+	uint32_t start;
+	uint32_t end;
+	uint32_t count;
+};
+
+// Single producer, single consumer ring: only the producer moves head and
+// only the consumer moves tail, so neither side takes a lock. A side that
+// has to wait spins briefly, then sleeps on cond until the other side
+// moves; the lock is only taken around that sleep.
+struct qspi_spsc {
+	uint32_t        head;
+	uint32_t        tail;
+	uint32_t        mask;
+	int             eof;
+	int             sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+struct qspi_pipe_block {
+	uint32_t len;
+	uint8_t  data[QSPI_PIPE_BLOCK];
+};
+
+struct qspi_pipe_frame {
+	uint32_t mem_addr;
+	uint32_t end;
+	uint16_t len;
+	uint8_t  buf[QSPI_FRAME_HDR + QSPI_BURST_MAX];
+};
+
+// -B load pipeline: reader thread -> blocks -> transform thread -> frames
+// -> bus (calling) thread
+struct qspi_pipe {
+	struct qspi_spsc        block_ring;
+	struct qspi_spsc        frame_ring;
+	struct qspi_pipe_block  blocks[QSPI_PIPE_BLOCKS];
+	struct qspi_pipe_frame  frames[QSPI_PIPE_FRAMES];
+	int                     fd;
+	// Without an fd, fill generates size bytes of image at an address
+	void                  (*fill)(void *arg, uint8_t *buf, uint32_t mem_addr, uint32_t len);
+	void                   *arg;
+	size_t                  size;
+	uint32_t                mem_addr;
+	size_t                  start;
+	size_t                  total;
+	uint16_t                burst;
+	int                     stream;
+	int                     abort;
+	int                     error;
+};
+
+struct qspi_trace_header {
+	uint32_t magic;
+	uint32_t record_size;
+	uint64_t epoch_us;
+};
+
+// One FT4222_SPIMaster_MultiReadWrite call; data payloads are not kept
+struct qspi_trace_record {
+	uint64_t start_us;
+	uint32_t duration_us;
+	uint16_t write_len;
+	uint16_t read_len;
+	uint8_t  cmd[QSPI_TRACE_CMD];
+	int16_t  status;
+	uint16_t single_len;
+};
+
+struct qspi_journal {
+	uint32_t magic;
+	uint32_t swap_word;
+	uint64_t image_hash;
+	uint64_t image_size;
+	uint32_t mem_addr;
+	uint32_t reserved;
+	uint64_t done;
+};
+
+struct qspi_rmw_op {
+	int      type;
+	uint32_t addr;
+	uint32_t mask;
+	uint32_t value;
+};
+
 GPIO_Dir gpioDir[4] = {GPIO_INPUT, GPIO_INPUT, GPIO_INPUT, GPIO_INPUT};
 
 static int debug_printf=0, delay_cycle=QSPI_MULTI_WR_DELAY, io_Loading=DS_8MA;
-static uint32_t qspi_store_base=0x90000000;
+// Each chip select drives its own SPI2AHB bridge with its own window
+static uint32_t qspi_store_base[QSPI_TARGET_MAX] = {0x90000000, 0x90000000, 0x90000000, 0x90000000};
+static int qspi_base_valid[QSPI_TARGET_MAX] = {0}, qspi_base_held = 0;
+static int qspi_target = 0, qspi_target_active = -1;
 static int qspi_swapword = QSPI_WR_SWAP_WORD;
+// Wait cycles per command type, each one is a dummy byte ahead of the data
+static int qspi_wait_cycle[QSPI_WAIT_OPS] = {0}, qspi_wait_auto = 1;
+static int qspi_retry_max = QSPI_RECOVER_RETRY;
+static FT_HANDLE qspi_ready_handle = NULL;
+static int qspi_ready_port = -1;
+#ifndef FT4222_QSPI_LIBRARY
+static GPIO_Trigger qspi_ready_trigger = GPIO_TRIGGER_RISING;
+#endif
+// Device picked by -o/-O, and the link setup already applied to it since
+// it was plugged in
+static char *qspi_serial_want = NULL;
+static DWORD qspi_locid_want = 0;
+static char qspi_serial[32] = "";
+#ifndef FT4222_QSPI_LIBRARY
+static int qspi_dump_format = QSPI_DUMP_FMT_WORDS, qspi_dump_columns = QSPI_DUMP_COL_NUM;
+#endif
+// Every SPI transaction goes through qspi_transport; -T records them
+static FT4222_STATUS (*qspi_transport)(FT_HANDLE, uint8 *, uint8 *, uint8, uint16, uint16, uint32 *) =
+	FT4222_SPIMaster_MultiReadWrite;
+static FILE *qspi_trace_fp = NULL;
+static struct qspi_trace_record *qspi_trace_ring = NULL;
+static unsigned int qspi_trace_count = 0;
+static uint64_t qspi_trace_base = 0;
+static struct {
+	int    valid;
+	char   stamp[96];
+	double vio;
+	int    drive;
+} qspi_link_state;
+static int qspi_division = QSPI_DEFAULT_DIV;
+#ifndef FT4222_QSPI_LIBRARY
+static int qspi_adaptive = 0, qspi_burst_size = QSPI_CMD_WRITE_MAX;
+static int qspi_posted = 0;
+static int qspi_division_min = QSPI_DEFAULT_DIV;
+static int qspi_adapt_errors = 0, qspi_adapt_clean = 0, qspi_adapt_down = 0, qspi_adapt_up = 0;
+#endif
+static struct qspi_cache_region qspi_cache_regions[QSPI_CACHE_REGION_MAX];
+static int qspi_cache_region_num = 0;
+static struct qspi_cache_line *qspi_cache_lines = NULL;
+static struct qspi_stats qspi_stats;
+#ifndef FT4222_QSPI_LIBRARY
+static struct qspi_rmw_op qspi_rmw_ops[QSPI_RMW_MAX];
+static int qspi_rmw_num = 0;
+static struct {
+	int           num;
+	uint32_t      addr[QSPI_WATCH_MAX];
+	uint32_t      period_us;
+	unsigned long samples;
+	char         *log;
+	int           binary;
+	int           rt_prio;
+	int           cpu;
+} qspi_watch = { .cpu = -1 };
+static volatile sig_atomic_t qspi_watch_stop = 0;
+#endif
+
+// One -F manifest line, with its timing once loaded
+struct qspi_manifest_item {
+	int      kind;
+	int      line;
+	uint32_t mem_addr;
+	uint32_t value;
+	int      swap;
+	int      verify;
+	char     path[PATH_MAX];
+	size_t   size;
+	uint64_t load_us;
+	uint64_t verify_us;
+	int      result;
+};
+
+struct qspi_memtest_ctx;
+struct qspi_memtest {
+	const char *name;
+	int         passes;
+	uint32_t  (*value)(const struct qspi_memtest_ctx *ctx, uint32_t addr);
+};
+
+struct qspi_memtest_ctx {
+	const struct qspi_memtest *test;
+	int           pass;
+	uint32_t      seed;
+	unsigned long errors;
+	uint32_t      bits;
+};
+
+#ifndef FT4222_QSPI_LIBRARY
+static struct qspi_memtest_ctx qspi_memtest_runs[QSPI_MEMTEST_MAX];
+static int qspi_memtest_num = 0;
+static char *qspi_journal_name = NULL;
+static int qspi_journal_fd = -1, qspi_journal_every = QSPI_JOURNAL_EVERY, qspi_resume = 0;
+#endif
+// Write-combining buffer: one aligned QSPI_COMBINE_SIZE region of pending
+// words, held until a barrier, an overlapping bus access, a move to another
+// region or a lower address, or the age limit. Pending writes only ever go
+// up, so flushing in ascending order keeps program order.
+static struct {
+	int      enabled;
+	int      timeout_ms;
+	int      pending;
+	uint32_t base;
+	uint32_t lo;
+	uint32_t hi;
+	uint32_t next;
+	uint64_t since_us;
+	uint8_t  valid[QSPI_COMBINE_SIZE / QSPI_DUMP_WORD];
+	uint8_t  data[QSPI_COMBINE_SIZE];
+} qspi_combine;
+
+// --plan: transactions are counted and priced instead of sent, sleeps are
+// added up instead of slept. Costs are per transaction plus per byte on
+// the wire, indexed by [write op][transaction type].
+static struct {
+	int           enabled;
+	uint32_t      base[QSPI_TARGET_MAX];
+	uint32_t      request;
+	unsigned long count[2][4];
+	uint64_t      bytes[2][4];
+	unsigned long base_switch;
+	uint64_t      sleep_us;
+	double        fixed_us[2][4];
+	double        byte_us[2][4];
+	const char   *calibration;
+} qspi_plan;
 char ft4222A_desc[64];
 char ft4222B_desc[64];
-static const char *const short_options = "bhrVwya:B:D:d:g:l:L:p:s:S:W:v:";
+#ifndef FT4222_QSPI_LIBRARY
+static const char *const short_options = "AbhIQRrVwya:e:B:F:K:u:U:Y:Z:c:C:D:d:E:f:g:G:i:j:J:k:l:L:m:M:n:N:o:O:p:P:q:s:S:t:T:W:v:x:X:z:";
 static const struct option long_options[] = {
+   {"adaptive", no_argument, NULL, 'A'},
    {"base", no_argument, NULL, 'b'},
    {"Binary", required_argument, NULL, 'B'},
+   {"cache", required_argument, NULL, 'c'},
+   {"combine", required_argument, NULL, 'C'},
+   {"format", required_argument, NULL, 'f'},
    {"help", no_argument, NULL, 'h'},
    {"addr", required_argument, NULL, 'a'},
    {"div", required_argument, NULL, 'd'},
+   {"export", required_argument, NULL, 'E'},
    {"Data", required_argument, NULL, 'D'},
    {"debug", required_argument, NULL, 'g'},
+   {"gdb", required_argument, NULL, 'G'},
+   {"readyGpio", required_argument, NULL, 'i'},
+   {"load-stdin", no_argument, NULL, 'I'},
+   {"journal", required_argument, NULL, 'j'},
+   {"journalEvery", required_argument, NULL, 'J'},
+   {"waitCycle", required_argument, NULL, 'k'},
    {"delay", required_argument, NULL, 'l'},
    {"Load", required_argument, NULL, 'L'},
+   {"modify", required_argument, NULL, 'm'},
+   {"snapshot", required_argument, NULL, 'n'},
+   {"diff", required_argument, NULL, 'N'},
+   {"serial", required_argument, NULL, 'o'},
+   {"location", required_argument, NULL, 'O'},
+   {"mount", required_argument, NULL, 'M'},
    {"dump", required_argument, NULL, 'p'},
+   {"poll", required_argument, NULL, 'P'},
+   {"watch", required_argument, NULL, 'Y'},
+   {"memtest", required_argument, NULL, 'u'},
+   {"manifest", required_argument, NULL, 'F'},
+   {"watchLog", required_argument, NULL, 'U'},
+   {"samples", required_argument, NULL, 'Z'},
+   {"realtime", required_argument, NULL, 'K'},
+   {"posted", required_argument, NULL, 'q'},
+   {"plan", no_argument, NULL, 'Q'},
+   {"planCost", required_argument, NULL, 'e'},
    {"read", no_argument, NULL, 'r'},
+   {"resume", no_argument, NULL, 'R'},
    {"string", required_argument, NULL, 's'},
    {"Script", required_argument, NULL, 'S'},
+   {"target", required_argument, NULL, 't'},
+   {"trace", required_argument, NULL, 'T'},
    {"write", no_argument, NULL, 'w'},
    {"swapWord", required_argument, NULL, 'W'},
    {"Version", no_argument, NULL, 'V'},
    {"voltage", required_argument, NULL, 'v'},
    {"verify", no_argument, NULL, 'y'},
+   {"retries", required_argument, NULL, 'x'},
+   {"replay", required_argument, NULL, 'X'},
+   {"size", required_argument, NULL, 'z'},
    {NULL, no_argument, NULL, 0},
 };
 
@@ -91,8 +499,22 @@ static void print_usage(FILE * stream, char *app_name, int exit_code)
    fprintf(stream, "Usage: %s %s-%s [options]\n", app_name, FT4222_QSPI_TOOL_GIT_TAG, FT4222_QSPI_TOOL_GIT_COMMIT);
    fprintf(stream,
       " -a  --addr <address>      Setting QSPI access address.\n"
+      " -A  --adaptive            Step -B burst size and QSPI clock down on link errors\n"
+      "                           and back up after clean bursts.\n"
       " -b  --base                Display SPI2AHB Base Address.\n"
       " -B  --Binary <file>       QSPI Write with binary file.\n"
+      " -C  --combine <ms>        Gather small and adjacent writes into the largest legal\n"
+      "                           bursts; pending writes <ms> old go out at the next write\n"
+      "                           or -P poll (0: only at a read of them, another 4KB\n"
+      "                           region or exit). Writes into -c ...,u regions and to\n"
+      "                           lower addresses are not merged.\n"
+      " -c  --cache <addr,size,policy>\n"
+      "                           Enable host read cache for a region (hex addr/size).\n"
+      "                           policy c: cacheable, invalidated by writes;\n"
+      "                           policy o: read-once, updated by writes;\n"
+      "                           policy u: uncached (MMIO). May be repeated.\n"
+      " -E  --export <trace>,<json>\n"
+      "                           Convert a -T trace to Chrome trace-event JSON.\n"
       " -d  --div <division>      Setting QSPI CLOCK with 80MHz/<division>.\n"\
       "                           2/4/8/16/32/64/128/256/512.\n"
       " -D  --Data <value>        Setting QSPI Send data value.\n"
@@ -102,22 +524,79 @@ static void print_usage(FILE * stream, char *app_name, int exit_code)
       "                           100: Check Read Dump Log.\n"
       "                           114: Check Read Command Log.\n"
       "                           115: Check Write STATUS Command Log.\n"
+      "                           116: Show Transfer Statistics.\n"
       "                           119: Check Write Command Log.\n"
+      " -G  --gdb <port>          Serve target memory to gdb (target remote :<port>).\n"
       " -h  --help                Display this usage information.\n"
+      " -i  --readyGpio <2[,f]>   Wait for the target ready line on interface B GPIO2\n"
+      "                           (rising edge, f: falling) instead of polling status.\n"
+      " -I  --load-stdin          Stream an image of any length from stdin to -a.\n"
+      " -j  --journal <file>      Record -B load progress in <file> for --resume.\n"
+      " -J  --journalEvery <n>    Update the journal every <n> bursts (default 64).\n"
+      " -k  --waitCycle <auto|rd[,rs[,ws]]>\n"
+      "                           SPI2AHB wait cycles 0~3 for read data, read status and\n"
+      "                           write status. auto (default) follows the -d divider.\n"
 	  " -l  --delay               Setting QSPI CMD Send Operation Delay.\n"
+      " -m  --modify <op[;op...]> Read-modify-write registers in one session (hex fields).\n"
+      "                           set:<addr>:<bits>  clr:<addr>:<bits>\n"
+      "                           field:<addr>:<mask>:<value>  mask:<addr>:<mask>:<value>\n"
+      "                           May be repeated; adjacent registers share bursts.\n"
+      " -M  --mount <dir>         Serve -a/-z target range as <dir>/mem through FUSE, uncached unless -c says so.\n"
+      " -n  --snapshot <file>     Save the -a/-z range to a packed snapshot <file>.\n"
+      " -N  --diff <snap>[,<snap2>]\n"
+      "                           List address ranges that changed between <snap> and\n"
+      "                           live memory, or between two snapshots.\n"
+      " -o  --serial <serial>     Open the FT4222H with this serial number.\n"
+      " -O  --location <locid>    Open the FT4222H whose interface A has this hex location ID.\n"
       " -p  --dump <size>         Dump Address size Context.\n"
+      " -F  --manifest <file>     Load the images and words listed in <file> in one session\n"
+      "                           (image <addr> <file> [swap=<n>] [verify], word <addr>\n"
+      "                           <value> [verify], barrier), grouped by 32MB window.\n"
+      " -f  --format <fmt>        -p output: words[:<n>] (default, n columns of 4 bytes),\n"
+      "                           hex (hexdump -C), raw (binary) or ihex (Intel HEX).\n"
+      " -P  --poll <mask,value,timeout_ms[,interval_us]>\n"
+      "                           Poll address until (data & mask) == value (hex mask/value).\n"
+      " -Q  --plan                Run the requested reads, writes and loads without the\n"
+      "                           board and print their transactions and estimated time.\n"
+      " -e  --planCost <trace>    Calibrate --plan costs from a -T trace of the bench.\n"
+      " -q  --posted <n>          Send -B/-I bursts back to back and check the write status\n"
+      "                           once every <n> bursts (up to 4, what the bridge buffers);\n"
+      "                           a failed batch is sent again burst by burst.\n"
 	  " -r  --read                Setting QSPI Read Operation.\n"
+      " -R  --resume              Continue an interrupted -B load from its journal.\n"
       " -s  --string <string>     QSPI Write with string.\n"
       " -S  --Script <text file>  QSPI Write with file context.\n"
+      " -t  --target <cs[,cs...]> Select target on SS0O~SS3O (default 0). A list loads\n"
+      "                           -B into every target with interleaved bursts.\n"
       " -w  --write               Setting QSPI Write Operation.\n"
       " -W  --swapWord <swap>     Setting QSPI Write/Read Word format is MSB or LSB.\n"
       "                           W/R Both Word NoSwap(0x0);\n"
       "                           Write Word Swap(0x1);\n"
       "                           Read Word Swap(0x2);\n"
       "                           W/R Both Word Swap(0x3);\n"
+      " -T  --trace <file>        Record every SPI transaction to a binary trace <file>.\n"
       " -V  --Version             Display FT4222 Chip version and LibFT4222 version.\n"
-      " -v  --voltage             Setting QSPI IO voltage from 1.5V ~3.3V.\n"
-      " -y  --verify              Verfiy QSPI Write binary file.\n");
+      " -v  --voltage             Setting QSPI IO voltage from 1.5V ~3.3V, applied whenever\n"
+      "                           given. May be left out once applied since the board was\n"
+      "                           plugged in.\n"
+      " -x  --retries <n>         Per-burst recovery retries after a link error (default 3).\n"
+      " -X  --replay <trace>[,hw] Re-issue a trace with its original timing on a null\n"
+      "                           transport, or on the board with hw (write data kept off it).\n"
+      " -Y  --watch <period_us>,<addr>[,<addr>...]\n"
+      "                           Sample word addresses (hex) every <period_us> on absolute\n"
+      "                           deadlines until Ctrl-C; adjacent ones share bursts.\n"
+      " -u  --memtest <pat[,pat...]>\n"
+      "                           Test the -a/-z range with walk1, walk0, addr, checker,\n"
+      "                           random[=<seed>], march (March C-) or all.\n"
+      " -U  --watchLog <file>[,bin]\n"
+      "                           Write -Y samples to <file> as CSV (default stdout) or\n"
+      "                           as a binary log with bin.\n"
+      " -Z  --samples <n>         Stop -Y after <n> samples.\n"
+      " -K  --realtime <prio>[,<cpu>]\n"
+      "                           Run -Y under SCHED_FIFO <prio> (0: keep the policy),\n"
+      "                           pinned to <cpu>.\n"
+      " -y  --verify              Verfiy QSPI Write binary file.\n"
+      " -z  --size <size>         Setting target range size in hex bytes.\n");
  
    exit(exit_code);
 }
@@ -145,6 +624,7 @@ static unsigned int get_ul_number(const char *_str)
 
 	return addr;
 }
+#endif
 
 static uint32_t swapLong(uint32_t ldata)
 {
@@ -160,7 +640,413 @@ static uint32_t swapLong(uint32_t ldata)
 
 static void msleep(unsigned int msecs)
 {
-	usleep(msecs*1000);
+	if (qspi_plan.enabled)
+		qspi_plan.sleep_us += (uint64_t)msecs * 1000;
+	else if (msecs)
+		usleep(msecs*1000);
+}
+
+static uint64_t qspi_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+// Stand-in for the bus: completes at once and reads back ready bytes, so
+// status polls finish on the first try
+static FT4222_STATUS ft4222_qspi_null_transport(FT_HANDLE ftHandle, uint8 *readBuffer, uint8 *writeBuffer,
+												uint8 singleWriteBytes, uint16 multiWriteBytes,
+												uint16 multiReadBytes, uint32 *sizeOfRead)
+{
+	if (readBuffer && multiReadBytes)
+		memset(readBuffer, QSPI_WR_READY, multiReadBytes);
+	*sizeOfRead = multiReadBytes;
+	return FT4222_OK;
+}
+#endif
+
+static int ft4222_qspi_trace_flush(void)
+{
+	if (qspi_trace_count &&
+		(fwrite(qspi_trace_ring, sizeof(*qspi_trace_ring), qspi_trace_count, qspi_trace_fp) != qspi_trace_count))
+	{
+		printf("Failed to write trace: %s\n", strerror(errno));
+		qspi_trace_count = 0;
+		return 0;
+	}
+	qspi_trace_count = 0;
+	return 1;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_trace_open(const char *fileName)
+{
+	struct qspi_trace_header header;
+	struct timespec ts;
+
+	qspi_trace_ring = malloc(QSPI_TRACE_RING * sizeof(*qspi_trace_ring));
+	qspi_trace_fp = fopen(fileName, "wb");
+	if ((qspi_trace_ring == NULL) || (qspi_trace_fp == NULL))
+	{
+		printf("Can't record trace %s: %s\n", fileName, strerror(errno));
+		goto fail;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.magic = QSPI_TRACE_MAGIC;
+	header.record_size = sizeof(struct qspi_trace_record);
+	header.epoch_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	if (fwrite(&header, sizeof(header), 1, qspi_trace_fp) != 1)
+	{
+		printf("Failed to write trace: %s\n", strerror(errno));
+		goto fail;
+	}
+	qspi_trace_base = qspi_time_us();
+	return 1;
+
+fail:
+	if (qspi_trace_fp)
+		fclose(qspi_trace_fp);
+	qspi_trace_fp = NULL;
+	free(qspi_trace_ring);
+	qspi_trace_ring = NULL;
+	return 0;
+}
+
+static void ft4222_qspi_trace_close(void)
+{
+	if (qspi_trace_fp == NULL)
+		return;
+
+	ft4222_qspi_trace_flush();
+	fclose(qspi_trace_fp);
+	qspi_trace_fp = NULL;
+	free(qspi_trace_ring);
+	qspi_trace_ring = NULL;
+}
+#endif
+
+static FT4222_STATUS ft4222_qspi_spi_rw(FT_HANDLE ftHandle, uint8_t *readBuffer, uint8_t *writeBuffer,
+										uint8_t singleWriteBytes, uint16_t multiWriteBytes,
+										uint16_t multiReadBytes, uint32_t *sizeOfRead)
+{
+	struct qspi_trace_record *rec;
+	FT4222_STATUS ft4222Status;
+	uint64_t start;
+
+	if (qspi_trace_fp == NULL)
+		return qspi_transport(ftHandle, readBuffer, writeBuffer, singleWriteBytes,
+							  multiWriteBytes, multiReadBytes, sizeOfRead);
+
+	start = qspi_time_us();
+	ft4222Status = qspi_transport(ftHandle, readBuffer, writeBuffer, singleWriteBytes,
+								  multiWriteBytes, multiReadBytes, sizeOfRead);
+
+	rec = &qspi_trace_ring[qspi_trace_count];
+	rec->start_us = start - qspi_trace_base;
+	rec->duration_us = (uint32_t)(qspi_time_us() - start);
+	rec->single_len = singleWriteBytes;
+	rec->write_len = multiWriteBytes;
+	rec->read_len = multiReadBytes;
+	rec->status = (int16_t)ft4222Status;
+	memset(rec->cmd, 0, sizeof(rec->cmd));
+	memcpy(rec->cmd, writeBuffer, ((singleWriteBytes + multiWriteBytes) < QSPI_TRACE_CMD) ?
+		   (singleWriteBytes + multiWriteBytes) : QSPI_TRACE_CMD);
+
+	// The ring only goes to disk when it fills, outside the timed window
+	if (++qspi_trace_count == QSPI_TRACE_RING)
+		ft4222_qspi_trace_flush();
+
+	return ft4222Status;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static const char *const qspi_trans_names[2][4] = {
+	{"read data", "read request", "read status", "read dummy"},
+	{"write data", "write request", "write status", "write dummy"},
+};
+
+static const char *ft4222_qspi_trace_name(const struct qspi_trace_record *rec)
+{
+	return qspi_trans_names[(rec->cmd[0] & QSPI_WR_OP_MASK) ? 1 : 0][(rec->cmd[0] & QSPI_TRANS_TYPE_MASK) >> 5];
+}
+
+static FILE *ft4222_qspi_trace_load(const char *fileName, struct qspi_trace_header *header)
+{
+	FILE *fp = fopen(fileName, "rb");
+
+	if (fp == NULL)
+	{
+		printf("Can't open trace %s: %s\n", fileName, strerror(errno));
+		return NULL;
+	}
+
+	if ((fread(header, sizeof(*header), 1, fp) != 1) || (header->magic != QSPI_TRACE_MAGIC) ||
+		(header->record_size != sizeof(struct qspi_trace_record)))
+	{
+		printf("%s is not a trace.\n", fileName);
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+// Stand-in for the bus in --plan mode. It keeps the base register so the
+// window logic takes its real path, and reports every status as ready.
+static FT4222_STATUS ft4222_qspi_plan_transport(FT_HANDLE ftHandle, uint8 *readBuffer, uint8 *writeBuffer,
+												uint8 singleWriteBytes, uint16 multiWriteBytes,
+												uint16 multiReadBytes, uint32 *sizeOfRead)
+{
+	int op = (writeBuffer[0] & QSPI_WR_OP_MASK) ? 1 : 0, type = (writeBuffer[0] & QSPI_TRANS_TYPE_MASK) >> 5;
+	uint32_t offset = (writeBuffer[1] << 18) | (writeBuffer[2] << 10) | (writeBuffer[3] << 2);
+	uint32_t *base = &qspi_plan.base[qspi_target];
+
+	qspi_plan.count[op][type]++;
+	qspi_plan.bytes[op][type] += singleWriteBytes + multiWriteBytes + multiReadBytes;
+
+	if (op && (writeBuffer[0] & QSPI_TRANS_TYPE_MASK) == QSPI_TRANS_DATA && (offset == QSPI_SET_BASE_ADDR))
+	{
+		*base = (writeBuffer[4] << 24) | (writeBuffer[5] << 16) | (writeBuffer[6] << 8) | writeBuffer[7];
+		qspi_plan.base_switch++;
+	}
+	else if (!op && ((writeBuffer[0] & QSPI_TRANS_TYPE_MASK) == QSPI_READ_REQUEST))
+		qspi_plan.request = offset;
+
+	if (readBuffer && multiReadBytes)
+	{
+		if ((writeBuffer[0] & QSPI_TRANS_TYPE_MASK) == QSPI_TRANS_STATUS)
+			memset(readBuffer, QSPI_WR_READY, multiReadBytes);
+		else
+			memset(readBuffer, 0, multiReadBytes);
+		if (((writeBuffer[0] & QSPI_TRANS_TYPE_MASK) == QSPI_TRANS_DATA) &&
+			(qspi_plan.request == QSPI_SET_BASE_ADDR) && (multiReadBytes >= 4))
+		{
+			readBuffer[multiReadBytes - 4] = (*base >> 24) & 0xFF;
+			readBuffer[multiReadBytes - 3] = (*base >> 16) & 0xFF;
+			readBuffer[multiReadBytes - 2] = (*base >>  8) & 0xFF;
+			readBuffer[multiReadBytes - 1] = (*base >>  0) & 0xFF;
+		}
+	}
+	*sizeOfRead = multiReadBytes;
+	return FT4222_OK;
+}
+
+// Default costs: a microframe per transaction, and two SCLK cycles per
+// byte on the four data lines
+static void ft4222_qspi_plan_defaults(void)
+{
+	int op, type;
+
+	for (op = 0; op < 2; op++)
+		for (type = 0; type < 4; type++)
+		{
+			qspi_plan.fixed_us[op][type] = QSPI_PLAN_USB_US;
+			qspi_plan.byte_us[op][type] = 2.0 * 1000000 / (QSPI_SYS_CLK / qspi_division);
+		}
+}
+
+// Fit cost = fixed + bytes * per_byte to each transaction type of a -T
+// trace taken on the bench. Types the trace has too little of keep the
+// defaults; a single transfer size only calibrates the fixed cost.
+static int ft4222_qspi_plan_calibrate(const char *fileName)
+{
+	struct qspi_trace_header header;
+	struct qspi_trace_record rec;
+	double n[2][4] = {{0}}, sx[2][4] = {{0}}, sy[2][4] = {{0}}, sxx[2][4] = {{0}}, sxy[2][4] = {{0}};
+	double x, var, slope;
+	int op, type;
+	FILE *fp;
+
+	fp = ft4222_qspi_trace_load(fileName, &header);
+	if (fp == NULL)
+		return 0;
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		if (rec.status != FT4222_OK)
+			continue;
+		op = (rec.cmd[0] & QSPI_WR_OP_MASK) ? 1 : 0;
+		type = (rec.cmd[0] & QSPI_TRANS_TYPE_MASK) >> 5;
+		x = rec.single_len + rec.write_len + rec.read_len;
+		n[op][type]++;
+		sx[op][type] += x;
+		sy[op][type] += rec.duration_us;
+		sxx[op][type] += x * x;
+		sxy[op][type] += x * rec.duration_us;
+	}
+	fclose(fp);
+
+	for (op = 0; op < 2; op++)
+		for (type = 0; type < 4; type++)
+		{
+			if (n[op][type] < 1)
+				continue;
+			var = sxx[op][type] - sx[op][type] * sx[op][type] / n[op][type];
+			slope = qspi_plan.byte_us[op][type];
+			if ((n[op][type] >= 2) && (var > 0))
+			{
+				slope = (sxy[op][type] - sx[op][type] * sy[op][type] / n[op][type]) / var;
+				if (slope < 0)
+					slope = 0;
+			}
+			qspi_plan.byte_us[op][type] = slope;
+			qspi_plan.fixed_us[op][type] = (sy[op][type] - slope * sx[op][type]) / n[op][type];
+			if (qspi_plan.fixed_us[op][type] < 0)
+				qspi_plan.fixed_us[op][type] = 0;
+		}
+	qspi_plan.calibration = fileName;
+	return 1;
+}
+
+static void ft4222_qspi_plan_report(void)
+{
+	unsigned long transactions = 0;
+	double cost, total_us = 0;
+	int op, type;
+
+	printf("Plan at %d Hz (div %d), delay %d ms, %d bytes bursts, costs %s%s\n",
+		   QSPI_SYS_CLK / qspi_division, qspi_division, delay_cycle, qspi_burst_size,
+		   qspi_plan.calibration ? "from " : "default", qspi_plan.calibration ? qspi_plan.calibration : "");
+	printf("%-14s %10s %12s %12s\n", "transaction", "count", "bytes", "est ms");
+	for (op = 0; op < 2; op++)
+		for (type = 0; type < 4; type++)
+		{
+			if (!qspi_plan.count[op][type])
+				continue;
+			cost = qspi_plan.count[op][type] * qspi_plan.fixed_us[op][type] +
+				   qspi_plan.bytes[op][type] * qspi_plan.byte_us[op][type];
+			printf("%-14s %10lu %12llu %12.1f\n", qspi_trans_names[op][type], qspi_plan.count[op][type],
+				   (unsigned long long)qspi_plan.bytes[op][type], cost / 1000);
+			transactions += qspi_plan.count[op][type];
+			total_us += cost;
+		}
+	printf("%-14s %10s %12s %12.1f\n", "sleeps", "", "", qspi_plan.sleep_us / 1000.0);
+	total_us += qspi_plan.sleep_us;
+	printf("%lu transactions, %lu base switches, %lu status polls, estimated %.3f s\n", transactions,
+		   qspi_plan.base_switch, qspi_plan.count[0][2] + qspi_plan.count[1][2], total_us / 1000000);
+}
+
+// Re-issue every traced transaction at its recorded offset from the start.
+// Write payloads are not traced, so on the board write data, base register
+// writes included, goes to the null transport instead of writing zeros.
+static int ft4222_qspi_trace_replay(FT_HANDLE ftHandle, const char *fileName)
+{
+	struct qspi_trace_header header;
+	struct qspi_trace_record rec;
+	uint8_t *writeBuffer = NULL, *readBuffer = NULL;
+	uint64_t base, now, start, traced_us = 0, replay_us = 0, late_us = 0;
+	uint32_t sizeOfRead, count = 0, failed = 0, padded = 0;
+	FT4222_STATUS ft4222Status;
+	int write_data;
+	FILE *fp;
+
+	fp = ft4222_qspi_trace_load(fileName, &header);
+	if (fp == NULL)
+		return 0;
+
+	writeBuffer = calloc(1, 0x10000 + 0x100);
+	readBuffer = malloc(0x10000);
+	if ((writeBuffer == NULL) || (readBuffer == NULL))
+	{
+		printf("Allocation failure.\n");
+		goto exit;
+	}
+
+	base = qspi_time_us();
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		// Sleep off long gaps, spin through the last stretch
+		now = qspi_time_us() - base;
+		if (now + QSPI_TRACE_SPIN_US < rec.start_us)
+			usleep(rec.start_us - now - QSPI_TRACE_SPIN_US);
+		while ((now = qspi_time_us() - base) < rec.start_us)
+			;
+		if (now - rec.start_us > late_us)
+			late_us = now - rec.start_us;
+
+		write_data = (rec.cmd[0] & QSPI_WR_OP_MASK) && ((rec.cmd[0] & QSPI_TRANS_TYPE_MASK) == QSPI_TRANS_DATA);
+		memcpy(writeBuffer, rec.cmd, QSPI_TRACE_CMD);
+		start = qspi_time_us();
+		if (write_data && (qspi_transport != ft4222_qspi_null_transport))
+		{
+			// Wait out the traced time so later transactions keep their spacing
+			while (qspi_time_us() - start < rec.duration_us)
+				;
+			ft4222Status = (FT4222_STATUS)rec.status;
+			padded++;
+		}
+		else
+			ft4222Status = qspi_transport(ftHandle, readBuffer, writeBuffer, (uint8)rec.single_len,
+										  rec.write_len, rec.read_len, &sizeOfRead);
+		replay_us += qspi_time_us() - start;
+		traced_us += rec.duration_us;
+		memset(writeBuffer, 0, QSPI_TRACE_CMD);
+
+		if (ft4222Status != (FT4222_STATUS)rec.status)
+			failed++;
+		count++;
+	}
+
+	printf("Replayed %u transactions on %s: bus time %llu us (traced %llu us), "
+		   "at most %llu us behind schedule, %u status mismatches\n",
+		   count, (qspi_transport == ft4222_qspi_null_transport) ? "null transport" : "hardware",
+		   (unsigned long long)replay_us, (unsigned long long)traced_us,
+		   (unsigned long long)late_us, failed);
+	if (padded)
+		printf("%u write data transactions were padded, not sent: the trace has no payloads.\n", padded);
+
+exit:
+	free(readBuffer);
+	free(writeBuffer);
+	fclose(fp);
+	return count && !failed;
+}
+
+// Chrome trace-event JSON; open it in chrome://tracing or Perfetto
+static int ft4222_qspi_trace_export(const char *fileName, const char *jsonName)
+{
+	struct qspi_trace_header header;
+	struct qspi_trace_record rec;
+	FILE *fp, *out;
+	int success = 1, first = 1;
+
+	fp = ft4222_qspi_trace_load(fileName, &header);
+	if (fp == NULL)
+		return 0;
+
+	out = fopen(jsonName, "w");
+	if (out == NULL)
+	{
+		printf("Can't create %s: %s\n", jsonName, strerror(errno));
+		fclose(fp);
+		return 0;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"epoch_us\":%llu},\"traceEvents\":[\n",
+			(unsigned long long)header.epoch_us);
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"spi\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%llu,\"dur\":%u,\"args\":{\"cmd\":\"%02x %02x %02x %02x\","
+				"\"write\":%u,\"read\":%u,\"status\":%d}}",
+				first ? "" : ",\n", ft4222_qspi_trace_name(&rec),
+				(unsigned long long)rec.start_us, rec.duration_us,
+				rec.cmd[0], rec.cmd[1], rec.cmd[2], rec.cmd[3],
+				rec.single_len + rec.write_len, rec.read_len, rec.status);
+		first = 0;
+	}
+	fprintf(out, "\n]}\n");
+
+	if (fclose(out))
+	{
+		printf("Failed to write %s: %s\n", jsonName, strerror(errno));
+		success = 0;
+	}
+	fclose(fp);
+	return success;
 }
 
 static void show_progress_bar(int cnt)
@@ -288,6 +1174,7 @@ static void showVersion(FT_HANDLE ftHandle, char *desc)
     }
 	return;
 }
+#endif
 
 static FT4222_SPIClock ft4222_convert_qspiclk(int division)
 {
@@ -374,12 +1261,73 @@ static FT4222_SPIClock ft4222_convert_qspiclk(int division)
 	return ftQspiClk;
 }
 
+// At the fast dividers the bridge needs wait cycles before it can drive
+// read data; slower clocks leave it enough time on their own.
+static void ft4222_qspi_wait_cycle_auto(FT4222_SPIClock ftQspiClk)
+{
+	int wait, op;
+
+	switch (ftQspiClk)
+	{
+		case CLK_NONE:
+		case CLK_DIV_2:
+			wait = 3;
+			break;
+		case CLK_DIV_4:
+			wait = 2;
+			break;
+		case CLK_DIV_8:
+			wait = 1;
+			break;
+		default:
+			wait = 0;
+			break;
+	}
+
+	for (op = 0; op < QSPI_WAIT_OPS; op++)
+		qspi_wait_cycle[op] = wait;
+
+	if (debug_printf == 'c')
+		printf("[QSPI WAIT] %d cycles\n", wait);
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_wait_cycle_set(const char *arg)
+{
+	int fields;
+
+	if (!strcmp(arg, "auto"))
+	{
+		qspi_wait_auto = 1;
+		return 1;
+	}
+
+	fields = sscanf(arg, "%d,%d,%d", &qspi_wait_cycle[QSPI_WAIT_READ_DATA],
+					&qspi_wait_cycle[QSPI_WAIT_READ_STATUS], &qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS]);
+	if (fields < 1)
+		return 0;
+	if (fields == 1)
+		qspi_wait_cycle[QSPI_WAIT_READ_STATUS] = qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS] = qspi_wait_cycle[QSPI_WAIT_READ_DATA];
+	else if (fields == 2)
+		qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS] = qspi_wait_cycle[QSPI_WAIT_READ_STATUS];
+
+	for (fields = 0; fields < QSPI_WAIT_OPS; fields++)
+		if ((qspi_wait_cycle[fields] < 0) || (qspi_wait_cycle[fields] > QSPI_WAIT_CYCLE_MAX))
+			return 0;
+
+	qspi_wait_auto = 0;
+	return 1;
+}
+#endif
+
 static void IOx_Index_SetOut(FT_HANDLE ftHandle_B, uint8_t bIOx_Index)
 {
 	FT4222_STATUS  ft4222Status;
 
 	gpioDir[bIOx_Index] = GPIO_OUTPUT;
 	ft4222Status = FT4222_GPIO_Init(ftHandle_B, &gpioDir[0]);
+	if (FT4222_OK != ft4222Status)
+		printf("FT4222_GPIO_Init failed (error %d)\n", (int)ft4222Status);
 }
 
 void IOx_Index_SetValue(FT_HANDLE ftHandle_B, uint8_t bIOx_Index, int iValue)
@@ -402,13 +1350,15 @@ void IOx_Index_SetValue(FT_HANDLE ftHandle_B, uint8_t bIOx_Index, int iValue)
 	}
 	BOOL bIO_Value = (iValue == 0) ? FALSE : TRUE;
 	ft4222Status = FT4222_GPIO_Write(ftHandle_B, GPIO_PortX, bIO_Value);
+	if (FT4222_OK != ft4222Status)
+		printf("FT4222_GPIO_Write failed (error %d)\n", (int)ft4222Status);
 }
 
 void Config_Init(FT_HANDLE ftHandle_B)
 {
 	IOx_Index_SetOut(ftHandle_B,0x03);
 	IOx_Index_SetValue(ftHandle_B,0x03, 1);
-	FT4222_I2CMaster_Init(ftHandle_B, 100);
+	FT4222_I2CMaster_Init(ftHandle_B, QSPI_VIO_I2C_KBPS);
 }
 
 BOOL Config_Set_VIO_2(FT_HANDLE ftHandle_B, uint16_t iValue)
@@ -444,23 +1394,26 @@ static uint8_t ft4222_qspi_get_read_status(FT_HANDLE ftHandle)
 	uint32_t sizeOfRead;
 
     //Send Read Status
-	cmd[0] = QSPI_READ_OP | QSPI_TRANS_STATUS | QSPI_WAIT_CYCLE(0);
-	ft4222Status = FT4222_SPIMaster_MultiReadWrite(
+	cmd[0] = QSPI_READ_OP | QSPI_TRANS_STATUS | QSPI_WAIT_CYCLE(qspi_wait_cycle[QSPI_WAIT_READ_STATUS]);
+	ft4222Status = ft4222_qspi_spi_rw(
 						ftHandle,
 						buffer, //readBuffer
 						cmd, //writeBuffer
 						0, //singleWriteBytes = 0
 						1, //multiWriteBytes
-						1, //multiReadBytes = 0
+						1 + qspi_wait_cycle[QSPI_WAIT_READ_STATUS], //multiReadBytes
 						&sizeOfRead);
 	msleep(1);
+	qspi_stats.status_poll++;
 	if (debug_printf == 's') {
+		if (FT4222_OK != ft4222Status)
+			printf("Get Status failed (error %d)\n", (int)ft4222Status);
 		printf("Get Status cmd:%02x\n",cmd[0]);
-		printf("Get Status:%02x\n",buffer[0]);
+		printf("Get Status:%02x\n",buffer[qspi_wait_cycle[QSPI_WAIT_READ_STATUS]]);
 		printf("\n");
 	}
 
-    return buffer[0];
+    return buffer[qspi_wait_cycle[QSPI_WAIT_READ_STATUS]];
 }
 
 static uint8_t ft4222_qspi_get_write_status(FT_HANDLE ftHandle)
@@ -471,34 +1424,151 @@ static uint8_t ft4222_qspi_get_write_status(FT_HANDLE ftHandle)
 	uint32_t sizeOfRead;
 
     //Send Read Status
-	cmd[0] = QSPI_WRITE_OP | QSPI_TRANS_STATUS | QSPI_WAIT_CYCLE(0);
-	ft4222Status = FT4222_SPIMaster_MultiReadWrite(
+	cmd[0] = QSPI_WRITE_OP | QSPI_TRANS_STATUS | QSPI_WAIT_CYCLE(qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS]);
+	ft4222Status = ft4222_qspi_spi_rw(
 						ftHandle,
 						buffer, //readBuffer
 						cmd, //writeBuffer
 						0, //singleWriteBytes = 0
 						1, //multiWriteBytes
-						1, //multiReadBytes = 0
+						1 + qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS], //multiReadBytes
 						&sizeOfRead);
 	msleep(1);
+	qspi_stats.status_poll++;
 	if (debug_printf == 's') {
+		if (FT4222_OK != ft4222Status)
+			printf("Get Status failed (error %d)\n", (int)ft4222Status);
 		printf("Get Status cmd:%02x\n",cmd[0]);
-		printf("Get Status:%02x\n",buffer[0]);
+		printf("Get Status:%02x\n",buffer[qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS]]);
 		printf("\n");
 	}
 
-    return buffer[0];
+    return buffer[qspi_wait_cycle[QSPI_WAIT_WRITE_STATUS]];
 }
 
 
-static int ft4222_qspi_write_nword(FT_HANDLE ftHandle, unsigned int offset, uint8_t *buffer, uint16_t bytes)
+// Drop every edge queued on the ready line
+static void ft4222_qspi_ready_drain(FT_HANDLE ftHandle_B, int port)
 {
-    int success = 1, row = 0 ,delay_cnt = 1 ,retry_times = 0;
-	uint8_t *writeBuffer =  NULL;
-	uint8_t cmd[4]= {0};
-	uint8_t data_length,w_status = 0x0;
-	FT4222_STATUS  ft4222Status = FT4222_OK;
-	uint32_t sizeOfRead;
+	GPIO_Trigger events[QSPI_READY_EVENTS];
+	uint16 queueSize = 0, sizeofRead = 0;
+
+	while ((FT4222_OK == FT4222_GPIO_GetTriggerStatus(ftHandle_B, (GPIO_Port)port, &queueSize)) && queueSize)
+	{
+		if (FT4222_OK != FT4222_GPIO_ReadTriggerQueue(ftHandle_B, (GPIO_Port)port, events,
+													  (queueSize > QSPI_READY_EVENTS) ? QSPI_READY_EVENTS : queueSize,
+													  &sizeofRead))
+			break;
+	}
+}
+
+// Completion through the target's ready/IRQ line on an interface B GPIO.
+// Every finished transaction queues one edge, so one event is consumed per
+// transaction waited for. Returns 0 when the line is not configured or
+// stays quiet before all of them came.
+static int ft4222_qspi_wait_ready(int count)
+{
+	FT4222_STATUS ft4222Status;
+	GPIO_Trigger events[QSPI_READY_EVENTS];
+	uint16 queueSize = 0, sizeofRead = 0;
+	uint64_t start_us;
+
+	if (qspi_ready_port < 0)
+		return 0;
+
+	start_us = qspi_time_us();
+	do {
+		ft4222Status = FT4222_GPIO_GetTriggerStatus(qspi_ready_handle, (GPIO_Port)qspi_ready_port, &queueSize);
+		if (FT4222_OK != ft4222Status)
+			break;
+
+		if (queueSize)
+		{
+			if (queueSize > count)
+				queueSize = count;
+			if (queueSize > QSPI_READY_EVENTS)
+				queueSize = QSPI_READY_EVENTS;
+			ft4222Status = FT4222_GPIO_ReadTriggerQueue(qspi_ready_handle, (GPIO_Port)qspi_ready_port, events, queueSize, &sizeofRead);
+			if (FT4222_OK != ft4222Status)
+				break;
+			qspi_stats.ready_event += sizeofRead;
+			count -= sizeofRead;
+			if (count <= 0)
+				return 1;
+			continue;
+		}
+		usleep(QSPI_READY_POLL_US);
+	} while ((qspi_time_us() - start_us) < QSPI_READY_TIMEOUT_MS * 1000);
+
+	qspi_stats.ready_timeout++;
+	if (debug_printf == 's')
+		printf("Ready GPIO%d timeout, polling status\n", qspi_ready_port);
+	return 0;
+}
+
+// Wait for the count transactions just issued. An edge alone could be a late one
+// from an earlier timed out wait, so one status read always confirms it.
+// Once status had to be polled the queue no longer lines up with the
+// transactions, so it is emptied before the next one goes out.
+static int ft4222_qspi_wait_status(FT_HANDLE ftHandle, uint8_t (*get_status)(FT_HANDLE), const char *name, int count)
+{
+	int retry_times = 0, edge;
+	uint8_t status;
+
+	if (debug_printf == 'S')
+		return 1;
+
+	edge = ft4222_qspi_wait_ready(count);
+	while (!(QSPI_WR_READY == (status = get_status(ftHandle))))
+	{
+		retry_times ++;
+		if (retry_times > QSPI_MULTI_WR_RETRY)
+		{
+			printf("%s retry tiemout status %02x!\n", name, status);
+			break;
+		}
+		msleep(delay_cycle);
+	}
+	if ((qspi_ready_port >= 0) && (!edge || retry_times))
+		ft4222_qspi_ready_drain(qspi_ready_handle, qspi_ready_port);
+
+	return (QSPI_WR_READY == status);
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_ready_init(FT_HANDLE ftHandle_B, int port)
+{
+	FT4222_STATUS ft4222Status;
+
+	gpioDir[port] = GPIO_INPUT;
+	ft4222Status = FT4222_GPIO_Init(ftHandle_B, &gpioDir[0]);
+	if (FT4222_OK == ft4222Status)
+		ft4222Status = FT4222_GPIO_SetInputTrigger(ftHandle_B, (GPIO_Port)port, qspi_ready_trigger);
+	if (FT4222_OK != ft4222Status)
+	{
+		printf("FT4222_GPIO_SetInputTrigger failed (error %d), polling status instead\n", (int)ft4222Status);
+		return 0;
+	}
+
+	// GPIO_Init claims all four pins; hand GPIO0/1 back to the VIO DAC I2C
+	ft4222Status = FT4222_I2CMaster_Init(ftHandle_B, QSPI_VIO_I2C_KBPS);
+	if (FT4222_OK != ft4222Status)
+		printf("FT4222_I2CMaster_Init failed (error %d)\n", (int)ft4222Status);
+
+	// Drop edges left over from before this session
+	ft4222_qspi_ready_drain(ftHandle_B, port);
+
+	qspi_ready_handle = ftHandle_B;
+	qspi_ready_port   = port;
+	return 1;
+}
+#endif
+
+// A write frame is the 4-byte command header followed by the payload, in
+// the form FT4222_SPIMaster_MultiReadWrite sends it
+static int ft4222_qspi_write_build(uint8_t *frame, unsigned int offset, const uint8_t *buffer, uint16_t bytes)
+{
+	uint8_t data_length;
 
 	switch(bytes)
 	{
@@ -521,26 +1591,28 @@ static int ft4222_qspi_write_nword(FT_HANDLE ftHandle, unsigned int offset, uint
 			data_length = 5;
 			break;
 		default:
-			success = 0;
-			goto exit;
+			return 0;
 	}
 
-	delay_cnt = bytes/QSPI_DUMP_WORD;
-	cmd[0] = QSPI_WRITE_OP | QSPI_TRANS_DATA | data_length;
-	cmd[1] = (offset >> 18) & 0xFF;
-	cmd[2] = (offset >> 10) & 0xFF;
-	cmd[3] = (offset >> 2) & 0xFF;
-
-	writeBuffer = malloc(sizeof(cmd) + bytes);
+	frame[0] = QSPI_WRITE_OP | QSPI_TRANS_DATA | data_length;
+	frame[1] = (offset >> 18) & 0xFF;
+	frame[2] = (offset >> 10) & 0xFF;
+	frame[3] = (offset >> 2) & 0xFF;
+	if (buffer)
+		memcpy(frame + QSPI_FRAME_HDR, buffer, bytes);
+	return 1;
+}
 
-	memset(writeBuffer,0x0,sizeof(cmd) + bytes);
-	memcpy(writeBuffer, cmd, sizeof(cmd));
-	memcpy(writeBuffer + sizeof(cmd), buffer, bytes);
+static int ft4222_qspi_write_send(FT_HANDLE ftHandle, uint8_t *writeBuffer, uint16_t bytes)
+{
+    int success = 1, row = 0;
+	FT4222_STATUS  ft4222Status = FT4222_OK;
+	uint32_t sizeOfRead;
 
 	if (debug_printf == 'w') {
 		printf("[QSPI Write OP]\n");
-		printf("[CMD:%d bytes]\n",(int)sizeof(cmd));
-		for(row=0;row < sizeof(cmd); row++ )
+		printf("[CMD:%d bytes]\n",QSPI_FRAME_HDR);
+		for(row=0;row < QSPI_FRAME_HDR; row++ )
 			printf("%02x ", *(writeBuffer + row));
 		printf("\n");
 
@@ -549,23 +1621,21 @@ static int ft4222_qspi_write_nword(FT_HANDLE ftHandle, unsigned int offset, uint
 		{
 			if ((row%16 == 0) && (row > 0))
 				printf("\n");
-			printf("%02x ", *(writeBuffer + sizeof(cmd) + row));
+			printf("%02x ", *(writeBuffer + QSPI_FRAME_HDR + row));
 		}
 
 		printf("\n");
 		printf("\n");
 	}
 
-	ft4222Status = FT4222_SPIMaster_MultiReadWrite(
+	ft4222Status = ft4222_qspi_spi_rw(
 						ftHandle,
 						NULL, //readBuffer
 						writeBuffer,
 						0, //singleWriteBytes = 0
-						bytes + sizeof(cmd), //multiWriteBytes
+						bytes + QSPI_FRAME_HDR, //multiWriteBytes
 						0, //multiReadBytes = 0
 						&sizeOfRead);
-	//msleep(delay_cnt*delay_cycle);
-	msleep(delay_cycle);
 
     if (FT4222_OK != ft4222Status)
     {
@@ -574,34 +1644,42 @@ static int ft4222_qspi_write_nword(FT_HANDLE ftHandle, unsigned int offset, uint
         success = 0;
         goto exit;
     }
-
-	if (debug_printf != 'S')
-	{
-		while(!(QSPI_WR_READY == (w_status = ft4222_qspi_get_write_status(ftHandle))))
-		{
-			retry_times ++;
-			if (retry_times > QSPI_MULTI_WR_RETRY)
-			{
-				printf("ft4222_qspi_get_write_status retry tiemout w_status %02x!\n",
-					   w_status);
-				success = 0;
-				goto exit;
-			}
-			//msleep(delay_cnt*delay_cycle);
-			msleep(delay_cycle);
-		}
-	}
+	qspi_stats.write_burst++;
 
 exit:
-	free(writeBuffer);
     return success;
 }
 
+static int ft4222_qspi_write_issue(FT_HANDLE ftHandle, unsigned int offset, uint8_t *buffer, uint16_t bytes)
+{
+	uint8_t frame[QSPI_FRAME_HDR + QSPI_BURST_MAX];
+
+	if (!ft4222_qspi_write_build(frame, offset, buffer, bytes))
+		return 0;
+
+	return ft4222_qspi_write_send(ftHandle, frame, bytes);
+}
+
+static int ft4222_qspi_write_complete(FT_HANDLE ftHandle, int count)
+{
+	return ft4222_qspi_wait_status(ftHandle, ft4222_qspi_get_write_status, "ft4222_qspi_get_write_status", count);
+}
+
+static int ft4222_qspi_write_nword(FT_HANDLE ftHandle, unsigned int offset, uint8_t *buffer, uint16_t bytes)
+{
+	if (!ft4222_qspi_write_issue(ftHandle, offset, buffer, bytes))
+		return 0;
+
+	msleep(delay_cycle);
+	return ft4222_qspi_write_complete(ftHandle, 1);
+}
+
 static int ft4222_qspi_read_nword(FT_HANDLE ftHandle, unsigned int offset, uint8_t *buffer, uint16_t bytes)
 {
-    int success = 1 ,cnt = 0,delay_cnt = 1 ,retry_times = 0;;
+    int success = 1 ,cnt = 0, wait;
 	uint8_t cmd[4]= {0};
-	uint8_t data_length, r_status = 0x0;
+	uint8_t data_length;
+	uint8_t readBuffer[256 + QSPI_WAIT_CYCLE_MAX];
 	FT4222_STATUS  ft4222Status;
 	uint32_t sizeOfRead;
 
@@ -629,7 +1707,6 @@ static int ft4222_qspi_read_nword(FT_HANDLE ftHandle, unsigned int offset, uint8
 			break;
 	}
 
-	delay_cnt = bytes/QSPI_DUMP_WORD;
 	//Send Read Request
 	cmd[0] = QSPI_READ_OP | QSPI_READ_REQUEST | data_length;
 	cmd[1] = (offset >> 18) & 0xFF;
@@ -641,7 +1718,7 @@ static int ft4222_qspi_read_nword(FT_HANDLE ftHandle, unsigned int offset, uint8
 		printf("Read Request cmd:%02x %02x %02x %02x\n",cmd[0],cmd[1],cmd[2],cmd[3]);
 	}
 
-	ft4222Status = FT4222_SPIMaster_MultiReadWrite(
+	ft4222Status = ft4222_qspi_spi_rw(
 						ftHandle,
 						NULL, //readBuffer
 						cmd, //writeBuffer
@@ -660,34 +1737,28 @@ static int ft4222_qspi_read_nword(FT_HANDLE ftHandle, unsigned int offset, uint8
         goto exit;
     }
 
-	if (debug_printf != 'S')
+	if (!ft4222_qspi_wait_status(ftHandle, ft4222_qspi_get_read_status, "ft4222_qspi_get_read_status", 1))
 	{
-		while(!(QSPI_WR_READY == (r_status = ft4222_qspi_get_read_status(ftHandle))))
-		{
-			retry_times ++;
-			if (retry_times > QSPI_MULTI_WR_RETRY)
-			{
-				printf("ft4222_qspi_get_read_status retry tiemout r_status %02x!\n",
-					   r_status);
-				success = 0;
-				goto next;
-			}
-			//msleep(delay_cnt*delay_cycle);
-			msleep(delay_cycle);
-		}
+		success = 0;
+		goto exit;
 	}
 
-next:
     //Send Read Data
-	cmd[0] = QSPI_READ_OP | QSPI_TRANS_DATA | QSPI_WAIT_CYCLE(0) | data_length;
-	ft4222Status = FT4222_SPIMaster_MultiReadWrite(
+	wait = qspi_wait_cycle[QSPI_WAIT_READ_DATA];
+	cmd[0] = QSPI_READ_OP | QSPI_TRANS_DATA | QSPI_WAIT_CYCLE(wait) | data_length;
+	ft4222Status = ft4222_qspi_spi_rw(
 						ftHandle,
-						buffer, //readBuffer
+						wait ? readBuffer : buffer, //readBuffer
 						cmd, //writeBuffer
 						0, //singleWriteBytes = 0
 						1, //multiWriteBytes
-						bytes, //multiReadBytes = 0
+						bytes + wait, //multiReadBytes
 						&sizeOfRead);
+	if (wait)
+	{
+		memcpy(buffer, readBuffer + wait, bytes);
+		sizeOfRead = (sizeOfRead > wait) ? (sizeOfRead - wait) : 0;
+	}
 
 	//msleep(delay_cnt*delay_cycle);
 	msleep(delay_cycle);
@@ -699,6 +1770,7 @@ next:
         success = 0;
         goto exit;
     }
+	qspi_stats.read_burst++;
 
 	if (debug_printf == 'r') {
 		printf("Read Data cmd:%02x\n",cmd[0]);
@@ -738,6 +1810,10 @@ static int ft4222_qspi_check_base(FT_HANDLE ftHandle, uint32_t mem_addr)
 	uint32_t qspi_base_addr =0;
 	uint32_t set_base_addr  =(mem_addr/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
 
+	// The window is only trusted across calls while a caller holds it
+	if (qspi_base_held && qspi_base_valid[qspi_target] && (qspi_store_base[qspi_target] == set_base_addr))
+		return success;
+
 	//if (qspi_store_base != set_base_addr)
 	if (qspi_base_addr != set_base_addr)
 	{
@@ -791,256 +1867,890 @@ retry_switch:
 	}
 
 exit:
-	qspi_store_base = set_base_addr;
+	qspi_store_base[qspi_target] = set_base_addr;
+	qspi_base_valid[qspi_target] = success;
     return success;
 }
 
-static int ft4222_qspi_memory_write(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_cache_add_region(const char *region)
 {
 	int success = 1;
-	uint32_t offset_addr=(mem_addr%QSPI_ACCESS_WINDOW);
+	unsigned int start, size;
+	char policy;
 
-	if (!ft4222_qspi_check_base(ftHandle, mem_addr))
+	if ((sscanf(region, "%x,%x,%c", &start, &size, &policy) != 3) || (size == 0))
 	{
-        printf("Failed to check and rebuild base address.\n");
+		printf("QSPI cache region '%s' is not <addr,size,policy>.\n", region);
 		success = 0;
-        goto exit;
+		goto exit;
 	}
 
-	// Send QSPI Data
-	if (!ft4222_qspi_write_nword(ftHandle, offset_addr, buffer, bytes))
+	if (qspi_cache_region_num >= QSPI_CACHE_REGION_MAX)
 	{
-		printf("Failed ft4222_qspi_write_nword send data.\n");
+		printf("QSPI cache region number exceed max %d.\n", QSPI_CACHE_REGION_MAX);
 		success = 0;
 		goto exit;
 	}
 
+	switch (policy)
+	{
+		case 'c':
+			qspi_cache_regions[qspi_cache_region_num].policy = QSPI_CACHE_CACHEABLE;
+			break;
+		case 'o':
+			qspi_cache_regions[qspi_cache_region_num].policy = QSPI_CACHE_READONCE;
+			break;
+		case 'u':
+			qspi_cache_regions[qspi_cache_region_num].policy = QSPI_CACHE_UNCACHED;
+			break;
+		default:
+			printf("QSPI cache policy '%c' is not c/o/u.\n", policy);
+			success = 0;
+			goto exit;
+	}
+
+	if (qspi_cache_lines == NULL)
+		qspi_cache_lines = calloc(QSPI_CACHE_ENTRIES, sizeof(struct qspi_cache_line));
+
+	qspi_cache_regions[qspi_cache_region_num].start = start;
+	qspi_cache_regions[qspi_cache_region_num].size  = size;
+	qspi_cache_region_num++;
 exit:
-    return success;
+	return success;
 }
+#endif
 
-static int ft4222_qspi_memory_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+// Regions are matched in the order given, the first region holding the
+// whole access decides; anything else stays on the bus.
+static int ft4222_qspi_cache_policy(uint32_t mem_addr, uint32_t bytes)
 {
-	int success = 1;
-	uint32_t offset_addr=(mem_addr%QSPI_ACCESS_WINDOW);
+	int i;
 
-	if (!ft4222_qspi_check_base(ftHandle, mem_addr))
+	for (i = 0; i < qspi_cache_region_num; i++)
 	{
-        printf("Failed to check and rebuild base address.\n");
-		success = 0;
-        goto exit;
+		if ((mem_addr >= qspi_cache_regions[i].start) &&
+			((uint64_t)mem_addr + bytes <= (uint64_t)qspi_cache_regions[i].start + qspi_cache_regions[i].size))
+			return qspi_cache_regions[i].policy;
 	}
 
-	// Send QSPI Data
-	if (!ft4222_qspi_read_nword(ftHandle, offset_addr, buffer, bytes))
+	return QSPI_CACHE_UNCACHED;
+}
+
+// Whether a span touches a region marked uncached (u), i.e. registers
+static int ft4222_qspi_cache_mmio(uint32_t mem_addr, uint32_t bytes)
+{
+	int i;
+
+	for (i = 0; i < qspi_cache_region_num; i++)
 	{
-		printf("Failed ft4222_qspi_read_nword send data.\n");
-		success = 0;
-		goto exit;
+		if ((qspi_cache_regions[i].policy == QSPI_CACHE_UNCACHED) &&
+			(mem_addr < (uint64_t)qspi_cache_regions[i].start + qspi_cache_regions[i].size) &&
+			((uint64_t)mem_addr + bytes > qspi_cache_regions[i].start))
+			return 1;
 	}
+	return 0;
+}
 
-exit:
-    return success;
+// A whole block may be filled only if it lies inside a cached region and
+// overlaps no uncached one
+static int ft4222_qspi_cache_fillable(uint32_t blk_addr)
+{
+	if (ft4222_qspi_cache_mmio(blk_addr, QSPI_CACHE_BLOCK))
+		return 0;
+	return ft4222_qspi_cache_policy(blk_addr, QSPI_CACHE_BLOCK) != QSPI_CACHE_UNCACHED;
 }
 
-static int ft4222_qspi_memory_read_word(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t *pdata)
+// Write-through coherency: cacheable blocks are dropped, read-once
+// blocks take the new data so they never go back to the bus.
+static void ft4222_qspi_cache_write(uint32_t mem_addr, const uint8_t *buffer, uint32_t bytes)
 {
-    int success = 1;
-	uint8_t  qspi_data[4]= {0};
-	if (!ft4222_qspi_memory_read(ftHandle, mem_addr, qspi_data, 4))
+	uint32_t blk_addr, lo, hi;
+	struct qspi_cache_line *line;
+
+	if (qspi_cache_lines == NULL)
+		return;
+
+	for (blk_addr = (mem_addr/QSPI_CACHE_BLOCK) * QSPI_CACHE_BLOCK; blk_addr < mem_addr + bytes; blk_addr += QSPI_CACHE_BLOCK)
 	{
-        printf("Failed to ft4222_qspi_memory_read 4 bytes.\n");
-		success = 0;
-        goto exit;
+		line = &qspi_cache_lines[(blk_addr/QSPI_CACHE_BLOCK) % QSPI_CACHE_ENTRIES];
+		if (!line->valid || (line->addr != blk_addr) || (line->target != qspi_target))
+			continue;
+
+		if (ft4222_qspi_cache_policy(blk_addr, QSPI_CACHE_BLOCK) == QSPI_CACHE_READONCE)
+		{
+			lo = (mem_addr > blk_addr) ? mem_addr : blk_addr;
+			hi = ((mem_addr + bytes) < (blk_addr + QSPI_CACHE_BLOCK)) ? (mem_addr + bytes) : (blk_addr + QSPI_CACHE_BLOCK);
+			memcpy(line->data + (lo - blk_addr), buffer + (lo - mem_addr), hi - lo);
+		}
+		else
+		{
+			line->valid = 0;
+			qspi_stats.cache_inval++;
+		}
 	}
-	*pdata = (qspi_data[0] << 24) | (qspi_data[1] << 16) | (qspi_data[2] << 8) | qspi_data[3];
-exit:
-    return success;
 }
 
-static int ft4222_qspi_cmd_dump(FT_HANDLE ftHandle, uint32_t mem_addr, uint16_t size)
+#ifndef FT4222_QSPI_LIBRARY
+static void ft4222_qspi_cache_flush(void)
 {
-    int success = 1, row =0, col =0, max_row = 0, max_col =0, malloc_len =0;
-	uint8_t *buffer = NULL;
-	uint32_t start_base  =(mem_addr/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
-	uint32_t end_base  =((mem_addr + size)/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
+	int i;
 
-	if (size > QSPI_CMD_READ_MAX) {
-        printf("QSPI CMD Dump size %d exceed max %d.\n",(int)size ,QSPI_CMD_READ_MAX);
-		success = 0;
-        goto exit;
+	if (qspi_cache_lines == NULL)
+		return;
+
+	for (i = 0; i < QSPI_CACHE_ENTRIES; i++)
+		qspi_cache_lines[i].valid = 0;
+}
+
+static void ft4222_qspi_show_stats(void)
+{
+	if (qspi_cache_lines != NULL)
+		printf("QSPI cache: %lu hits, %lu misses, %lu invalidations\n",
+			   qspi_stats.cache_hit, qspi_stats.cache_miss, qspi_stats.cache_inval);
+
+	if (qspi_ready_port >= 0)
+		printf("QSPI ready GPIO%d: %lu events, %lu fallbacks to status polling\n",
+			   qspi_ready_port, qspi_stats.ready_event, qspi_stats.ready_timeout);
+
+	if (qspi_stats.recovery || (debug_printf == 't'))
+		printf("QSPI recovery: %lu retries, %lu bursts recovered, %lu failed, %llu us spent\n",
+			   qspi_stats.recovery, qspi_stats.recovered, qspi_stats.recovery_fail,
+			   (unsigned long long)qspi_stats.recovery_us);
+
+	if (qspi_posted)
+		printf("QSPI posted writes: %lu batches, %lu re-sent with status checks\n",
+			   qspi_stats.posted_batch, qspi_stats.posted_fail);
+
+	if (qspi_combine.enabled)
+		printf("QSPI write combining: %lu writes sent as %lu bursts\n",
+			   qspi_stats.combine_write, qspi_stats.combine_burst);
+
+	if (debug_printf == 't')
+		printf("QSPI bursts: %lu read, %lu write, %lu status polls\n",
+			   qspi_stats.read_burst, qspi_stats.write_burst, qspi_stats.status_poll);
+}
+#endif
+
+// Abort whatever the FT4222 still holds for the failed burst, forget the
+// base window so it is read back and rebuilt, then back off before the
+// burst is re-issued.
+static void ft4222_qspi_recover(FT_HANDLE ftHandle, uint32_t mem_addr, int attempt)
+{
+	FT4222_STATUS ft4222Status;
+	uint64_t start_us = qspi_time_us();
+	unsigned int backoff = QSPI_RECOVER_BACKOFF_MS << attempt;
+
+	printf("Recovering burst at 0x%08x (attempt %d/%d)\n", mem_addr, attempt + 1, qspi_retry_max);
+
+	ft4222Status = FT4222_SPI_ResetTransaction(ftHandle, 0);
+	if (FT4222_OK != ft4222Status)
+	{
+		ft4222Status = FT4222_SPI_Reset(ftHandle);
+		if (FT4222_OK != ft4222Status)
+			printf("FT4222_SPI_Reset failed (error %d)\n", (int)ft4222Status);
 	}
+	qspi_base_valid[qspi_target] = 0;
 
-	if ((start_base != end_base) && ((mem_addr + size)%QSPI_ACCESS_WINDOW)){
-        printf("QSPI CMD Dump from 0x%08x to 0x%08x, exceed next 32M windows 0x%08x.\n",mem_addr, (mem_addr + size), end_base);
+	msleep((backoff > QSPI_RECOVER_BACKOFF_MAX) ? QSPI_RECOVER_BACKOFF_MAX : backoff);
+	qspi_stats.recovery++;
+	qspi_stats.recovery_us += qspi_time_us() - start_us;
+}
+
+static int ft4222_qspi_combine_flush(FT_HANDLE ftHandle);
+
+// A bus access overlapping pending combined words sends them first
+static int ft4222_qspi_combine_order(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t bytes)
+{
+	if (qspi_combine.pending && (mem_addr < qspi_combine.base + qspi_combine.hi) &&
+		(mem_addr + bytes > qspi_combine.base + qspi_combine.lo))
+		return ft4222_qspi_combine_flush(ftHandle);
+	return 1;
+}
+
+// Send a prebuilt write frame, with the same recovery as any other burst
+static int ft4222_qspi_write_frame(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *frame, uint16_t bytes)
+{
+	int success = 1, attempt = 0;
+
+	if (!ft4222_qspi_combine_order(ftHandle, mem_addr, bytes))
+		return 0;
+
+retry:
+	if (!ft4222_qspi_check_base(ftHandle, mem_addr))
+	{
+        printf("Failed to check and rebuild base address.\n");
 		success = 0;
-        goto exit;
+        goto recover;
 	}
 
-	if (size <= 4)
-		malloc_len = 4;
-	else if ((size > 4) && (size <= 16))
-		malloc_len = 16;
-	else if ((size > 16) && (size <= 32))
-		malloc_len = 32;
-	else if ((size > 32) && (size <= 64))
-		malloc_len = 64;
-	else if ((size > 64) && (size <= 128))
-		malloc_len = 128;
-	else if ((size > 128) && (size <= 256))
-		malloc_len = 256;
-	else {
-		printf("QSPI Write with string length %d exceed max 256.\n",size);
+	// Send QSPI Data
+	if (!ft4222_qspi_write_send(ftHandle, frame, bytes))
+	{
+		printf("Failed ft4222_qspi_write_send send data.\n");
 		success = 0;
-		goto exit;
+		goto recover;
+	}
+	msleep(delay_cycle);
+	if (!ft4222_qspi_write_complete(ftHandle, 1))
+	{
+		printf("Failed ft4222_qspi_write_complete wait for data.\n");
+		success = 0;
+		goto recover;
 	}
 
-	buffer = malloc(malloc_len);
-	memset(buffer,0x0,malloc_len);
+	ft4222_qspi_cache_write(mem_addr, frame + QSPI_FRAME_HDR, bytes);
+	if (attempt)
+		qspi_stats.recovered++;
+    return success;
 
-	if (!ft4222_qspi_memory_read(ftHandle, mem_addr, buffer, malloc_len))
+recover:
+	if (attempt < qspi_retry_max)
 	{
-        printf("Failed to ft4222_qspi_memory_read 4 bytes.\n");
-		success = 0;
-        goto exit;
+		ft4222_qspi_recover(ftHandle, mem_addr, attempt++);
+		success = 1;
+		goto retry;
 	}
+	qspi_stats.recovery_fail++;
+    return success;
+}
 
-	max_row = size/(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD);
+// Largest legal burst that does not exceed bytes
+static int ft4222_qspi_burst_fit(uint32_t bytes)
+{
+	if (bytes >= 128)
+		return 128;
+	else if (bytes >= 64)
+		return 64;
+	else if (bytes >= 32)
+		return 32;
+	else if (bytes >= 16)
+		return 16;
+	return 4;
+}
 
-	if (max_row) {
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_addr_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+#endif
 
-		for(row=0; row < max_row; row++)
+static int ft4222_qspi_memory_write_bus(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+{
+	uint8_t frame[QSPI_FRAME_HDR + QSPI_BURST_MAX];
+
+	if (!ft4222_qspi_write_build(frame, mem_addr % QSPI_ACCESS_WINDOW, buffer, bytes))
+	{
+		printf("QSPI write burst of %d bytes is not 4/16/32/64/128/256.\n", bytes);
+		return 0;
+	}
+	return ft4222_qspi_write_frame(ftHandle, mem_addr, frame, bytes);
+}
+
+// Send every run of pending words in the largest legal bursts
+static int ft4222_qspi_combine_flush(FT_HANDLE ftHandle)
+{
+	uint32_t word, run, chunk, end = qspi_combine.hi / QSPI_DUMP_WORD;
+	int success = 1;
+
+	if (!qspi_combine.pending)
+		return success;
+	qspi_combine.pending = 0;
+
+	for (word = qspi_combine.lo / QSPI_DUMP_WORD; success && (word < end); )
+	{
+		if (!qspi_combine.valid[word])
 		{
-			printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
-			for(col=0; col < QSPI_DUMP_COL_NUM; col++)
-			{
-				printf("%08x ", swapLong(*((uint32_t *)(buffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
-			}
-			printf("\n");
+			word++;
+			continue;
 		}
-
-		if (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))
+		for (run = word; (run < end) && qspi_combine.valid[run]; run++)
+			;
+		while (success && (word < run))
 		{
-			row++;
-			max_col = (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))/QSPI_DUMP_WORD;
-			printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
-			for(col=0; col < max_col; col++)
-			{
-				printf("%08x ", swapLong(*((uint32_t *)(buffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
-			}
-			printf("\n");
+			chunk = ft4222_qspi_burst_fit((run - word) * QSPI_DUMP_WORD);
+			success = ft4222_qspi_memory_write_bus(ftHandle, qspi_combine.base + word * QSPI_DUMP_WORD,
+												   qspi_combine.data + word * QSPI_DUMP_WORD, chunk);
+			qspi_stats.combine_burst++;
+			word += chunk / QSPI_DUMP_WORD;
 		}
 	}
-	else
+
+	memset(qspi_combine.valid + qspi_combine.lo / QSPI_DUMP_WORD, 0,
+		   (qspi_combine.hi - qspi_combine.lo) / QSPI_DUMP_WORD);
+	return success;
+}
+
+// Send the pending words once they waited timeout_ms
+static int ft4222_qspi_combine_due(FT_HANDLE ftHandle)
+{
+	if (qspi_combine.pending && qspi_combine.timeout_ms &&
+		(qspi_time_us() - qspi_combine.since_us >= (uint64_t)qspi_combine.timeout_ms * 1000))
+		return ft4222_qspi_combine_flush(ftHandle);
+	return 1;
+}
+
+static int ft4222_qspi_combine_write(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+{
+	uint32_t region, piece, off;
+
+	if (!ft4222_qspi_combine_due(ftHandle))
+		return 0;
+
+	while (bytes)
 	{
-		printf("%08x : ", mem_addr);
-		max_col = (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))/QSPI_DUMP_WORD;
-		for(col=0; col < max_col; col++)
+		region = mem_addr & ~(QSPI_COMBINE_SIZE - 1);
+		piece = region + QSPI_COMBINE_SIZE - mem_addr;
+		if (piece > bytes)
+			piece = bytes;
+
+		if (qspi_combine.pending && ((qspi_combine.base != region) || (mem_addr < region + qspi_combine.next)) &&
+			!ft4222_qspi_combine_flush(ftHandle))
+			return 0;
+		if (!qspi_combine.pending)
 		{
-			printf("%08x ", swapLong(*((uint32_t *)(buffer + col*QSPI_DUMP_WORD))));
+			qspi_combine.pending = 1;
+			qspi_combine.base = region;
+			qspi_combine.lo = QSPI_COMBINE_SIZE;
+			qspi_combine.hi = 0;
+			qspi_combine.since_us = qspi_time_us();
 		}
-		printf("\n");
+
+		off = mem_addr - region;
+		memcpy(qspi_combine.data + off, buffer, piece);
+		memset(qspi_combine.valid + off / QSPI_DUMP_WORD, 1, piece / QSPI_DUMP_WORD);
+		if (off < qspi_combine.lo)
+			qspi_combine.lo = off;
+		if (off + piece > qspi_combine.hi)
+			qspi_combine.hi = off + piece;
+		qspi_combine.next = off + piece;
+
+		mem_addr += piece;
+		buffer += piece;
+		bytes -= piece;
 	}
-exit:
-    return success;
+	qspi_stats.combine_write++;
+	return 1;
 }
 
-static int ft4222_qspi_cmd_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t size, int swap_word)
+static int ft4222_qspi_memory_write(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
 {
-    int success = 1, row =0, col =0, max_row = 0, max_col =0, malloc_len =0;
-	uint8_t *readbuffer = NULL;
-	uint32_t start_base  =(mem_addr/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
-	uint32_t end_base  =((mem_addr + size)/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
+	// Register writes keep their count and order
+	if (qspi_combine.enabled && !((mem_addr | bytes) % QSPI_DUMP_WORD) && !ft4222_qspi_cache_mmio(mem_addr, bytes))
+		return ft4222_qspi_combine_write(ftHandle, mem_addr, buffer, bytes);
 
-	if (size > QSPI_CMD_READ_MAX) {
-        printf("QSPI CMD Dump size %d exceed max %d.\n",(int)size ,QSPI_CMD_READ_MAX);
+	if (!ft4222_qspi_combine_flush(ftHandle))
+		return 0;
+	return ft4222_qspi_memory_write_bus(ftHandle, mem_addr, buffer, bytes);
+}
+
+static int ft4222_qspi_memory_read_bus(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+{
+	int success = 1, attempt = 0;
+	uint32_t offset_addr=(mem_addr%QSPI_ACCESS_WINDOW);
+
+	if (!ft4222_qspi_combine_order(ftHandle, mem_addr, bytes))
+		return 0;
+
+retry:
+	if (!ft4222_qspi_check_base(ftHandle, mem_addr))
+	{
+        printf("Failed to check and rebuild base address.\n");
 		success = 0;
-        goto exit;
+        goto recover;
 	}
 
-	if ((start_base != end_base) && ((mem_addr + size)%QSPI_ACCESS_WINDOW)){
-        printf("QSPI CMD Dump from 0x%08x to 0x%08x, exceed next 32M windows 0x%08x.\n",mem_addr, (mem_addr + size), end_base);
+	// Send QSPI Data
+	if (!ft4222_qspi_read_nword(ftHandle, offset_addr, buffer, bytes))
+	{
+		printf("Failed ft4222_qspi_read_nword send data.\n");
 		success = 0;
-        goto exit;
+		goto recover;
 	}
+	if (attempt)
+		qspi_stats.recovered++;
+    return success;
 
-	if (size <= 4)
-		malloc_len = 4;
-	else if ((size > 4) && (size <= 16))
-		malloc_len = 16;
-	else if ((size > 16) && (size <= 32))
-		malloc_len = 32;
-	else if ((size > 32) && (size <= 64))
-		malloc_len = 64;
-	else if ((size > 64) && (size <= 128))
-		malloc_len = 128;
-	else if ((size > 128) && (size <= 256))
-		malloc_len = 256;
-	else {
-		printf("QSPI Write with string length %d exceed max 256.\n",size);
-		success = 0;
-		goto exit;
+recover:
+	if (attempt < qspi_retry_max)
+	{
+		ft4222_qspi_recover(ftHandle, mem_addr, attempt++);
+		success = 1;
+		goto retry;
 	}
+	qspi_stats.recovery_fail++;
+    return success;
+}
 
-	readbuffer = malloc(malloc_len);
-	memset(readbuffer,0x0,malloc_len);
+#ifndef FT4222_QSPI_LIBRARY
+// Read a word aligned span in legal bursts that never reach past it, so
+// registers next to the span are not read as a side effect
+static int ft4222_qspi_memory_read_exact(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint32_t bytes)
+{
+	uint32_t done, chunk;
 
-	if (!ft4222_qspi_memory_read(ftHandle, mem_addr, readbuffer, malloc_len))
+	for (done = 0; done < bytes; done += chunk)
 	{
-        printf("Failed to ft4222_qspi_memory_read 4 bytes.\n");
-		success = 0;
-        goto exit;
+		chunk = ft4222_qspi_burst_fit(bytes - done);
+		if (((mem_addr + done) % QSPI_ACCESS_WINDOW) + chunk > QSPI_ACCESS_WINDOW)
+			chunk = QSPI_DUMP_WORD;
+		if (!ft4222_qspi_memory_read_bus(ftHandle, mem_addr + done, buffer + done, chunk))
+			return 0;
 	}
+	return 1;
+}
+#endif
 
-	max_row = size/(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD);
-
-	if (max_row) {
+static int ft4222_qspi_cache_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+{
+	int success = 1;
+	uint32_t blk_addr, copy_offset, copy_len, done = 0;
+	struct qspi_cache_line *line;
 
-		for(row=0; row < max_row; row++)
+	while (done < bytes)
+	{
+		blk_addr    = ((mem_addr + done)/QSPI_CACHE_BLOCK) * QSPI_CACHE_BLOCK;
+		copy_offset = (mem_addr + done) - blk_addr;
+		copy_len    = QSPI_CACHE_BLOCK - copy_offset;
+		if (copy_len > bytes - done)
+			copy_len = bytes - done;
+
+		line = &qspi_cache_lines[(blk_addr/QSPI_CACHE_BLOCK) % QSPI_CACHE_ENTRIES];
+		if (line->valid && (line->addr == blk_addr) && (line->target == qspi_target))
 		{
-			if ( debug_printf  == 'd')
-				printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
-			for(col=0; col < QSPI_DUMP_COL_NUM; col++)
+			qspi_stats.cache_hit++;
+		}
+		else if (!ft4222_qspi_cache_fillable(blk_addr))
+		{
+			// The block straddles a region edge, filling it would touch
+			// addresses outside the region; read just what was asked for
+			qspi_stats.cache_miss++;
+			copy_len = ft4222_qspi_burst_fit(copy_len);
+			if (!ft4222_qspi_memory_read_bus(ftHandle, mem_addr + done, buffer + done, copy_len))
 			{
-				if (swap_word & QSPI_R_SWAP_WORD)
-				{
-					if ( debug_printf  == 'd')
-						printf("%08x ", swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
-					*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)) = \
-					swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
-				}
-				else
-				{
-					if ( debug_printf  == 'd')
-						printf("%08x ", *((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
-				}
+				success = 0;
+				goto exit;
 			}
-			if ( debug_printf  == 'd')
-				printf("\n");
+			done += copy_len;
+			continue;
 		}
-
-		if (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))
+		else
 		{
-			max_col = (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))/QSPI_DUMP_WORD;
-			if ( debug_printf  == 'd')
-				printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
-			for(col=0; col < max_col; col++)
+			qspi_stats.cache_miss++;
+			line->valid = 0;
+			if (!ft4222_qspi_memory_read_bus(ftHandle, blk_addr, line->data, QSPI_CACHE_BLOCK))
 			{
-				if (swap_word & QSPI_R_SWAP_WORD)
-				{
-					if ( debug_printf  == 'd')
-						printf("%08x ", swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
-					*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)) = \
-					swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
-				}
-				else
-				{
-					if ( debug_printf  == 'd')
-						printf("%08x ", *((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
-				}
+				success = 0;
+				goto exit;
 			}
-			if ( debug_printf  == 'd')
-				printf("\n");
+			line->addr   = blk_addr;
+			line->target = qspi_target;
+			line->valid  = 1;
+		}
+
+		memcpy(buffer + done, line->data + copy_offset, copy_len);
+		done += copy_len;
+	}
+
+exit:
+	return success;
+}
+
+static int ft4222_qspi_memory_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t bytes)
+{
+	if (!ft4222_qspi_combine_order(ftHandle, mem_addr, bytes))
+		return 0;
+
+	if (ft4222_qspi_cache_policy(mem_addr, bytes) != QSPI_CACHE_UNCACHED)
+		return ft4222_qspi_cache_read(ftHandle, mem_addr, buffer, bytes);
+
+	return ft4222_qspi_memory_read_bus(ftHandle, mem_addr, buffer, bytes);
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_memory_read_word(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t *pdata)
+{
+    int success = 1;
+	uint8_t  qspi_data[4]= {0};
+	if (!ft4222_qspi_memory_read(ftHandle, mem_addr, qspi_data, 4))
+	{
+        printf("Failed to ft4222_qspi_memory_read 4 bytes.\n");
+		success = 0;
+        goto exit;
+	}
+	*pdata = (qspi_data[0] << 24) | (qspi_data[1] << 16) | (qspi_data[2] << 8) | qspi_data[3];
+exit:
+    return success;
+}
+
+static int ft4222_qspi_memory_poll(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t mask, uint32_t value,
+								   unsigned int timeout_ms, unsigned int interval_us)
+{
+	int success = 0, saved_delay = delay_cycle;
+	unsigned long polls = 0;
+	uint8_t  qspi_data[4]= {0};
+	uint32_t data = 0;
+	uint64_t start_us, now_us;
+
+	// Hold the base window and drop the per-command sleeps, each poll
+	// is then one read request, its status and the data phase.
+	qspi_base_held = 1;
+	delay_cycle = 0;
+	start_us = qspi_time_us();
+
+	do {
+		if (!ft4222_qspi_combine_due(ftHandle))
+			goto exit;
+		if (!ft4222_qspi_memory_read_bus(ftHandle, mem_addr, qspi_data, 4))
+		{
+			printf("Failed to ft4222_qspi_memory_read_bus 4 bytes.\n");
+			goto exit;
+		}
+		polls++;
+		data = (qspi_data[0] << 24) | (qspi_data[1] << 16) | (qspi_data[2] << 8) | qspi_data[3];
+		now_us = qspi_time_us();
+
+		if ((data & mask) == value)
+		{
+			printf("%08x : %08x matched after %lu polls, %llu us\n", mem_addr, data, polls,
+				   (unsigned long long)(now_us - start_us));
+			success = 1;
+			goto exit;
+		}
+
+		if (interval_us)
+			usleep(interval_us);
+	} while ((now_us - start_us) < (uint64_t)timeout_ms * 1000);
+
+	printf("%08x : %08x poll timeout (mask %08x value %08x) after %lu polls, %llu us\n", mem_addr, data,
+		   mask, value, polls, (unsigned long long)(qspi_time_us() - start_us));
+exit:
+	delay_cycle = saved_delay;
+	qspi_base_held = 0;
+	return success;
+}
+
+// -Y <period_us>,<addr>[,<addr>...]
+static int ft4222_qspi_watch_add(char *spec)
+{
+	char *tok, *saveptr = NULL;
+
+	tok = strtok_r(spec, ",", &saveptr);
+	qspi_watch.period_us = (tok != NULL) ? strtoul(tok, NULL, 10) : 0;
+	if (qspi_watch.period_us == 0)
+	{
+		printf("QSPI watch period '%s' is not a number of us.\n", tok ? tok : "");
+		return 0;
+	}
+
+	for (tok = strtok_r(NULL, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr))
+	{
+		if (qspi_watch.num >= QSPI_WATCH_MAX)
+		{
+			printf("QSPI watch address number exceed max %d.\n", QSPI_WATCH_MAX);
+			return 0;
+		}
+		qspi_watch.addr[qspi_watch.num] = strtoul(tok, NULL, 16);
+		if (qspi_watch.addr[qspi_watch.num] % QSPI_DUMP_WORD)
+		{
+			printf("QSPI watch address '%s' is not word aligned.\n", tok);
+			return 0;
+		}
+		qspi_watch.num++;
+	}
+
+	if (qspi_watch.num == 0)
+	{
+		printf("QSPI watch needs at least one address.\n");
+		return 0;
+	}
+	return 1;
+}
+
+static void ft4222_qspi_watch_signal(int sig)
+{
+	qspi_watch_stop = 1;
+}
+
+// Put the sampling thread on SCHED_FIFO and one CPU, and keep its pages
+// resident. Failures only cost jitter, so they are reported and ignored.
+static void ft4222_qspi_watch_realtime(void)
+{
+	struct sched_param param = { .sched_priority = qspi_watch.rt_prio };
+	cpu_set_t cpus;
+
+	if (qspi_watch.cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(qspi_watch.cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus))
+			fprintf(stderr, "Failed to pin the watch to CPU %d: %s\n", qspi_watch.cpu, strerror(errno));
+	}
+	if (qspi_watch.rt_prio > 0)
+	{
+		if (sched_setscheduler(0, SCHED_FIFO, &param))
+			fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n", qspi_watch.rt_prio, strerror(errno));
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+	}
+}
+
+// Sample the -Y addresses every period on absolute deadlines. Runs of
+// adjacent addresses are read together in legal bursts that stay inside
+// the run, so no register between or beside them is touched. A sample
+// that starts after its next deadline counts the periods it overran as
+// missed, and the schedule skips ahead.
+static int ft4222_qspi_memory_watch(FT_HANDLE ftHandle)
+{
+	int success = 1, saved_delay = delay_cycle, i, j, ngroups = 0;
+	uint32_t sorted[QSPI_WATCH_MAX], group_addr[QSPI_WATCH_MAX], values[QSPI_WATCH_MAX], header[4];
+	uint16_t group_len[QSPI_WATCH_MAX];
+	uint8_t  raw[QSPI_CMD_READ_MAX], *p;
+	uint64_t start_us, now_us, late_us, max_late_us = 0, read_us = 0, stamp[2];
+	unsigned long n, missed = 0;
+	struct timespec next;
+	FILE *fp = stdout;
+	char *logbuf = NULL;
+	void (*saved_int)(int);
+
+	memcpy(sorted, qspi_watch.addr, qspi_watch.num * sizeof(uint32_t));
+	qsort(sorted, qspi_watch.num, sizeof(uint32_t), ft4222_qspi_addr_cmp);
+	for (i = 0; i < qspi_watch.num; i = j)
+	{
+		for (j = i + 1; j < qspi_watch.num; j++)
+		{
+			if (sorted[j] - sorted[j - 1] > QSPI_DUMP_WORD)
+				break;
+			if (sorted[j] + QSPI_DUMP_WORD - sorted[i] > QSPI_CMD_READ_MAX)
+				break;
+			if ((sorted[j]/QSPI_ACCESS_WINDOW) != (sorted[i]/QSPI_ACCESS_WINDOW))
+				break;
+		}
+		group_addr[ngroups] = sorted[i];
+		group_len[ngroups++] = sorted[j - 1] + QSPI_DUMP_WORD - sorted[i];
+	}
+
+	if (qspi_watch.log != NULL)
+	{
+		fp = fopen(qspi_watch.log, qspi_watch.binary ? "wb" : "w");
+		if (fp == NULL)
+		{
+			printf("cannot open watch log: %s \n", qspi_watch.log);
+			return 0;
+		}
+	}
+	logbuf = malloc(QSPI_WATCH_LOG_BUF);
+	if (logbuf != NULL)
+		setvbuf(fp, logbuf, _IOFBF, QSPI_WATCH_LOG_BUF);
+
+	if (qspi_watch.binary)
+	{
+		header[0] = QSPI_WATCH_MAGIC;
+		header[1] = 1;
+		header[2] = qspi_watch.num;
+		header[3] = qspi_watch.period_us;
+		fwrite(header, sizeof(header), 1, fp);
+		fwrite(qspi_watch.addr, sizeof(uint32_t), qspi_watch.num, fp);
+	}
+	else
+	{
+		fprintf(fp, "time_us,late_us");
+		for (i = 0; i < qspi_watch.num; i++)
+			fprintf(fp, ",0x%08x", qspi_watch.addr[i]);
+		fprintf(fp, "\n");
+	}
+
+	fprintf(stderr, "Watching %d addresses in %d groups every %u us%s\n", qspi_watch.num, ngroups,
+			qspi_watch.period_us, qspi_watch.samples ? "" : ", Ctrl-C to stop");
+
+	if (!ft4222_qspi_combine_flush(ftHandle))
+	{
+		success = 0;
+		goto exit;
+	}
+	ft4222_qspi_watch_realtime();
+	saved_int = signal(SIGINT, ft4222_qspi_watch_signal);
+	qspi_base_held = 1;
+	delay_cycle = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start_us = (uint64_t)next.tv_sec * 1000000 + next.tv_nsec / 1000;
+	for (n = 0; !qspi_watch_stop && (!qspi_watch.samples || (n < qspi_watch.samples)); n++)
+	{
+		while ((clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) && !qspi_watch_stop)
+			;
+		if (qspi_watch_stop)
+			break;
+
+		now_us = qspi_time_us();
+		late_us = now_us - ((uint64_t)next.tv_sec * 1000000 + next.tv_nsec / 1000);
+		if (late_us > max_late_us)
+			max_late_us = late_us;
+
+		for (i = 0; i < ngroups; i++)
+		{
+			if (!ft4222_qspi_memory_read_exact(ftHandle, group_addr[i], raw, group_len[i]))
+			{
+				printf("Failed to read watch burst at 0x%08x.\n", group_addr[i]);
+				success = 0;
+				goto restore;
+			}
+			for (j = 0; j < qspi_watch.num; j++)
+			{
+				if ((qspi_watch.addr[j] < group_addr[i]) || (qspi_watch.addr[j] >= group_addr[i] + group_len[i]))
+					continue;
+				p = raw + qspi_watch.addr[j] - group_addr[i];
+				values[j] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			}
+		}
+		read_us += qspi_time_us() - now_us;
+
+		if (qspi_watch.binary)
+		{
+			stamp[0] = now_us - start_us;
+			stamp[1] = late_us;
+			fwrite(stamp, sizeof(stamp), 1, fp);
+			fwrite(values, sizeof(uint32_t), qspi_watch.num, fp);
+		}
+		else
+		{
+			fprintf(fp, "%llu,%llu", (unsigned long long)(now_us - start_us), (unsigned long long)late_us);
+			for (i = 0; i < qspi_watch.num; i++)
+				fprintf(fp, ",0x%08x", values[i]);
+			fprintf(fp, "\n");
+		}
+
+		next.tv_nsec += (long)qspi_watch.period_us * 1000;
+		next.tv_sec  += next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		now_us = qspi_time_us();
+		while ((uint64_t)next.tv_sec * 1000000 + next.tv_nsec / 1000 < now_us)
+		{
+			next.tv_nsec += (long)qspi_watch.period_us * 1000;
+			next.tv_sec  += next.tv_nsec / 1000000000;
+			next.tv_nsec %= 1000000000;
+			missed++;
+		}
+	}
+
+restore:
+	signal(SIGINT, saved_int);
+	delay_cycle = saved_delay;
+	qspi_base_held = 0;
+	fprintf(stderr, "Watch: %lu samples, %lu missed deadlines, max late %llu us, mean read %llu us\n", n, missed,
+			(unsigned long long)max_late_us, (unsigned long long)(n ? read_us / n : 0));
+exit:
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+	if (logbuf != NULL)
+	{
+		if (fp == stdout)
+			setvbuf(stdout, NULL, _IOLBF, 0);
+		free(logbuf);
+	}
+	return success;
+}
+
+static int ft4222_qspi_cmd_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buffer, uint16_t size, int swap_word)
+{
+    int success = 1, row =0, col =0, max_row = 0, max_col =0, malloc_len =0;
+	uint8_t *readbuffer = NULL;
+	uint32_t start_base  =(mem_addr/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
+	uint32_t end_base  =((mem_addr + size)/QSPI_ACCESS_WINDOW) * QSPI_ACCESS_WINDOW;
+
+	if (size > QSPI_CMD_READ_MAX) {
+        printf("QSPI CMD Dump size %d exceed max %d.\n",(int)size ,QSPI_CMD_READ_MAX);
+		success = 0;
+        goto exit;
+	}
+
+	if ((start_base != end_base) && ((mem_addr + size)%QSPI_ACCESS_WINDOW)){
+        printf("QSPI CMD Dump from 0x%08x to 0x%08x, exceed next 32M windows 0x%08x.\n",mem_addr, (mem_addr + size), end_base);
+		success = 0;
+        goto exit;
+	}
+
+	if (size <= 4)
+		malloc_len = 4;
+	else if ((size > 4) && (size <= 16))
+		malloc_len = 16;
+	else if ((size > 16) && (size <= 32))
+		malloc_len = 32;
+	else if ((size > 32) && (size <= 64))
+		malloc_len = 64;
+	else if ((size > 64) && (size <= 128))
+		malloc_len = 128;
+	else if ((size > 128) && (size <= 256))
+		malloc_len = 256;
+	else {
+		printf("QSPI Write with string length %d exceed max 256.\n",size);
+		success = 0;
+		goto exit;
+	}
+
+	readbuffer = malloc(malloc_len);
+	memset(readbuffer,0x0,malloc_len);
+
+	if (!ft4222_qspi_memory_read(ftHandle, mem_addr, readbuffer, malloc_len))
+	{
+        printf("Failed to ft4222_qspi_memory_read 4 bytes.\n");
+		success = 0;
+        goto exit;
+	}
+
+	max_row = size/(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD);
+
+	if (max_row) {
+
+		for(row=0; row < max_row; row++)
+		{
+			if ( debug_printf  == 'd')
+				printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
+			for(col=0; col < QSPI_DUMP_COL_NUM; col++)
+			{
+				if (swap_word & QSPI_R_SWAP_WORD)
+				{
+					if ( debug_printf  == 'd')
+						printf("%08x ", swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
+					*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)) = \
+					swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
+				}
+				else
+				{
+					if ( debug_printf  == 'd')
+						printf("%08x ", *((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
+				}
+			}
+			if ( debug_printf  == 'd')
+				printf("\n");
+		}
+
+		if (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))
+		{
+			max_col = (size%(QSPI_DUMP_COL_NUM*QSPI_DUMP_WORD))/QSPI_DUMP_WORD;
+			if ( debug_printf  == 'd')
+				printf("%08x : ", mem_addr + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM));
+			for(col=0; col < max_col; col++)
+			{
+				if (swap_word & QSPI_R_SWAP_WORD)
+				{
+					if ( debug_printf  == 'd')
+						printf("%08x ", swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD))));
+					*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)) = \
+					swapLong(*((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
+				}
+				else
+				{
+					if ( debug_printf  == 'd')
+						printf("%08x ", *((uint32_t *)(readbuffer + (row*QSPI_DUMP_WORD*QSPI_DUMP_COL_NUM) + col*QSPI_DUMP_WORD)));
+				}
+			}
+			if ( debug_printf  == 'd')
+				printf("\n");
 		}
 	}
 	else
@@ -1135,68 +2845,170 @@ exit:
     return success;
 }
 
-static int ft4222_qspi_memory_dump(FT_HANDLE ftHandle, uint32_t mem_addr, uint16_t size)
+static int ft4222_qspi_memory_write_word(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t mem_data)
 {
-    int success = 1, cmd_time = 0, max_cmd_times = 0;
-	uint32_t qspi_addr = 0;
-
-	if (size > QSPI_DUMP_MAX_SIZE) {
-        printf("QSPI Dump memory size %d exceed max %d.\n",(int)size ,QSPI_DUMP_MAX_SIZE);
-		success = 0;
-        goto exit;
-	}
+	uint8_t  qspi_data[4]= {0};
+	qspi_data[0] = (mem_data >> 24) & 0xFF;
+	qspi_data[1] = (mem_data >> 16) & 0xFF;
+	qspi_data[2] = (mem_data >>  8) & 0xFF;
+	qspi_data[3] = (mem_data >>  0) & 0xFF;
+	return ft4222_qspi_memory_write(ftHandle, mem_addr, qspi_data, 4);
+}
 
-	max_cmd_times = (size/QSPI_CMD_READ_MAX);
+static int ft4222_qspi_rmw_add(char *oplist)
+{
+	int success = 1, fields;
+	char *op, *saveptr = NULL, type[8];
+	struct qspi_rmw_op *rmw;
 
-	if (max_cmd_times) {
-		for (cmd_time = 0; cmd_time < max_cmd_times; cmd_time++)
+	for (op = strtok_r(oplist, ";", &saveptr); op != NULL; op = strtok_r(NULL, ";", &saveptr))
+	{
+		if (qspi_rmw_num >= QSPI_RMW_MAX)
 		{
-			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
-
-			if (!ft4222_qspi_cmd_dump(ftHandle, qspi_addr, QSPI_CMD_READ_MAX))
-			{
-				printf("Failed to ft4222_qspi_cmd_dump.\n");
-				success = 0;
-				goto exit;
-			}
-			msleep(delay_cycle);
+			printf("QSPI modify op number exceed max %d.\n", QSPI_RMW_MAX);
+			success = 0;
+			goto exit;
 		}
 
-		if (size%QSPI_CMD_READ_MAX)
+		rmw = &qspi_rmw_ops[qspi_rmw_num];
+		rmw->value = 0;
+		fields = sscanf(op, "%7[a-z]:%x:%x:%x", type, &rmw->addr, &rmw->mask, &rmw->value);
+
+		if ((fields == 3) && !strcmp(type, "set"))
+			rmw->type = QSPI_RMW_SET;
+		else if ((fields == 3) && !strcmp(type, "clr"))
+			rmw->type = QSPI_RMW_CLR;
+		else if ((fields == 4) && !strcmp(type, "field"))
+			rmw->type = QSPI_RMW_FIELD;
+		else if ((fields == 4) && !strcmp(type, "mask"))
+			rmw->type = QSPI_RMW_MASK;
+		else
 		{
-			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
-
-			if (!ft4222_qspi_cmd_dump(ftHandle, qspi_addr, size%QSPI_CMD_READ_MAX))
-			{
-				printf("Failed to ft4222_qspi_cmd_dump.\n");
-				success = 0;
-				goto exit;
-			}
+			printf("QSPI modify op '%s' is not valid.\n", op);
+			success = 0;
+			goto exit;
 		}
-	}
-	else
-	{
-		qspi_addr = mem_addr;
 
-		if (!ft4222_qspi_cmd_dump(ftHandle, qspi_addr, size))
+		if ((rmw->addr % QSPI_DUMP_WORD) || (rmw->mask == 0))
 		{
-			printf("Failed to ft4222_qspi_cmd_dump.\n");
+			printf("QSPI modify op '%s' needs a word aligned address and non-zero mask.\n", op);
 			success = 0;
 			goto exit;
 		}
+		qspi_rmw_num++;
 	}
 exit:
-    return success;
+	return success;
 }
 
-static int ft4222_qspi_memory_write_word(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t mem_data)
+static uint32_t ft4222_qspi_rmw_apply(const struct qspi_rmw_op *rmw, uint32_t data)
 {
-	uint8_t  qspi_data[4]= {0};
-	qspi_data[0] = (mem_data >> 24) & 0xFF;
-	qspi_data[1] = (mem_data >> 16) & 0xFF;
-	qspi_data[2] = (mem_data >>  8) & 0xFF;
-	qspi_data[3] = (mem_data >>  0) & 0xFF;
-	return ft4222_qspi_memory_write(ftHandle, mem_addr, qspi_data, 4);
+	uint32_t shift = 0;
+
+	switch (rmw->type)
+	{
+		case QSPI_RMW_SET:
+			return data | rmw->mask;
+		case QSPI_RMW_CLR:
+			return data & ~rmw->mask;
+		case QSPI_RMW_FIELD:
+			while (!((rmw->mask >> shift) & 1))
+				shift++;
+			return (data & ~rmw->mask) | ((rmw->value << shift) & rmw->mask);
+		default:
+			return (data & ~rmw->mask) | (rmw->value & rmw->mask);
+	}
+}
+
+// Registers are read back in as few bursts as their layout allows,
+// every op is applied in command line order, and only the modified
+// words are written back, merged into the largest legal bursts.
+static int ft4222_qspi_memory_modify(FT_HANDLE ftHandle)
+{
+	int success = 1, i, j, k, first, last, words, nregs = 0, run, chunk;
+	uint32_t regs[QSPI_RMW_MAX], data[QSPI_CMD_READ_MAX/QSPI_DUMP_WORD];
+	uint8_t  dirty[QSPI_CMD_READ_MAX/QSPI_DUMP_WORD], raw[QSPI_CMD_READ_MAX];
+	unsigned long bursts = qspi_stats.read_burst + qspi_stats.write_burst;
+
+	for (i = 0; i < qspi_rmw_num; i++)
+		regs[i] = qspi_rmw_ops[i].addr;
+	qsort(regs, qspi_rmw_num, sizeof(uint32_t), ft4222_qspi_addr_cmp);
+
+	qspi_base_held = 1;
+	for (first = 0; first < qspi_rmw_num; first = last + 1)
+	{
+		// Extend the group while the registers stay adjacent and in one window
+		for (last = first; last + 1 < qspi_rmw_num; last++)
+		{
+			if (regs[last + 1] - regs[last] > QSPI_DUMP_WORD)
+				break;
+			if (regs[last + 1] - regs[first] >= QSPI_CMD_READ_MAX)
+				break;
+			if ((regs[last + 1]/QSPI_ACCESS_WINDOW) != (regs[first]/QSPI_ACCESS_WINDOW))
+				break;
+		}
+
+		words = (regs[last] - regs[first])/QSPI_DUMP_WORD + 1;
+		if (!ft4222_qspi_memory_read_exact(ftHandle, regs[first], raw, words * QSPI_DUMP_WORD))
+		{
+			printf("Failed to read registers at 0x%08x.\n", regs[first]);
+			success = 0;
+			goto exit;
+		}
+
+		for (j = 0; j < words; j++)
+		{
+			data[j]  = (raw[j*4] << 24) | (raw[j*4 + 1] << 16) | (raw[j*4 + 2] << 8) | raw[j*4 + 3];
+			dirty[j] = 0;
+		}
+
+		for (i = 0; i < qspi_rmw_num; i++)
+		{
+			if ((qspi_rmw_ops[i].addr < regs[first]) || (qspi_rmw_ops[i].addr > regs[last]))
+				continue;
+			j = (qspi_rmw_ops[i].addr - regs[first])/QSPI_DUMP_WORD;
+			data[j]  = ft4222_qspi_rmw_apply(&qspi_rmw_ops[i], data[j]);
+			dirty[j] = 1;
+		}
+
+		for (j = 0; j < words; j++)
+		{
+			raw[j*4]     = (data[j] >> 24) & 0xFF;
+			raw[j*4 + 1] = (data[j] >> 16) & 0xFF;
+			raw[j*4 + 2] = (data[j] >>  8) & 0xFF;
+			raw[j*4 + 3] = (data[j] >>  0) & 0xFF;
+		}
+
+		for (j = 0; j < words; j += run)
+		{
+			for (run = 0; (j + run < words) && dirty[j + run]; run++);
+			if (run == 0)
+			{
+				run = 1;
+				continue;
+			}
+
+			for (k = 0; k < run; k += chunk)
+			{
+				chunk = ft4222_qspi_burst_fit((run - k) * QSPI_DUMP_WORD)/QSPI_DUMP_WORD;
+				if (!ft4222_qspi_memory_write(ftHandle, regs[first] + (j + k) * QSPI_DUMP_WORD, raw + (j + k) * QSPI_DUMP_WORD, chunk * QSPI_DUMP_WORD))
+				{
+					printf("Failed to write registers at 0x%08x.\n", regs[first] + (j + k) * QSPI_DUMP_WORD);
+					success = 0;
+					goto exit;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < qspi_rmw_num; i++)
+		if ((i == 0) || (regs[i] != regs[i - 1]))
+			nregs++;
+	printf("Modified %d registers with %d ops in %lu bus bursts\n", nregs, qspi_rmw_num,
+		   qspi_stats.read_burst + qspi_stats.write_burst - bursts);
+exit:
+	qspi_base_held = 0;
+	return success;
 }
 
 static int ft4222_qspi_memory_write_string(FT_HANDLE ftHandle, uint32_t mem_addr, char *strbuf)
@@ -1309,189 +3121,3070 @@ static int ft4222_qspi_memory_write_scriptfile(FT_HANDLE ftHandle, uint32_t mem_
 exit:
     return success;
 }
+#endif
 
-static int ft4222_qspi_memory_write_binaryfile(FT_HANDLE ftHandle, uint32_t mem_addr, char *binary_file)
+static int ft4222_qspi_link_init(FT_HANDLE ft4222AHandle, FT4222_SPIClock ftQspiClk);
+
+#ifndef FT4222_QSPI_LIBRARY
+static int ft4222_qspi_adapt_set_div(FT_HANDLE ftHandle, int division)
 {
-    int success = 1, cmd_time = 0, max_cmd_times = 0, process_times = 0;
-	uint32_t qspi_addr = 0;
-	size_t filesize, malloc_len;
-	uint8_t *bufPtr = NULL;
-    FILE *fp_binary;
+	if (!ft4222_qspi_link_init(ftHandle, ft4222_convert_qspiclk(division)))
+		return 0;
 
-    fp_binary =fopen(binary_file,"rb");
-	if (!fp_binary)
+	qspi_division = division;
+	qspi_base_valid[qspi_target] = 0;
+	return 1;
+}
+
+// Multiplicative decrease: halve the burst first, then halve the clock
+static int ft4222_qspi_adapt_down(FT_HANDLE ftHandle)
+{
+	qspi_adapt_errors = 0;
+	qspi_adapt_clean  = 0;
+
+	if (qspi_burst_size > QSPI_ADAPT_MIN_BURST)
+		qspi_burst_size /= 2;
+	else if ((qspi_division < QSPI_ADAPT_MAX_DIV) && ft4222_qspi_adapt_set_div(ftHandle, qspi_division * 2))
+		;
+	else
+		return 0;
+
+	qspi_adapt_down++;
+	printf("QSPI adaptive: step down to %d bytes burst, div %d\n", qspi_burst_size, qspi_division);
+	return 1;
+}
+
+// Feed the result of every burst; after a clean run step back up one
+// notch, restoring the clock before the burst size.
+static void ft4222_qspi_adapt(FT_HANDLE ftHandle, int clean)
+{
+	if (!qspi_adaptive)
+		return;
+
+	if (!clean)
 	{
-		printf("cannot open file: %s \n",binary_file);
-		success = 0;
-		goto exit;
+		qspi_adapt_clean = 0;
+		if (++qspi_adapt_errors >= QSPI_ADAPT_ERRORS)
+			ft4222_qspi_adapt_down(ftHandle);
+		return;
 	}
 
-	filesize = get_file_size(binary_file);
-	malloc_len = ((filesize/QSPI_DUMP_WORD) + ((filesize%QSPI_DUMP_WORD) ? 1 : 0 )) * QSPI_DUMP_WORD;
-	bufPtr = malloc(malloc_len);
-	memset(bufPtr,0x0,malloc_len);
-	fread(bufPtr, sizeof(char), filesize, fp_binary);
-	fclose(fp_binary);
+	qspi_adapt_errors = 0;
+	if (++qspi_adapt_clean < QSPI_ADAPT_CLEAN)
+		return;
+	qspi_adapt_clean = 0;
 
-	max_cmd_times = (malloc_len/QSPI_CMD_WRITE_MAX);
-	process_times = ((malloc_len%QSPI_CMD_WRITE_MAX) != 0) ? (max_cmd_times + 1) : max_cmd_times ;
+	if ((qspi_division > qspi_division_min) && ft4222_qspi_adapt_set_div(ftHandle, qspi_division / 2))
+		qspi_adapt_up++;
+	else if (qspi_burst_size < QSPI_CMD_WRITE_MAX)
+	{
+		qspi_burst_size *= 2;
+		qspi_adapt_up++;
+	}
+	else
+		return;
 
-	//printf("%s filesize %d \n",binary_file,(int)filesize);
-	//printf("max_cmd_times %d \n",max_cmd_times);
-	//printf("process_times %d \n",process_times);
+	if (debug_printf == 't')
+		printf("QSPI adaptive: step up to %d bytes burst, div %d\n", qspi_burst_size, qspi_division);
+}
+#endif
 
-	if (max_cmd_times) {
-		for (cmd_time = 0; cmd_time < max_cmd_times; cmd_time++)
-		{
-			qspi_addr = mem_addr + (QSPI_CMD_WRITE_MAX * cmd_time);
+static int ft4222_qspi_link_sso(FT_HANDLE ft4222AHandle, FT4222_SPIClock ftQspiClk);
 
-			if (!ft4222_qspi_cmd_write(ftHandle, qspi_addr, bufPtr + (QSPI_CMD_WRITE_MAX * cmd_time), QSPI_CMD_WRITE_MAX , qspi_swapword))
-			{
-				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-				success = 0;
-				goto exit;
-			}
-			show_progress_bar((cmd_time*100)/process_times);
-			msleep(delay_cycle);
-		}
+// Route the following bursts to another chip select. The FT4222 only maps
+// slave selects at SPI master init, so a switch redoes that one call with
+// the new SSxO; wait cycles and drive strength stay as the link set them.
+// The target's base window state is kept per chip select.
+static int ft4222_qspi_select_target(FT_HANDLE ftHandle, int target)
+{
+	if ((target < 0) || (target >= QSPI_TARGET_MAX))
+	{
+		printf("QSPI target %d is not SS0O ~ SS%dO.\n", target, QSPI_TARGET_MAX - 1);
+		return 0;
+	}
 
-		if (malloc_len%QSPI_CMD_WRITE_MAX)
-		{
-			qspi_addr = mem_addr + (QSPI_CMD_WRITE_MAX * cmd_time);
+	if ((qspi_target != target) && !ft4222_qspi_combine_flush(ftHandle))
+		return 0;
 
-			if (!ft4222_qspi_cmd_write(ftHandle, qspi_addr, bufPtr + (QSPI_CMD_WRITE_MAX * cmd_time), malloc_len%QSPI_CMD_WRITE_MAX, qspi_swapword))
-			{
-				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-				success = 0;
-				goto exit;
-			}
-		}
-		show_progress_bar(100);
+	qspi_target = target;
+	if (qspi_target_active == target)
+		return 1;
+	if (qspi_target_active < 0)
+		return ft4222_qspi_link_init(ftHandle, ft4222_convert_qspiclk(qspi_division));
+
+	return ft4222_qspi_link_sso(ftHandle, ft4222_convert_qspiclk(qspi_division));
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+static uint64_t ft4222_qspi_hash_update(uint64_t hash, const uint8_t *buf, size_t len)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < len; cnt++)
+	{
+		hash ^= buf[cnt];
+		hash *= 0x100000001b3ULL;
 	}
-	else
+	return hash;
+}
+
+static uint64_t ft4222_qspi_hash(const uint8_t *buf, size_t len)
+{
+	return ft4222_qspi_hash_update(0xcbf29ce484222325ULL, buf, len);
+}
+
+static void ft4222_qspi_span_swap(uint8_t *buf, uint32_t len, int swap);
+
+// Does the target still hold the burst that ends at image offset done?
+// Compared in bus order, the image as -W swapped it on the way out.
+static int ft4222_qspi_journal_check(FT_HANDLE ftHandle, struct qspi_journal *journal, const uint8_t *bufPtr, size_t done)
+{
+	uint8_t expect[QSPI_CMD_WRITE_MAX], readback[QSPI_CMD_WRITE_MAX];
+	size_t boundary = ((done - 1)/QSPI_CMD_WRITE_MAX) * QSPI_CMD_WRITE_MAX;
+	uint32_t chunk = done - boundary, len = (chunk + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+
+	memset(expect, 0, len);
+	memcpy(expect, bufPtr + boundary, chunk);
+	ft4222_qspi_span_swap(expect, len, QSPI_W_SWAP_WORD);
+	if (ft4222_qspi_memory_read_exact(ftHandle, journal->mem_addr + boundary, readback, len) &&
+		!memcmp(readback, expect, len))
+		return 1;
+
+	printf("Block 0x%08x differs from the image.\n", journal->mem_addr + (uint32_t)boundary);
+	return 0;
+}
+
+// Reopen the journal of an interrupted load and find where to continue.
+// The last journaled burst is read back. If the target does not hold it,
+// the load steps back at most one journal interval; when that burst is
+// gone too the target lost the image and the load starts over.
+static int ft4222_qspi_journal_resume(FT_HANDLE ftHandle, struct qspi_journal *journal, const uint8_t *bufPtr, size_t *pdone)
+{
+	struct qspi_journal saved;
+	size_t interval = (size_t)qspi_journal_every * QSPI_CMD_WRITE_MAX;
+
+	if (pread(qspi_journal_fd, &saved, sizeof(saved), 0) != sizeof(saved))
 	{
-		qspi_addr = mem_addr;
+		printf("Journal %s is empty, loading from start.\n", qspi_journal_name);
+		return 1;
+	}
 
-		if (!ft4222_qspi_cmd_write(ftHandle, qspi_addr, bufPtr, malloc_len, qspi_swapword))
+	if ((saved.magic != journal->magic) || (saved.image_hash != journal->image_hash) ||
+		(saved.image_size != journal->image_size) || (saved.mem_addr != journal->mem_addr) ||
+		(saved.swap_word != journal->swap_word))
+	{
+		printf("Journal %s does not match this image, address or swap mode.\n", qspi_journal_name);
+		return 0;
+	}
+
+	// Re-establish the base window before trusting any read back
+	qspi_base_valid[qspi_target] = 0;
+	*pdone = saved.done;
+	if (*pdone && !ft4222_qspi_journal_check(ftHandle, journal, bufPtr, *pdone))
+	{
+		*pdone = (*pdone > interval) ? ((*pdone - interval)/QSPI_CMD_WRITE_MAX) * QSPI_CMD_WRITE_MAX : 0;
+		if (*pdone && !ft4222_qspi_journal_check(ftHandle, journal, bufPtr, *pdone))
 		{
-			printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-			success = 0;
-			goto exit;
+			printf("Target no longer holds the journaled image, loading from start.\n");
+			*pdone = 0;
 		}
 	}
 
-exit:
-    return success;
+	printf("Resuming at 0x%08x (%zu of %llu bytes done)\n", journal->mem_addr + (uint32_t)*pdone, *pdone,
+		   (unsigned long long)journal->image_size);
+	return 1;
 }
 
-static int ft4222_qspi_memory_write_binaryfile_verify(FT_HANDLE ftHandle, uint32_t mem_addr, char *binary_file)
+static void ft4222_qspi_journal_update(struct qspi_journal *journal, size_t done)
 {
-    int success = 1, cmd_time = 0, max_cmd_times = 0, process_times = 0 ,bcmpcmpsize = 0;
-	uint32_t qspi_addr = 0;
-	size_t filesize, malloc_len;
-	uint8_t *bufPtr = NULL, *readbufPtr = NULL;
-    FILE *fp_binary;
+	journal->done = done;
+	if (pwrite(qspi_journal_fd, journal, sizeof(*journal), 0) != sizeof(*journal))
+		printf("Failed to update journal %s: %s\n", qspi_journal_name, strerror(errno));
+}
 
-    fp_binary =fopen(binary_file,"rb");
-	if (!fp_binary)
+
+static void ft4222_qspi_spsc_init(struct qspi_spsc *ring, uint32_t slots)
+{
+	ring->mask = slots - 1;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+}
+
+static void ft4222_qspi_spsc_destroy(struct qspi_spsc *ring)
+{
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+}
+
+static int ft4222_qspi_spsc_full(struct qspi_spsc *ring)
+{
+	return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) > ring->mask;
+}
+
+static int ft4222_qspi_spsc_empty(struct qspi_spsc *ring)
+{
+	return (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail) &&
+		   !__atomic_load_n(&ring->eof, __ATOMIC_SEQ_CST);
+}
+
+// Sleep while still_waiting holds. The flag is raised before the last
+// check and the other side looks at it after its move, so one of the two
+// always sees the other; the timeout only bounds how late an abort is seen.
+static void ft4222_qspi_spsc_sleep(struct qspi_spsc *ring, int (*still_waiting)(struct qspi_spsc *))
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += QSPI_PIPE_WAIT_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
 	{
-		printf("cannot open file: %s \n",binary_file);
-		success = 0;
-		goto exit;
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
 	}
 
-	filesize = get_file_size(binary_file);
-	malloc_len = ((filesize/QSPI_DUMP_WORD) + ((filesize%QSPI_DUMP_WORD) ? 1 : 0 )) * QSPI_DUMP_WORD;
-	bufPtr = malloc(malloc_len);
-	memset(bufPtr,0x0,malloc_len);
-	fread(bufPtr, sizeof(char), filesize, fp_binary);
-	fclose(fp_binary);
+	pthread_mutex_lock(&ring->lock);
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (still_waiting(ring))
+		pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ring->lock);
+}
 
-	max_cmd_times = (malloc_len/QSPI_CMD_READ_MAX);
-	process_times = (malloc_len%QSPI_CMD_READ_MAX) ? (max_cmd_times + 1) : max_cmd_times;
+static void ft4222_qspi_spsc_wake(struct qspi_spsc *ring)
+{
+	if (!__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
 
-	readbufPtr = malloc(process_times*QSPI_CMD_READ_MAX);
-	memset(readbufPtr,0x0,(process_times*QSPI_CMD_READ_MAX));
+static int ft4222_qspi_spsc_wait_room(struct qspi_spsc *ring, int *abort)
+{
+	int spin = 0;
 
-	if (max_cmd_times) {
-		for (cmd_time = 0; cmd_time < max_cmd_times; cmd_time++)
+	while (ft4222_qspi_spsc_full(ring))
+	{
+		if (__atomic_load_n(abort, __ATOMIC_RELAXED))
+			return 0;
+		if (spin++ < QSPI_PIPE_SPIN)
+			sched_yield();
+		else
+			ft4222_qspi_spsc_sleep(ring, ft4222_qspi_spsc_full);
+	}
+	return 1;
+}
+
+static void ft4222_qspi_spsc_push(struct qspi_spsc *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+	ft4222_qspi_spsc_wake(ring);
+}
+
+// 1 once the slot at tail holds data, 0 when the producer is done or the
+// pipeline was aborted
+static int ft4222_qspi_spsc_wait_data(struct qspi_spsc *ring, int *abort)
+{
+	int spin = 0;
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+	{
+		if (__atomic_load_n(&ring->eof, __ATOMIC_ACQUIRE))
+			return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail;
+		if (__atomic_load_n(abort, __ATOMIC_RELAXED))
+			return 0;
+		if (spin++ < QSPI_PIPE_SPIN)
+			sched_yield();
+		else
+			ft4222_qspi_spsc_sleep(ring, ft4222_qspi_spsc_empty);
+	}
+	return 1;
+}
+
+static void ft4222_qspi_spsc_pop(struct qspi_spsc *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+	ft4222_qspi_spsc_wake(ring);
+}
+
+static void ft4222_qspi_spsc_close(struct qspi_spsc *ring)
+{
+	__atomic_store_n(&ring->eof, 1, __ATOMIC_SEQ_CST);
+	ft4222_qspi_spsc_wake(ring);
+}
+
+// Fill whole blocks from the image; only the last one comes up short. A
+// stream hands over whole bursts as soon as they arrive and carries the
+// remainder into the next block.
+static void *ft4222_qspi_pipe_reader(void *arg)
+{
+	struct qspi_pipe *pipe = arg;
+	struct qspi_pipe_block *block;
+	uint8_t carry[QSPI_BURST_MAX];
+	uint32_t carry_len = 0;
+	ssize_t ret;
+	int eof = 0;
+
+	while (!eof)
+	{
+		if (!ft4222_qspi_spsc_wait_room(&pipe->block_ring, &pipe->abort))
+			break;
+
+		block = &pipe->blocks[pipe->block_ring.head & pipe->block_ring.mask];
+		if (pipe->fill)
 		{
-			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
+			block->len = ((pipe->size - pipe->total) < QSPI_PIPE_BLOCK) ? (pipe->size - pipe->total) : QSPI_PIPE_BLOCK;
+			pipe->fill(pipe->arg, block->data, pipe->mem_addr + pipe->start + pipe->total, block->len);
+			pipe->total += block->len;
+			eof = (pipe->total == pipe->size);
+			if (block->len)
+				ft4222_qspi_spsc_push(&pipe->block_ring);
+			continue;
+		}
 
-			if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr + (QSPI_CMD_READ_MAX * cmd_time), QSPI_CMD_READ_MAX , qspi_swapword))
+		memcpy(block->data, carry, carry_len);
+		block->len = carry_len;
+		carry_len = 0;
+		while (block->len < QSPI_PIPE_BLOCK)
+		{
+			ret = read(pipe->fd, block->data + block->len, QSPI_PIPE_BLOCK - block->len);
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			if (ret < 0)
 			{
-				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-				success = 0;
+				printf("Failed to read image: %s\n", strerror(errno));
+				pipe->error = 1;
+				__atomic_store_n(&pipe->abort, 1, __ATOMIC_RELAXED);
 				goto exit;
 			}
-			show_progress_bar((cmd_time*100)/process_times);
+			if (ret == 0)
+			{
+				eof = 1;
+				break;
+			}
+			block->len += ret;
+			pipe->total += ret;
+			if (pipe->stream && (block->len >= pipe->burst))
+				break;
 		}
 
-		if (malloc_len%QSPI_CMD_READ_MAX)
+		if (pipe->stream && !eof)
 		{
-			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
-
-			if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr + (QSPI_CMD_READ_MAX * cmd_time), malloc_len%QSPI_CMD_READ_MAX, qspi_swapword))
-			{
-				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-				success = 0;
-				goto exit;
-			}
+			carry_len = block->len % pipe->burst;
+			block->len -= carry_len;
+			memcpy(carry, block->data + block->len, carry_len);
 		}
-		show_progress_bar(100);
+		if (block->len)
+			ft4222_qspi_spsc_push(&pipe->block_ring);
 	}
-	else
+
+exit:
+	ft4222_qspi_spsc_close(&pipe->block_ring);
+	return NULL;
+}
+
+// Pad, swap and cut blocks into ready-to-send frames that never cross a
+// 32MB window
+static void *ft4222_qspi_pipe_transform(void *arg)
+{
+	struct qspi_pipe *pipe = arg;
+	struct qspi_pipe_block *block;
+	struct qspi_pipe_frame *frame;
+	size_t pos = pipe->start;
+	uint32_t len, off, chunk, addr, cnt;
+
+	while (ft4222_qspi_spsc_wait_data(&pipe->block_ring, &pipe->abort))
 	{
-		qspi_addr = mem_addr;
+		block = &pipe->blocks[pipe->block_ring.tail & pipe->block_ring.mask];
+		len = (block->len + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+		memset(block->data + block->len, 0, len - block->len);
 
-		if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr, malloc_len, qspi_swapword))
+		for (off = 0; off < len; off += chunk)
 		{
-			printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
-			success = 0;
-			goto exit;
+			addr = pipe->mem_addr + pos + off;
+			chunk = len - off;
+			if (chunk > pipe->burst)
+				chunk = pipe->burst;
+			if (chunk > QSPI_ACCESS_WINDOW - (addr % QSPI_ACCESS_WINDOW))
+				chunk = QSPI_ACCESS_WINDOW - (addr % QSPI_ACCESS_WINDOW);
+			chunk = ft4222_qspi_burst_fit(chunk);
+
+			if (!ft4222_qspi_spsc_wait_room(&pipe->frame_ring, &pipe->abort))
+				goto exit;
+
+			frame = &pipe->frames[pipe->frame_ring.head & pipe->frame_ring.mask];
+			frame->mem_addr = addr;
+			frame->len = chunk;
+			frame->end = pos + off + chunk;
+			ft4222_qspi_write_build(frame->buf, addr % QSPI_ACCESS_WINDOW, block->data + off, chunk);
+			if (qspi_swapword & QSPI_W_SWAP_WORD)
+				for (cnt = QSPI_FRAME_HDR; cnt < QSPI_FRAME_HDR + chunk; cnt += QSPI_DUMP_WORD)
+					*((uint32_t *)(frame->buf + cnt)) = swapLong(*((uint32_t *)(frame->buf + cnt)));
+			ft4222_qspi_spsc_push(&pipe->frame_ring);
 		}
+
+		pos += len;
+		ft4222_qspi_spsc_pop(&pipe->block_ring);
 	}
 
-	bcmpcmpsize = bcmp(bufPtr,readbufPtr,filesize);
+exit:
+	ft4222_qspi_spsc_close(&pipe->frame_ring);
+	return NULL;
+}
 
-	if (bcmpcmpsize != 0)
+static int ft4222_qspi_pipe_send(FT_HANDLE ftHandle, struct qspi_pipe_frame *frame)
+{
+	uint32_t off, chunk;
+
+	if (frame->len <= qspi_burst_size)
+		return ft4222_qspi_write_frame(ftHandle, frame->mem_addr, frame->buf, frame->len);
+
+	// -A stepped the burst size down after this frame was built
+	for (off = 0; off < frame->len; off += chunk)
 	{
-		printf("%s: bcmp %dbytes are different\n",__func__, (bcmpcmpsize < 0) ? (-bcmpcmpsize) : bcmpcmpsize);
-		printf("Verify: NK\n");
-		success = 0;
-		goto exit;
+		chunk = ft4222_qspi_burst_fit(((frame->len - off) < qspi_burst_size) ? (frame->len - off) : qspi_burst_size);
+		if (!ft4222_qspi_memory_write_bus(ftHandle, frame->mem_addr + off, frame->buf + QSPI_FRAME_HDR + off, chunk))
+			return 0;
 	}
-	printf("Verify: OK\n");
-exit:
-	if (bufPtr != NULL)
-		free(bufPtr);
-	if (readbufPtr != NULL)
-		free(readbufPtr);
-    return success;
+	return 1;
 }
 
-int main(int argc, char **argv)
+// Send up to qspi_posted frames from the ring tail back to back and check
+// the write status once for the batch. The frames stay in the ring until
+// the batch is confirmed, so on failure *presend of them are sent again one
+// checked burst at a time. Returns the number of frames confirmed.
+static uint32_t ft4222_qspi_pipe_post(FT_HANDLE ftHandle, struct qspi_pipe *pipe, uint32_t *presend)
 {
-   int division = QSPI_DEFAULT_DIV,write_op = 0, read_op = 0,
-       addr_set = 0, data_set = 0, show_base = 0,
-	   show_ft4222_ver = 0, dump_show = 0, dump_size = 0,
-	   string_send = 0, script_send = 0, binary_send = 0,
-	   i = 0, retCode = 0, found4222 = 0, ioVoltage_set = 0, verify_set = 0,
-	   next_option;  /* getopt iteration var */
-   double                    ft4222IOVoltage = 1.8;
-   FT_STATUS                 ftStatus;
-   FT4222_STATUS             ft4222Status;
-   FT_HANDLE                 ft4222AHandle = (FT_HANDLE)NULL;
-   FT_HANDLE                 ft4222BHandle = (FT_HANDLE)NULL;
+	struct qspi_spsc *ring = &pipe->frame_ring;
+	struct qspi_pipe_frame *frame = &pipe->frames[ring->tail & ring->mask];
+	uint32_t window = frame->mem_addr / QSPI_ACCESS_WINDOW, count, i;
+
+	*presend = 1;
+	if ((frame->len > qspi_burst_size) || !ft4222_qspi_check_base(ftHandle, frame->mem_addr))
+		return 0;
+
+	// Stop at a window change, a frame -A has to split, or the end of what
+	// the frame builder has ready
+	for (count = 0; count < (uint32_t)qspi_posted; count++)
+	{
+		if (count && (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail + count))
+			break;
+		frame = &pipe->frames[(ring->tail + count) & ring->mask];
+		if ((frame->len > qspi_burst_size) || (frame->mem_addr / QSPI_ACCESS_WINDOW != window))
+			break;
+		if (!ft4222_qspi_write_send(ftHandle, frame->buf, frame->len))
+		{
+			count++;
+			goto fail;
+		}
+	}
+
+	// Each posted burst queues its own ready edge
+	msleep(delay_cycle);
+	if (!ft4222_qspi_write_complete(ftHandle, count))
+		goto fail;
+
+	for (i = 0; i < count; i++)
+	{
+		frame = &pipe->frames[(ring->tail + i) & ring->mask];
+		ft4222_qspi_cache_write(frame->mem_addr, frame->buf + QSPI_FRAME_HDR, frame->len);
+	}
+	*presend = 0;
+	qspi_stats.posted_batch++;
+	return count;
+
+fail:
+	frame = &pipe->frames[ring->tail & ring->mask];
+	printf("Posted batch of %u bursts at 0x%08x failed, re-sending with status checks.\n", count, frame->mem_addr);
+	ft4222_qspi_recover(ftHandle, frame->mem_addr, 0);
+	qspi_stats.posted_fail++;
+	*presend = count;
+	return 0;
+}
+
+static struct qspi_pipe *ft4222_qspi_pipe_alloc(uint32_t mem_addr, size_t start)
+{
+	struct qspi_pipe *pipe;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (pipe == NULL)
+	{
+		printf("Allocation failure.\n");
+		return NULL;
+	}
+
+	ft4222_qspi_spsc_init(&pipe->block_ring, QSPI_PIPE_BLOCKS);
+	ft4222_qspi_spsc_init(&pipe->frame_ring, QSPI_PIPE_FRAMES);
+	pipe->fd = -1;
+	pipe->mem_addr = mem_addr;
+	pipe->start = start;
+	pipe->burst = qspi_burst_size;
+	return pipe;
+}
+
+static void ft4222_qspi_pipe_free(struct qspi_pipe *pipe)
+{
+	ft4222_qspi_spsc_destroy(&pipe->block_ring);
+	ft4222_qspi_spsc_destroy(&pipe->frame_ring);
+	free(pipe);
+}
+
+// Run a prepared pipeline to the end and free it. size is the padded image
+// size for progress, 0 for a stream of unknown length. *pdone tracks the
+// image offset confirmed on the target, *ptotal returns the bytes taken
+// from the source.
+static int ft4222_qspi_pipe_run(FT_HANDLE ftHandle, struct qspi_pipe *pipe, size_t size, size_t *pdone,
+								struct qspi_journal *journal, size_t *ptotal)
+{
+	struct qspi_pipe_frame *frame;
+	pthread_t reader, transform;
+	uint32_t bursts = 0, sent, resend = 0;
+	unsigned long recovery;
+	int success = 1, started = 0, percent = -1;
+
+	// Frames go straight to the bus, so earlier combined writes go first
+	if (!ft4222_qspi_combine_flush(ftHandle))
+	{
+		ft4222_qspi_pipe_free(pipe);
+		return 0;
+	}
+
+	if (pthread_create(&reader, NULL, ft4222_qspi_pipe_reader, pipe))
+	{
+		printf("Failed to start the image reader.\n");
+		ft4222_qspi_pipe_free(pipe);
+		return 0;
+	}
+	started++;
+	if (pthread_create(&transform, NULL, ft4222_qspi_pipe_transform, pipe))
+	{
+		printf("Failed to start the frame builder.\n");
+		success = 0;
+		goto exit;
+	}
+	started++;
+
+	while (ft4222_qspi_spsc_wait_data(&pipe->frame_ring, &pipe->abort))
+	{
+		frame = &pipe->frames[pipe->frame_ring.tail & pipe->frame_ring.mask];
+		recovery = qspi_stats.recovery;
+
+		if ((qspi_posted > 1) && !resend)
+		{
+			sent = ft4222_qspi_pipe_post(ftHandle, pipe, &resend);
+			if (!sent)
+				continue;
+		}
+		else
+		{
+			if (!ft4222_qspi_pipe_send(ftHandle, frame))
+			{
+				// Out of retries: degrade the link and send the frame again
+				if (qspi_adaptive && ft4222_qspi_adapt_down(ftHandle))
+					continue;
+				printf("%s line%d:Failed to write frame at address 0x%08x.\n",__func__,__LINE__,frame->mem_addr);
+				success = 0;
+				goto exit;
+			}
+			sent = 1;
+			if (resend)
+				resend--;
+		}
+		ft4222_qspi_adapt(ftHandle, recovery == qspi_stats.recovery);
+
+		for (; sent; sent--)
+		{
+			frame = &pipe->frames[pipe->frame_ring.tail & pipe->frame_ring.mask];
+			*pdone = frame->end;
+			ft4222_qspi_spsc_pop(&pipe->frame_ring);
+
+			if ((qspi_journal_fd >= 0) && !(++bursts % qspi_journal_every))
+				ft4222_qspi_journal_update(journal, *pdone);
+		}
+
+		if (size > QSPI_CMD_WRITE_MAX)
+		{
+			if ((int)(((uint64_t)*pdone*100)/size) != percent)
+			{
+				percent = (int)(((uint64_t)*pdone*100)/size);
+				show_progress_bar(percent);
+			}
+			msleep(delay_cycle);
+		}
+	}
+
+exit:
+	__atomic_store_n(&pipe->abort, 1, __ATOMIC_RELAXED);
+	if (started > 1)
+		pthread_join(transform, NULL);
+	pthread_join(reader, NULL);
+	if (pipe->error)
+		success = 0;
+	if (ptotal)
+		*ptotal = pipe->total;
+	ft4222_qspi_pipe_free(pipe);
+	return success;
+}
+
+// Stream the image from fd, starting at image offset *pdone, through the
+// pipeline.
+static int ft4222_qspi_pipe_load(FT_HANDLE ftHandle, int fd, uint32_t mem_addr, size_t size, size_t *pdone,
+								 struct qspi_journal *journal, size_t *ptotal)
+{
+	struct qspi_pipe *pipe;
+
+	pipe = ft4222_qspi_pipe_alloc(mem_addr, *pdone);
+	if (pipe == NULL)
+		return 0;
+
+	pipe->fd = fd;
+	pipe->stream = (size == 0);
+	return ft4222_qspi_pipe_run(ftHandle, pipe, size, pdone, journal, ptotal);
+}
+
+static int ft4222_qspi_memory_write_stdin(FT_HANDLE ftHandle, uint32_t mem_addr)
+{
+	size_t done = 0, total = 0;
+	uint64_t start_us, elapsed_us;
+	int success;
+
+	start_us = qspi_time_us();
+	success = ft4222_qspi_pipe_load(ftHandle, STDIN_FILENO, mem_addr, 0, &done, NULL, &total);
+	elapsed_us = qspi_time_us() - start_us;
+	if (elapsed_us == 0)
+		elapsed_us = 1;
+
+	printf("%s %zu bytes from stdin to 0x%08x in %.3f s (%.1f KB/s)\n", success ? "Loaded" : "Stopped after",
+		   success ? total : done, mem_addr, elapsed_us / 1000000.0,
+		   (success ? total : done) * 1000000.0 / 1024 / elapsed_us);
+	return success;
+}
+
+static uint32_t ft4222_qspi_memtest_walk1(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	return 1U << ((addr / QSPI_DUMP_WORD) % 32);
+}
+
+static uint32_t ft4222_qspi_memtest_walk0(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	return ~(1U << ((addr / QSPI_DUMP_WORD) % 32));
+}
+
+static uint32_t ft4222_qspi_memtest_addr(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	return ctx->pass ? ~addr : addr;
+}
+
+static uint32_t ft4222_qspi_memtest_checker(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	return (((addr / QSPI_DUMP_WORD) ^ ctx->pass) & 1) ? 0xAAAAAAAA : 0x55555555;
+}
+
+// Hash of the address, so any block can be generated or checked on its own
+static uint32_t ft4222_qspi_memtest_random(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	uint32_t x = addr ^ ctx->seed;
+
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+// March C- background: pass selects all zeros or all ones
+static uint32_t ft4222_qspi_memtest_march(const struct qspi_memtest_ctx *ctx, uint32_t addr)
+{
+	return ctx->pass ? 0xFFFFFFFF : 0;
+}
+
+static const struct qspi_memtest qspi_memtests[] = {
+	{"walk1",   1, ft4222_qspi_memtest_walk1},
+	{"walk0",   1, ft4222_qspi_memtest_walk0},
+	{"addr",    2, ft4222_qspi_memtest_addr},
+	{"checker", 2, ft4222_qspi_memtest_checker},
+	{"random",  1, ft4222_qspi_memtest_random},
+	{"march",   1, ft4222_qspi_memtest_march},
+};
+
+// -u <pattern[,pattern...]>, random takes =<seed>, all runs every pattern
+static int ft4222_qspi_memtest_add(char *list)
+{
+	char *tok, *saveptr = NULL, *seed;
+	int i, all;
+
+	for (tok = strtok_r(list, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr))
+	{
+		seed = strchr(tok, '=');
+		if (seed)
+			*seed++ = '\0';
+		all = !strcmp(tok, "all");
+
+		for (i = 0; i < (int)(sizeof(qspi_memtests)/sizeof(qspi_memtests[0])); i++)
+		{
+			if (!all && strcmp(tok, qspi_memtests[i].name))
+				continue;
+			if (qspi_memtest_num >= QSPI_MEMTEST_MAX)
+			{
+				printf("QSPI memtest pattern number exceed max %d.\n", QSPI_MEMTEST_MAX);
+				return 0;
+			}
+			memset(&qspi_memtest_runs[qspi_memtest_num], 0, sizeof(qspi_memtest_runs[0]));
+			qspi_memtest_runs[qspi_memtest_num].test = &qspi_memtests[i];
+			qspi_memtest_runs[qspi_memtest_num++].seed = seed ? strtoul(seed, NULL, 0) : (uint32_t)time(NULL);
+			if (!all)
+				break;
+		}
+		if (!all && (i == (int)(sizeof(qspi_memtests)/sizeof(qspi_memtests[0]))))
+		{
+			printf("QSPI memtest pattern '%s' is not walk1/walk0/addr/checker/random/march/all.\n", tok);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Pattern words in bus byte order, for the pipeline or for comparing
+static void ft4222_qspi_memtest_fill(void *arg, uint8_t *buf, uint32_t mem_addr, uint32_t len)
+{
+	const struct qspi_memtest_ctx *ctx = arg;
+	uint32_t off, data;
+
+	for (off = 0; off < len; off += QSPI_DUMP_WORD)
+	{
+		data = ctx->test->value(ctx, mem_addr + off);
+		buf[off]     = (data >> 24) & 0xFF;
+		buf[off + 1] = (data >> 16) & 0xFF;
+		buf[off + 2] = (data >>  8) & 0xFF;
+		buf[off + 3] = (data >>  0) & 0xFF;
+	}
+}
+
+static void ft4222_qspi_memtest_compare(struct qspi_memtest_ctx *ctx, uint32_t mem_addr, const uint8_t *raw, uint32_t len)
+{
+	uint8_t expect[QSPI_CMD_READ_MAX];
+	uint32_t off, want, got;
+
+	ft4222_qspi_memtest_fill(ctx, expect, mem_addr, len);
+	if (!memcmp(expect, raw, len))
+		return;
+
+	for (off = 0; off < len; off += QSPI_DUMP_WORD)
+	{
+		want = (expect[off] << 24) | (expect[off + 1] << 16) | (expect[off + 2] << 8) | expect[off + 3];
+		got  = (raw[off] << 24) | (raw[off + 1] << 16) | (raw[off + 2] << 8) | raw[off + 3];
+		if (want == got)
+			continue;
+		if (ctx->errors++ < QSPI_MEMTEST_REPORT)
+			printf("  %08x : wrote %08x read %08x bits %08x\n", mem_addr + off, want, got, want ^ got);
+		ctx->bits |= want ^ got;
+	}
+}
+
+// Largest read or write burst at pos that stays in the range and, going up
+// or down, in one window
+static uint32_t ft4222_qspi_memtest_chunk(uint32_t mem_addr, uint32_t size, uint32_t pos, int down)
+{
+	uint32_t left = down ? pos : (size - pos), addr, chunk;
+
+	chunk = ft4222_qspi_burst_fit((left < QSPI_CMD_READ_MAX) ? left : QSPI_CMD_READ_MAX);
+	addr = mem_addr + (down ? (pos - chunk) : pos);
+	if ((addr % QSPI_ACCESS_WINDOW) + chunk > QSPI_ACCESS_WINDOW)
+		chunk = down ? ft4222_qspi_burst_fit((mem_addr + pos) % QSPI_ACCESS_WINDOW)
+					 : ft4222_qspi_burst_fit(QSPI_ACCESS_WINDOW - (addr % QSPI_ACCESS_WINDOW));
+	return chunk;
+}
+
+// One march element over the range, burst by burst: read and check the
+// old background when check is set, then write the new one when write is
+static int ft4222_qspi_memtest_element(FT_HANDLE ftHandle, struct qspi_memtest_ctx *ctx, uint32_t mem_addr,
+									   uint32_t size, int down, int check, int write)
+{
+	uint8_t raw[QSPI_CMD_READ_MAX], frame[QSPI_FRAME_HDR + QSPI_BURST_MAX];
+	uint32_t pos, chunk, addr;
+	int old = ctx->pass;
+
+	for (pos = down ? size : 0; down ? (pos > 0) : (pos < size); pos = down ? (pos - chunk) : (pos + chunk))
+	{
+		chunk = ft4222_qspi_memtest_chunk(mem_addr, size, pos, down);
+		addr = mem_addr + (down ? (pos - chunk) : pos);
+
+		if (check)
+		{
+			if (!ft4222_qspi_memory_read_bus(ftHandle, addr, raw, chunk))
+			{
+				printf("Failed to read memtest burst at 0x%08x.\n", addr);
+				return 0;
+			}
+			ft4222_qspi_memtest_compare(ctx, addr, raw, chunk);
+		}
+		if (write)
+		{
+			ctx->pass = !old;
+			ft4222_qspi_memtest_fill(ctx, raw, addr, chunk);
+			ctx->pass = old;
+			ft4222_qspi_write_build(frame, addr % QSPI_ACCESS_WINDOW, raw, chunk);
+			if (!ft4222_qspi_write_frame(ftHandle, addr, frame, chunk))
+			{
+				printf("Failed to write memtest burst at 0x%08x.\n", addr);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int ft4222_qspi_memtest_write(FT_HANDLE ftHandle, struct qspi_memtest_ctx *ctx, uint32_t mem_addr,
+									 uint32_t size)
+{
+	struct qspi_pipe *pipe;
+	size_t done = 0;
+
+	pipe = ft4222_qspi_pipe_alloc(mem_addr, 0);
+	if (pipe == NULL)
+		return 0;
+
+	pipe->fill = ft4222_qspi_memtest_fill;
+	pipe->arg = ctx;
+	pipe->size = size;
+	return ft4222_qspi_pipe_run(ftHandle, pipe, size, &done, NULL, NULL);
+}
+
+static int ft4222_qspi_memtest_verify(FT_HANDLE ftHandle, struct qspi_memtest_ctx *ctx, uint32_t mem_addr,
+									  uint32_t size)
+{
+	uint8_t raw[QSPI_CMD_READ_MAX];
+	uint32_t pos, chunk;
+	int percent = -1;
+
+	for (pos = 0; pos < size; pos += chunk)
+	{
+		chunk = ft4222_qspi_memtest_chunk(mem_addr, size, pos, 0);
+		if (!ft4222_qspi_memory_read_bus(ftHandle, mem_addr + pos, raw, chunk))
+		{
+			printf("Failed to read memtest burst at 0x%08x.\n", mem_addr + pos);
+			return 0;
+		}
+		ft4222_qspi_memtest_compare(ctx, mem_addr + pos, raw, chunk);
+
+		if ((size > QSPI_CMD_READ_MAX) && ((int)(((uint64_t)pos*100)/size) != percent))
+		{
+			percent = (int)(((uint64_t)pos*100)/size);
+			show_progress_bar(percent);
+		}
+	}
+	return 1;
+}
+
+// Run the -u patterns over [mem_addr, mem_addr + size). Data is generated
+// in bus byte order with -W swaps off, so every pattern reaches the cells
+// as written. Fill patterns stream through the -B pipeline and are read
+// back in full bursts; March C- runs its read-then-write elements burst by
+// burst in the element's address order.
+static int ft4222_qspi_memory_test(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t size)
+{
+	struct qspi_memtest_ctx *ctx;
+	int success = 1, i, saved_swap = qspi_swapword;
+	unsigned long errors = 0;
+	uint64_t start_us, write_us, read_us;
+
+	if ((mem_addr | size) % QSPI_DUMP_WORD)
+	{
+		printf("Memtest range 0x%08x+0x%x is not word aligned.\n", mem_addr, size);
+		return 0;
+	}
+
+	qspi_swapword = 0;
+	for (i = 0; success && (i < qspi_memtest_num); i++)
+	{
+		ctx = &qspi_memtest_runs[i];
+		if (ctx->test->value == ft4222_qspi_memtest_random)
+			printf("memtest %s (seed 0x%08x) 0x%08x~0x%08x\n", ctx->test->name, ctx->seed, mem_addr, mem_addr + size - 1);
+		else
+			printf("memtest %s 0x%08x~0x%08x\n", ctx->test->name, mem_addr, mem_addr + size - 1);
+
+		write_us = read_us = 0;
+		for (ctx->pass = 0; success && (ctx->pass < ctx->test->passes); ctx->pass++)
+		{
+			start_us = qspi_time_us();
+			success = ft4222_qspi_memtest_write(ftHandle, ctx, mem_addr, size);
+			write_us += qspi_time_us() - start_us;
+			if (!success)
+				break;
+
+			start_us = qspi_time_us();
+			qspi_base_held = 1;
+			if (ctx->test->value == ft4222_qspi_memtest_march)
+			{
+				// up(r0,w1) up(r1,w0) down(r0,w1) down(r1,w0) up(r0)
+				success = ft4222_qspi_memtest_element(ftHandle, ctx, mem_addr, size, 0, 1, 1);
+				ctx->pass = 1;
+				success = success && ft4222_qspi_memtest_element(ftHandle, ctx, mem_addr, size, 0, 1, 1);
+				ctx->pass = 0;
+				success = success && ft4222_qspi_memtest_element(ftHandle, ctx, mem_addr, size, 1, 1, 1);
+				ctx->pass = 1;
+				success = success && ft4222_qspi_memtest_element(ftHandle, ctx, mem_addr, size, 1, 1, 1);
+				ctx->pass = 0;
+			}
+			success = success && ft4222_qspi_memtest_verify(ftHandle, ctx, mem_addr, size);
+			qspi_base_held = 0;
+			read_us += qspi_time_us() - start_us;
+		}
+
+		if (ctx->errors > QSPI_MEMTEST_REPORT)
+			printf("  ... %lu more\n", ctx->errors - QSPI_MEMTEST_REPORT);
+		printf("memtest %s: %s, %lu errors, failing bits %08x, write %.1f KB/s, %s %.1f KB/s\n",
+			   ctx->test->name, success ? (ctx->errors ? "FAIL" : "pass") : "aborted", ctx->errors, ctx->bits,
+			   (double)size * ctx->test->passes * 1000000 / 1024 / (write_us ? write_us : 1),
+			   (ctx->test->value == ft4222_qspi_memtest_march) ? "march" : "read",
+			   (double)size * ctx->test->passes * 1000000 / 1024 / (read_us ? read_us : 1));
+		errors += ctx->errors;
+	}
+	qspi_swapword = saved_swap;
+
+	return success && !errors;
+}
+
+static int ft4222_qspi_memory_write_binaryfile(FT_HANDLE ftHandle, uint32_t mem_addr, char *binary_file)
+{
+    int success = 1, fd = -1;
+	size_t filesize, malloc_len, done = 0;
+	uint8_t *mapPtr = NULL, pad[QSPI_DUMP_WORD] = {0};
+	struct qspi_journal journal;
+
+	fd = open(binary_file, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("cannot open file: %s \n",binary_file);
+		success = 0;
+		goto exit;
+	}
+
+	filesize = get_file_size(binary_file);
+	malloc_len = ((filesize/QSPI_DUMP_WORD) + ((filesize%QSPI_DUMP_WORD) ? 1 : 0 )) * QSPI_DUMP_WORD;
+	if (filesize == 0)
+		goto exit;
+
+	if (qspi_journal_name != NULL)
+	{
+		// The journal identifies the image by its hash, so map it once up front
+		mapPtr = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapPtr == MAP_FAILED)
+		{
+			mapPtr = NULL;
+			printf("cannot map file: %s \n",binary_file);
+			success = 0;
+			goto exit;
+		}
+
+		qspi_journal_fd = open(qspi_journal_name, O_RDWR | O_CREAT, 0644);
+		if (qspi_journal_fd < 0)
+		{
+			printf("cannot open journal: %s \n",qspi_journal_name);
+			success = 0;
+			goto exit;
+		}
+
+		memset(&journal, 0, sizeof(journal));
+		journal.magic      = QSPI_JOURNAL_MAGIC;
+		journal.image_hash = ft4222_qspi_hash_update(ft4222_qspi_hash(mapPtr, filesize), pad, malloc_len - filesize);
+		journal.image_size = malloc_len;
+		journal.mem_addr   = mem_addr;
+		journal.swap_word  = qspi_swapword;
+
+		if (qspi_resume && !ft4222_qspi_journal_resume(ftHandle, &journal, mapPtr, &done))
+		{
+			close(qspi_journal_fd);
+			qspi_journal_fd = -1;
+			success = 0;
+			goto exit;
+		}
+		ft4222_qspi_journal_update(&journal, done);
+	}
+
+	if (lseek(fd, done, SEEK_SET) != (off_t)done)
+	{
+		printf("cannot seek file: %s \n",binary_file);
+		success = 0;
+		goto exit;
+	}
+	posix_fadvise(fd, done, 0, POSIX_FADV_SEQUENTIAL);
+
+	success = ft4222_qspi_pipe_load(ftHandle, fd, mem_addr, malloc_len, &done, &journal, NULL);
+	if (!success)
+		goto exit;
+	if (malloc_len > QSPI_CMD_WRITE_MAX)
+		show_progress_bar(100);
+
+	if (qspi_adaptive)
+		printf("QSPI adaptive: final %d bytes burst, div %d (%d Hz), %d step downs, %d step ups\n",
+			   qspi_burst_size, qspi_division, QSPI_SYS_CLK/qspi_division, qspi_adapt_down, qspi_adapt_up);
+
+	// The whole image is on the target, nothing left to resume
+	if (qspi_journal_fd >= 0)
+		unlink(qspi_journal_name);
+
+exit:
+	if (qspi_journal_fd >= 0)
+	{
+		// Keep the last acknowledged extent for --resume
+		if (!success)
+			ft4222_qspi_journal_update(&journal, done);
+		close(qspi_journal_fd);
+		qspi_journal_fd = -1;
+	}
+	if (mapPtr != NULL)
+		munmap(mapPtr, filesize);
+	if (fd >= 0)
+		close(fd);
+    return success;
+}
+
+// Load one image into several targets, a stripe of QSPI_MULTI_STRIPE
+// bytes per target at a time, so the chip select only moves once per
+// stripe. The last burst of each stripe is left unconfirmed and its
+// write status is only collected when the target's next turn comes, so
+// the bridge's busy time is spent moving data for the others. Every
+// other round walks the targets backwards, so a round starts on the
+// chip select the last one ended on and costs one switch less.
+static int ft4222_qspi_memory_write_binaryfile_multi(FT_HANDLE ftHandle, uint32_t mem_addr, char *binary_file,
+													 const int *targets, int target_num)
+{
+    int success = 1, t, i, round = 0, saved_target = qspi_target;
+	uint32_t pend_off[QSPI_TARGET_MAX], pend_len[QSPI_TARGET_MAX] = {0};
+	uint32_t qspi_addr, chunk, stripe, off, cnt;
+	size_t filesize, malloc_len, done;
+	uint8_t *bufPtr = NULL;
+	uint64_t start_us = qspi_time_us();
+    FILE *fp_binary;
+
+    fp_binary =fopen(binary_file,"rb");
+	if (!fp_binary)
+	{
+		printf("cannot open file: %s \n",binary_file);
+		success = 0;
+		goto exit;
+	}
+
+	filesize = get_file_size(binary_file);
+	malloc_len = ((filesize/QSPI_DUMP_WORD) + ((filesize%QSPI_DUMP_WORD) ? 1 : 0 )) * QSPI_DUMP_WORD;
+	bufPtr = calloc(1, malloc_len ? malloc_len : 1);
+	if (bufPtr == NULL)
+	{
+		printf("%s: no memory for %zu bytes.\n", __func__, malloc_len);
+		fclose(fp_binary);
+		success = 0;
+		goto exit;
+	}
+	if (fread(bufPtr, sizeof(char), filesize, fp_binary) != filesize)
+	{
+		printf("cannot read file: %s \n", binary_file);
+		fclose(fp_binary);
+		success = 0;
+		goto exit;
+	}
+	fclose(fp_binary);
+
+	if (qspi_swapword & QSPI_W_SWAP_WORD)
+		for (cnt = 0; cnt < malloc_len; cnt += QSPI_DUMP_WORD)
+			*((uint32_t *)(bufPtr + cnt)) = swapLong(*((uint32_t *)(bufPtr + cnt)));
+
+	if (!ft4222_qspi_combine_flush(ftHandle))
+	{
+		success = 0;
+		goto exit;
+	}
+
+	qspi_base_held = 1;
+	for (done = 0; ; done += stripe, round++)
+	{
+		stripe = (malloc_len - done < QSPI_MULTI_STRIPE) ? (malloc_len - done) : QSPI_MULTI_STRIPE;
+
+		for (t = 0; t < target_num; t++)
+		{
+			i = (round & 1) ? (target_num - 1 - t) : t;
+			if ((stripe == 0) && (pend_len[i] == 0))
+				continue;
+			if (!ft4222_qspi_select_target(ftHandle, targets[i]))
+			{
+				success = 0;
+				goto exit;
+			}
+
+			// Collect the last burst of the previous stripe; a target that
+			// missed it gets it again through the recovering write path.
+			if (pend_len[i] && !ft4222_qspi_write_complete(ftHandle, 1) &&
+				!ft4222_qspi_memory_write_bus(ftHandle, mem_addr + pend_off[i], bufPtr + pend_off[i], pend_len[i]))
+			{
+				printf("%s: target %d failed at 0x%08x.\n", __func__, targets[i], mem_addr + pend_off[i]);
+				success = 0;
+				goto exit;
+			}
+			pend_len[i] = 0;
+
+			// Bursts never reach past the padded image or cross a window
+			for (off = done; off < done + stripe; off += chunk)
+			{
+				qspi_addr = mem_addr + off;
+				chunk = done + stripe - off;
+				if (chunk > QSPI_CMD_WRITE_MAX)
+					chunk = QSPI_CMD_WRITE_MAX;
+				if (chunk > QSPI_ACCESS_WINDOW - (qspi_addr % QSPI_ACCESS_WINDOW))
+					chunk = QSPI_ACCESS_WINDOW - (qspi_addr % QSPI_ACCESS_WINDOW);
+				chunk = ft4222_qspi_burst_fit(chunk);
+
+				if ((off + chunk < done + stripe) ||
+					!ft4222_qspi_check_base(ftHandle, qspi_addr) ||
+					!ft4222_qspi_write_issue(ftHandle, qspi_addr % QSPI_ACCESS_WINDOW, bufPtr + off, chunk))
+				{
+					if (!ft4222_qspi_memory_write_bus(ftHandle, qspi_addr, bufPtr + off, chunk))
+					{
+						printf("%s: target %d failed at 0x%08x.\n", __func__, targets[i], qspi_addr);
+						success = 0;
+						goto exit;
+					}
+					continue;
+				}
+				ft4222_qspi_cache_write(qspi_addr, bufPtr + off, chunk);
+				pend_off[i] = off;
+				pend_len[i] = chunk;
+			}
+		}
+
+		if (stripe == 0)
+			break;
+		show_progress_bar((int)(((uint64_t)(done + stripe)*100)/malloc_len));
+	}
+
+	printf("Loaded %zu bytes into %d targets in %llu us\n", malloc_len, target_num,
+		   (unsigned long long)(qspi_time_us() - start_us));
+exit:
+	qspi_base_held = 0;
+	ft4222_qspi_select_target(ftHandle, saved_target);
+	if (bufPtr != NULL)
+		free(bufPtr);
+    return success;
+}
+
+static int ft4222_qspi_memory_write_binaryfile_verify(FT_HANDLE ftHandle, uint32_t mem_addr, char *binary_file)
+{
+    int success = 1, cmd_time = 0, max_cmd_times = 0, process_times = 0 ,bcmpcmpsize = 0;
+	uint32_t qspi_addr = 0;
+	size_t filesize, malloc_len;
+	uint8_t *bufPtr = NULL, *readbufPtr = NULL;
+    FILE *fp_binary;
+
+    fp_binary =fopen(binary_file,"rb");
+	if (!fp_binary)
+	{
+		printf("cannot open file: %s \n",binary_file);
+		success = 0;
+		goto exit;
+	}
+
+	filesize = get_file_size(binary_file);
+	malloc_len = ((filesize/QSPI_DUMP_WORD) + ((filesize%QSPI_DUMP_WORD) ? 1 : 0 )) * QSPI_DUMP_WORD;
+	bufPtr = malloc(malloc_len);
+	memset(bufPtr,0x0,malloc_len);
+	fread(bufPtr, sizeof(char), filesize, fp_binary);
+	fclose(fp_binary);
+
+	max_cmd_times = (malloc_len/QSPI_CMD_READ_MAX);
+	process_times = (malloc_len%QSPI_CMD_READ_MAX) ? (max_cmd_times + 1) : max_cmd_times;
+
+	readbufPtr = malloc(process_times*QSPI_CMD_READ_MAX);
+	memset(readbufPtr,0x0,(process_times*QSPI_CMD_READ_MAX));
+
+	if (max_cmd_times) {
+		for (cmd_time = 0; cmd_time < max_cmd_times; cmd_time++)
+		{
+			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
+
+			if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr + (QSPI_CMD_READ_MAX * cmd_time), QSPI_CMD_READ_MAX , qspi_swapword))
+			{
+				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
+				success = 0;
+				goto exit;
+			}
+			show_progress_bar((cmd_time*100)/process_times);
+		}
+
+		if (malloc_len%QSPI_CMD_READ_MAX)
+		{
+			qspi_addr = mem_addr + (QSPI_CMD_READ_MAX * cmd_time);
+
+			if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr + (QSPI_CMD_READ_MAX * cmd_time), malloc_len%QSPI_CMD_READ_MAX, qspi_swapword))
+			{
+				printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
+				success = 0;
+				goto exit;
+			}
+		}
+		show_progress_bar(100);
+	}
+	else
+	{
+		qspi_addr = mem_addr;
+
+		if (!ft4222_qspi_cmd_read(ftHandle, qspi_addr, readbufPtr, malloc_len, qspi_swapword))
+		{
+			printf("%s line%d:Failed to ft4222_qspi_cmd_write address 0x%08x.\n",__func__,__LINE__,qspi_addr);
+			success = 0;
+			goto exit;
+		}
+	}
+
+	bcmpcmpsize = bcmp(bufPtr,readbufPtr,filesize);
+
+	if (bcmpcmpsize != 0)
+	{
+		printf("%s: bcmp %dbytes are different\n",__func__, (bcmpcmpsize < 0) ? (-bcmpcmpsize) : bcmpcmpsize);
+		printf("Verify: NK\n");
+		success = 0;
+		goto exit;
+	}
+	printf("Verify: OK\n");
+exit:
+	if (bufPtr != NULL)
+		free(bufPtr);
+	if (readbufPtr != NULL)
+		free(readbufPtr);
+    return success;
+}
+
+// Manifest lines, '#' starts a comment and addresses are hex:
+//   image <addr> <file> [swap=<n>] [verify]
+//   word <addr> <value> [verify]
+//   barrier
+// Relative file names are taken from the manifest's directory.
+static int ft4222_qspi_manifest_parse(const char *manifest, struct qspi_manifest_item *items, int *pnum)
+{
+	int success = 1, lineno = 0, n, used;
+	char line[PATH_MAX + 128], kind[16], path[PATH_MAX], opt[32], *p, *dir_end;
+	struct qspi_manifest_item *item;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (fp == NULL)
+	{
+		printf("cannot open manifest: %s \n", manifest);
+		return 0;
+	}
+	dir_end = strrchr(manifest, '/');
+
+	*pnum = 0;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if (sscanf(line, "%15s%n", kind, &used) != 1)
+			continue;
+
+		if (*pnum >= QSPI_MANIFEST_MAX)
+		{
+			printf("%s:%d: manifest item number exceed max %d.\n", manifest, lineno, QSPI_MANIFEST_MAX);
+			success = 0;
+			goto exit;
+		}
+		item = &items[*pnum];
+		memset(item, 0, sizeof(*item));
+		item->line = lineno;
+		item->swap = qspi_swapword;
+		p = line + used;
+
+		if (!strcmp(kind, "barrier"))
+			item->kind = QSPI_ITEM_BARRIER;
+		else if (!strcmp(kind, "image") && (sscanf(p, "%x %4095s%n", &item->mem_addr, path, &used) == 2))
+		{
+			item->kind = QSPI_ITEM_IMAGE;
+			if ((path[0] != '/') && (dir_end != NULL))
+				n = snprintf(item->path, sizeof(item->path), "%.*s/%s", (int)(dir_end - manifest), manifest, path);
+			else
+				n = snprintf(item->path, sizeof(item->path), "%s", path);
+			if (n >= (int)sizeof(item->path))
+			{
+				printf("%s:%d: file name too long.\n", manifest, lineno);
+				success = 0;
+				goto exit;
+			}
+			p += used;
+		}
+		else if (!strcmp(kind, "word") && (sscanf(p, "%x %x%n", &item->mem_addr, &item->value, &used) == 2))
+		{
+			item->kind = QSPI_ITEM_WORD;
+			p += used;
+		}
+		else
+		{
+			printf("%s:%d: '%s' is not an image, word or barrier line.\n", manifest, lineno, kind);
+			success = 0;
+			goto exit;
+		}
+
+		while (sscanf(p, "%31s%n", opt, &used) == 1)
+		{
+			p += used;
+			if (!strcmp(opt, "verify"))
+				item->verify = 1;
+			else if ((item->kind == QSPI_ITEM_IMAGE) && (sscanf(opt, "swap=%d", &item->swap) == 1) &&
+					 (item->swap >= 0) && (item->swap <= 3))
+				continue;
+			else
+			{
+				printf("%s:%d: option '%s' is not valid here.\n", manifest, lineno, opt);
+				success = 0;
+				goto exit;
+			}
+		}
+		(*pnum)++;
+	}
+
+exit:
+	fclose(fp);
+	return success;
+}
+
+static int ft4222_qspi_manifest_switches(struct qspi_manifest_item **order, int num)
+{
+	int i, switches = 0;
+	uint32_t window = 0xFFFFFFFF;
+
+	for (i = 0; i < num; i++)
+	{
+		if (order[i]->kind == QSPI_ITEM_BARRIER)
+			continue;
+		if (order[i]->mem_addr / QSPI_ACCESS_WINDOW != window)
+			switches++;
+		window = order[i]->mem_addr / QSPI_ACCESS_WINDOW;
+	}
+	return switches;
+}
+
+// Between barriers, items are reordered stably by window, starting with
+// the window the previous group ended in
+static void ft4222_qspi_manifest_order(struct qspi_manifest_item **order, int num)
+{
+	struct qspi_manifest_item *item;
+	uint32_t window = 0xFFFFFFFF;
+	int first, i, j;
+
+	for (first = 0; first < num; first = i + 1)
+	{
+		for (i = first; (i < num) && (order[i]->kind != QSPI_ITEM_BARRIER); i++)
+		{
+			item = order[i];
+			for (j = i; j > first; j--)
+			{
+				uint32_t a = order[j - 1]->mem_addr / QSPI_ACCESS_WINDOW, b = item->mem_addr / QSPI_ACCESS_WINDOW;
+
+				// The carried-over window sorts first
+				if ((b == window) ? (a == window) : ((a == window) || (a <= b)))
+					break;
+				order[j] = order[j - 1];
+			}
+			order[j] = item;
+		}
+		if (i > first)
+			window = order[i - 1]->mem_addr / QSPI_ACCESS_WINDOW;
+	}
+}
+
+static int ft4222_qspi_manifest_item_run(FT_HANDLE ftHandle, struct qspi_manifest_item *item)
+{
+	uint64_t start_us;
+	uint32_t data = 0;
+	int success;
+
+	start_us = qspi_time_us();
+	if (item->kind == QSPI_ITEM_WORD)
+	{
+		item->size = QSPI_DUMP_WORD;
+		success = ft4222_qspi_memory_write_word(ftHandle, item->mem_addr, item->value) &&
+				  ft4222_qspi_combine_flush(ftHandle);
+	}
+	else
+	{
+		printf("Loading  %s ......\n", item->path);
+		item->size = get_file_size(item->path);
+		success = ft4222_qspi_memory_write_binaryfile(ftHandle, item->mem_addr, item->path);
+	}
+	item->load_us = qspi_time_us() - start_us;
+
+	if (success && item->verify)
+	{
+		start_us = qspi_time_us();
+		if (item->kind == QSPI_ITEM_WORD)
+		{
+			success = ft4222_qspi_memory_read_word(ftHandle, item->mem_addr, &data) && (data == item->value);
+			if (!success)
+				printf("Verify word at 0x%08x: read %08x, expected %08x\n", item->mem_addr, data, item->value);
+		}
+		else
+		{
+			printf("Verifing %s ......\n", item->path);
+			success = ft4222_qspi_memory_write_binaryfile_verify(ftHandle, item->mem_addr, item->path);
+		}
+		item->verify_us = qspi_time_us() - start_us;
+	}
+	return success;
+}
+
+// Load every manifest item in one session. The next image is handed to
+// the kernel's readahead while the current one is on the bus.
+static int ft4222_qspi_memory_write_manifest(FT_HANDLE ftHandle, const char *manifest)
+{
+	struct qspi_manifest_item *items, *order[QSPI_MANIFEST_MAX];
+	int success = 1, num = 0, i, j, fd, saved_swap = qspi_swapword, file_switches;
+	uint64_t start_us, total_us, load_us = 0, verify_us = 0;
+	size_t bytes = 0;
+
+	items = calloc(QSPI_MANIFEST_MAX, sizeof(*items));
+	if (items == NULL)
+	{
+		printf("Allocation failure.\n");
+		return 0;
+	}
+	if (!ft4222_qspi_manifest_parse(manifest, items, &num))
+	{
+		success = 0;
+		goto exit;
+	}
+
+	for (i = 0; i < num; i++)
+		order[i] = &items[i];
+	file_switches = ft4222_qspi_manifest_switches(order, num);
+	ft4222_qspi_manifest_order(order, num);
+
+	start_us = qspi_time_us();
+	for (i = 0; success && (i < num); i++)
+	{
+		if (order[i]->kind == QSPI_ITEM_BARRIER)
+			continue;
+
+		for (j = i + 1; (j < num) && (order[j]->kind != QSPI_ITEM_IMAGE); j++)
+			;
+		if ((j < num) && ((fd = open(order[j]->path, O_RDONLY)) >= 0))
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+
+		qspi_swapword = order[i]->swap;
+		order[i]->result = ft4222_qspi_manifest_item_run(ftHandle, order[i]);
+		qspi_swapword = saved_swap;
+		if (!order[i]->result)
+		{
+			printf("%s:%d: item failed, stopping.\n", manifest, order[i]->line);
+			success = 0;
+		}
+	}
+	total_us = qspi_time_us() - start_us;
+
+	printf("%-5s %-10s %10s %10s %10s %10s  %s\n", "line", "address", "bytes", "load ms", "KB/s", "verify ms", "item");
+	for (i = 0; i < num; i++)
+	{
+		if ((order[i]->kind == QSPI_ITEM_BARRIER) || !order[i]->load_us)
+			continue;
+		printf("%-5d 0x%08x %10zu %10.1f %10.1f %10.1f  %s%s\n", order[i]->line, order[i]->mem_addr, order[i]->size,
+			   order[i]->load_us / 1000.0, order[i]->size * 1000000.0 / 1024 / order[i]->load_us,
+			   order[i]->verify_us / 1000.0, (order[i]->kind == QSPI_ITEM_WORD) ? "word" : order[i]->path,
+			   order[i]->result ? "" : " (failed)");
+		bytes += order[i]->size;
+		load_us += order[i]->load_us;
+		verify_us += order[i]->verify_us;
+	}
+	printf("total %10s %10zu %10.1f %10.1f %10.1f  %.1f ms elapsed, %d window switches (%d in file order)\n", "",
+		   bytes, load_us / 1000.0, bytes * 1000000.0 / 1024 / (load_us ? load_us : 1), verify_us / 1000.0,
+		   total_us / 1000.0, ft4222_qspi_manifest_switches(order, num), file_switches);
+
+exit:
+	free(items);
+	return success;
+}
+#endif
+
+static void ft4222_qspi_span_swap(uint8_t *buf, uint32_t len, int swap)
+{
+	uint32_t cnt;
+
+	if (!(qspi_swapword & swap))
+		return;
+
+	for (cnt = 0; cnt < len; cnt += QSPI_DUMP_WORD)
+		*((uint32_t *)(buf + cnt)) = swapLong(*((uint32_t *)(buf + cnt)));
+}
+
+// Read a word aligned span in the largest bursts that fit, as the bus
+// returns it
+static int ft4222_qspi_span_fetch(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buf, uint32_t len)
+{
+	uint32_t done = 0, chunk;
+
+	while (done < len)
+	{
+		chunk = ft4222_qspi_burst_fit(len - done);
+		if (((mem_addr + done) % QSPI_ACCESS_WINDOW) + chunk > QSPI_ACCESS_WINDOW)
+			chunk = QSPI_DUMP_WORD;
+		if (!ft4222_qspi_memory_read(ftHandle, mem_addr + done, buf + done, chunk))
+			return 0;
+		done += chunk;
+	}
+	return 1;
+}
+
+// Read a word aligned span in -W order
+static int ft4222_qspi_span_read(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buf, uint32_t len)
+{
+	if (!ft4222_qspi_span_fetch(ftHandle, mem_addr, buf, len))
+		return 0;
+
+	ft4222_qspi_span_swap(buf, len, QSPI_R_SWAP_WORD);
+	return 1;
+}
+
+// Read any byte span through a word aligned bounce buffer
+static int ft4222_qspi_span_read_any(FT_HANDLE ftHandle, uint32_t mem_addr, uint8_t *buf, uint32_t len)
+{
+	uint32_t start = mem_addr & ~(QSPI_DUMP_WORD - 1);
+	uint32_t end   = (mem_addr + len + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+	uint8_t *span  = malloc(end - start);
+	int success;
+
+	success = ft4222_qspi_span_read(ftHandle, start, span, end - start);
+	if (success)
+		memcpy(buf, span + (mem_addr - start), len);
+	free(span);
+	return success;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+// -p dump pipeline: the bus thread fills a ring of blocks, a formatter
+// thread renders them row by row into one large buffer and writes it out
+// in big chunks.
+struct qspi_dump_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	uint8_t         data[QSPI_DUMP_SLOTS][QSPI_DUMP_BLOCK];
+	uint32_t        addr[QSPI_DUMP_SLOTS];
+	uint32_t        len[QSPI_DUMP_SLOTS];
+	unsigned int    head, tail;
+	int             done, error;
+	int             fd;
+	int             ihex_upper;
+	uint32_t        row;
+	size_t          out_len;
+	char            out[QSPI_DUMP_OUT_SIZE];
+};
+
+struct qspi_dump_format {
+	const char *name;
+	uint32_t   row;    // bytes per row, 0: -f words:<n> columns
+	char *(*render)(struct qspi_dump_pipe *pipe, char *p, uint32_t addr, const uint8_t *data, uint32_t len);
+};
+
+static char qspi_hex_lower[256][2], qspi_hex_upper[256][2], qspi_dump_ascii[256];
+
+static void ft4222_qspi_dump_tables(void)
+{
+	static const char lower[] = "0123456789abcdef", upper[] = "0123456789ABCDEF";
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		qspi_hex_lower[i][0] = lower[i >> 4];
+		qspi_hex_lower[i][1] = lower[i & 0xf];
+		qspi_hex_upper[i][0] = upper[i >> 4];
+		qspi_hex_upper[i][1] = upper[i & 0xf];
+		qspi_dump_ascii[i] = ((i >= 0x20) && (i < 0x7f)) ? (char)i : '.';
+	}
+}
+
+static char *ft4222_qspi_dump_addr(char *p, uint32_t addr)
+{
+	memcpy(p, qspi_hex_lower[addr >> 24], 2);
+	memcpy(p + 2, qspi_hex_lower[(addr >> 16) & 0xff], 2);
+	memcpy(p + 4, qspi_hex_lower[(addr >> 8) & 0xff], 2);
+	memcpy(p + 6, qspi_hex_lower[addr & 0xff], 2);
+	return p + 8;
+}
+
+// "addr  xx xx .. xx  xx .. xx  |ascii|", as hexdump -C prints it
+static char *ft4222_qspi_dump_hex(struct qspi_dump_pipe *pipe, char *p, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	p = ft4222_qspi_dump_addr(p, addr);
+	*p++ = ' ';
+	for (i = 0; i < 16; i++)
+	{
+		if (i == 8)
+			*p++ = ' ';
+		*p++ = ' ';
+		if (i < len)
+			memcpy(p, qspi_hex_lower[data[i]], 2);
+		else
+			p[0] = p[1] = ' ';
+		p += 2;
+	}
+	*p++ = ' ';
+	*p++ = ' ';
+	*p++ = '|';
+	for (i = 0; i < len; i++)
+		*p++ = qspi_dump_ascii[data[i]];
+	*p++ = '|';
+	*p++ = '\n';
+	return p;
+}
+
+// "addr : wwwwwwww wwwwwwww ...", each word in bus byte order
+static char *ft4222_qspi_dump_words(struct qspi_dump_pipe *pipe, char *p, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	p = ft4222_qspi_dump_addr(p, addr);
+	memcpy(p, " : ", 3);
+	p += 3;
+	for (i = 0; i + QSPI_DUMP_WORD <= len; i += QSPI_DUMP_WORD)
+	{
+		memcpy(p, qspi_hex_lower[data[i]], 2);
+		memcpy(p + 2, qspi_hex_lower[data[i + 1]], 2);
+		memcpy(p + 4, qspi_hex_lower[data[i + 2]], 2);
+		memcpy(p + 6, qspi_hex_lower[data[i + 3]], 2);
+		p[8] = ' ';
+		p += 9;
+	}
+	*p++ = '\n';
+	return p;
+}
+
+static char *ft4222_qspi_dump_raw(struct qspi_dump_pipe *pipe, char *p, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static char *ft4222_qspi_ihex_record(char *p, uint8_t type, uint16_t offset, const uint8_t *data, uint32_t len)
+{
+	uint8_t sum = (uint8_t)(len + (offset >> 8) + offset + type);
+	uint32_t i;
+
+	*p++ = ':';
+	memcpy(p, qspi_hex_upper[len], 2);
+	memcpy(p + 2, qspi_hex_upper[offset >> 8], 2);
+	memcpy(p + 4, qspi_hex_upper[offset & 0xff], 2);
+	memcpy(p + 6, qspi_hex_upper[type], 2);
+	p += 8;
+	for (i = 0; i < len; i++, p += 2)
+	{
+		memcpy(p, qspi_hex_upper[data[i]], 2);
+		sum += data[i];
+	}
+	memcpy(p, qspi_hex_upper[(uint8_t)(0x100 - sum)], 2);
+	p[2] = '\n';
+	return p + 3;
+}
+
+// Intel HEX data records, with an extended linear address record whenever
+// the upper 16 address bits change
+static char *ft4222_qspi_dump_ihex(struct qspi_dump_pipe *pipe, char *p, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uint8_t upper[2];
+	uint32_t chunk;
+
+	while (len)
+	{
+		if ((int)(addr >> 16) != pipe->ihex_upper)
+		{
+			pipe->ihex_upper = addr >> 16;
+			upper[0] = addr >> 24;
+			upper[1] = addr >> 16;
+			p = ft4222_qspi_ihex_record(p, 0x04, 0, upper, 2);
+		}
+		chunk = 0x10000 - (addr & 0xffff);
+		if (chunk > len)
+			chunk = len;
+		p = ft4222_qspi_ihex_record(p, 0x00, addr & 0xffff, data, chunk);
+		addr += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return p;
+}
+
+static const struct qspi_dump_format qspi_dump_formats[] = {
+	[QSPI_DUMP_FMT_HEX]   = {"hex",   16,  ft4222_qspi_dump_hex},
+	[QSPI_DUMP_FMT_WORDS] = {"words", 0,   ft4222_qspi_dump_words},
+	[QSPI_DUMP_FMT_RAW]   = {"raw",   256, ft4222_qspi_dump_raw},
+	[QSPI_DUMP_FMT_IHEX]  = {"ihex",  16,  ft4222_qspi_dump_ihex},
+};
+
+static int ft4222_qspi_dump_format_set(const char *arg)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(qspi_dump_formats) / sizeof(qspi_dump_formats[0])); i++)
+	{
+		len = strlen(qspi_dump_formats[i].name);
+		if (strncmp(arg, qspi_dump_formats[i].name, len))
+			continue;
+
+		if ((i == QSPI_DUMP_FMT_WORDS) && (arg[len] == ':'))
+		{
+			qspi_dump_columns = get_int_number(arg + len + 1);
+			if ((qspi_dump_columns < 1) || (qspi_dump_columns > QSPI_DUMP_COL_MAX))
+				return 0;
+		}
+		else if (arg[len] != '\0')
+			continue;
+
+		qspi_dump_format = i;
+		return 1;
+	}
+	return 0;
+}
+
+static int ft4222_qspi_dump_flush(struct qspi_dump_pipe *pipe)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < pipe->out_len)
+	{
+		ret = write(pipe->fd, pipe->out + done, pipe->out_len - done);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+		{
+			printf("Failed to write dump output: %s\n", strerror(errno));
+			pipe->out_len = 0;
+			return 0;
+		}
+		done += ret;
+	}
+	pipe->out_len = 0;
+	return 1;
+}
+
+// The bus thread waits on the same lock, so it sees the error and stops
+static void ft4222_qspi_dump_fail(struct qspi_dump_pipe *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->error = 1;
+	pthread_cond_signal(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void *ft4222_qspi_dump_formatter(void *arg)
+{
+	struct qspi_dump_pipe *pipe = arg;
+	const struct qspi_dump_format *fmt = &qspi_dump_formats[qspi_dump_format];
+	unsigned int slot;
+	uint32_t off, row;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipe->lock);
+		while ((pipe->head == pipe->tail) && !pipe->done)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		if (pipe->head == pipe->tail)
+		{
+			pthread_mutex_unlock(&pipe->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pipe->lock);
+
+		slot = pipe->tail % QSPI_DUMP_SLOTS;
+		for (off = 0; off < pipe->len[slot]; off += row)
+		{
+			row = pipe->len[slot] - off;
+			if (row > pipe->row)
+				row = pipe->row;
+			if ((pipe->out_len + QSPI_DUMP_ROW_MAX > QSPI_DUMP_OUT_SIZE) && !ft4222_qspi_dump_flush(pipe))
+				ft4222_qspi_dump_fail(pipe);
+			pipe->out_len = fmt->render(pipe, pipe->out + pipe->out_len, pipe->addr[slot] + off,
+										pipe->data[slot] + off, row) - pipe->out;
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->tail++;
+		pthread_cond_signal(&pipe->cond);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+
+	if (qspi_dump_format == QSPI_DUMP_FMT_IHEX)
+		pipe->out_len = ft4222_qspi_ihex_record(pipe->out + pipe->out_len, 0x01, 0, NULL, 0) - pipe->out;
+	if (!ft4222_qspi_dump_flush(pipe))
+		ft4222_qspi_dump_fail(pipe);
+	return NULL;
+}
+
+static int ft4222_qspi_memory_dump(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t size)
+{
+	struct qspi_dump_pipe *pipe;
+	pthread_t formatter;
+	uint32_t done = 0, block, chunk;
+	unsigned int slot;
+	int success = 1, error = 0, saved_stdout;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (pipe == NULL)
+	{
+		printf("Allocation failure.\n");
+		return 0;
+	}
+
+	ft4222_qspi_dump_tables();
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	pipe->ihex_upper = -1;
+	pipe->row = qspi_dump_formats[qspi_dump_format].row;
+	if (pipe->row == 0)
+		pipe->row = qspi_dump_columns * QSPI_DUMP_WORD;
+	// Whole rows per block, so no row straddles two blocks
+	block = (QSPI_DUMP_BLOCK / pipe->row) * pipe->row;
+	size = (size + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+
+	// Anything printed so far has to land ahead of the dump. While it runs
+	// the dump owns stdout and messages printed meanwhile go to stderr.
+	fflush(stdout);
+	pipe->fd = STDOUT_FILENO;
+	saved_stdout = dup(STDOUT_FILENO);
+	if ((saved_stdout >= 0) && (dup2(STDERR_FILENO, STDOUT_FILENO) >= 0))
+		pipe->fd = saved_stdout;
+	if (pthread_create(&formatter, NULL, ft4222_qspi_dump_formatter, pipe))
+	{
+		printf("Failed to start the dump formatter.\n");
+		success = 0;
+		goto exit;
+	}
+
+	while (done < size)
+	{
+		chunk = (size - done < block) ? (size - done) : block;
+
+		pthread_mutex_lock(&pipe->lock);
+		while ((pipe->head - pipe->tail == QSPI_DUMP_SLOTS) && !pipe->error)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		error = pipe->error;
+		pthread_mutex_unlock(&pipe->lock);
+		if (error)
+			break;
+
+		slot = pipe->head % QSPI_DUMP_SLOTS;
+		if (!ft4222_qspi_span_fetch(ftHandle, mem_addr + done, pipe->data[slot], chunk))
+		{
+			printf("Failed to dump 0x%08x.\n", mem_addr + done);
+			success = 0;
+			break;
+		}
+		pipe->addr[slot] = mem_addr + done;
+		pipe->len[slot] = chunk;
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->head++;
+		pthread_cond_signal(&pipe->cond);
+		pthread_mutex_unlock(&pipe->lock);
+		done += chunk;
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->done = 1;
+	pthread_cond_signal(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	pthread_join(formatter, NULL);
+	if (pipe->error)
+		success = 0;
+
+exit:
+	if (pipe->fd != STDOUT_FILENO)
+	{
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+	}
+	if (saved_stdout >= 0)
+		close(saved_stdout);
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe);
+	return success;
+}
+
+// Runs of three or more equal words become {QSPI_SNAP_RUN | n, word},
+// everything else goes out as {n, word...} literals. Never longer than
+// words + 1.
+static uint32_t ft4222_qspi_snapshot_pack(const uint32_t *in, uint32_t words, uint32_t *out)
+{
+	uint32_t pos = 0, run, len = 0, lit = 0;
+
+	while (pos < words)
+	{
+		for (run = 1; (pos + run < words) && (in[pos + run] == in[pos]); run++)
+			;
+		if (run >= 3)
+		{
+			out[len++] = QSPI_SNAP_RUN | run;
+			out[len++] = in[pos];
+			pos += run;
+			continue;
+		}
+
+		for (lit = pos + 1; lit < words; lit++)
+			if ((lit + 2 < words) && (in[lit] == in[lit + 1]) && (in[lit] == in[lit + 2]))
+				break;
+		out[len++] = lit - pos;
+		memcpy(&out[len], &in[pos], (lit - pos) * sizeof(uint32_t));
+		len += lit - pos;
+		pos = lit;
+	}
+	return len;
+}
+
+static int ft4222_qspi_snapshot_unpack(const uint32_t *in, uint32_t len, uint32_t *out, uint32_t words)
+{
+	uint32_t pos = 0, cnt, i = 0;
+
+	while (i < len)
+	{
+		cnt = in[i] & ~QSPI_SNAP_RUN;
+		if (pos + cnt > words)
+			return 0;
+		if (in[i] & QSPI_SNAP_RUN)
+		{
+			if (i + 1 >= len)
+				return 0;
+			while (cnt--)
+				out[pos++] = in[i + 1];
+			i += 2;
+		}
+		else
+		{
+			if (i + 1 + cnt > len)
+				return 0;
+			memcpy(&out[pos], &in[i + 1], cnt * sizeof(uint32_t));
+			pos += cnt;
+			i += 1 + cnt;
+		}
+	}
+	return pos == words;
+}
+
+// File layout: header, index of every block, then the packed blocks
+static int ft4222_qspi_snapshot_save(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t size, const char *fileName)
+{
+	struct qspi_snap_header header;
+	struct qspi_snap_index *index = NULL;
+	uint32_t *raw = NULL, *packed = NULL, blk, len, offset, packed_total = 0;
+	FILE *fp = NULL;
+	int success = 0;
+
+	size = (size + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+	memset(&header, 0, sizeof(header));
+	header.magic = QSPI_SNAP_MAGIC;
+	header.block_size = QSPI_SNAP_BLOCK;
+	header.mem_addr = mem_addr;
+	header.size = size;
+	header.blocks = (size + QSPI_SNAP_BLOCK - 1) / QSPI_SNAP_BLOCK;
+
+	index = calloc(header.blocks, sizeof(*index));
+	raw = malloc(QSPI_SNAP_BLOCK);
+	packed = malloc(QSPI_SNAP_BLOCK + sizeof(uint32_t));
+	if ((index == NULL) || (raw == NULL) || (packed == NULL))
+	{
+		printf("Allocation failure.\n");
+		goto exit;
+	}
+
+	fp = fopen(fileName, "wb");
+	if (fp == NULL)
+	{
+		printf("Can't create snapshot %s: %s\n", fileName, strerror(errno));
+		goto exit;
+	}
+
+	offset = sizeof(header) + header.blocks * sizeof(*index);
+	if (fseek(fp, offset, SEEK_SET))
+		goto write_fail;
+
+	for (blk = 0; blk < header.blocks; blk++)
+	{
+		len = size - blk * QSPI_SNAP_BLOCK;
+		if (len > QSPI_SNAP_BLOCK)
+			len = QSPI_SNAP_BLOCK;
+
+		if (!ft4222_qspi_span_fetch(ftHandle, mem_addr + blk * QSPI_SNAP_BLOCK, (uint8_t *)raw, len))
+		{
+			printf("Failed to read snapshot block 0x%08x.\n", mem_addr + blk * QSPI_SNAP_BLOCK);
+			goto exit;
+		}
+
+		index[blk].hash = ft4222_qspi_hash((uint8_t *)raw, len);
+		index[blk].offset = offset;
+		index[blk].length = ft4222_qspi_snapshot_pack(raw, len / QSPI_DUMP_WORD, packed) * sizeof(uint32_t);
+		if (fwrite(packed, 1, index[blk].length, fp) != index[blk].length)
+			goto write_fail;
+		offset += index[blk].length;
+		packed_total += index[blk].length;
+	}
+
+	rewind(fp);
+	if ((fwrite(&header, sizeof(header), 1, fp) != 1) ||
+		(fwrite(index, sizeof(*index), header.blocks, fp) != header.blocks))
+		goto write_fail;
+
+	printf("Snapshot 0x%08x~0x%08x: %u blocks, %u bytes packed to %u\n",
+		   mem_addr, mem_addr + size, header.blocks, size, packed_total);
+	success = 1;
+	goto exit;
+
+write_fail:
+	printf("Failed to write snapshot %s: %s\n", fileName, strerror(errno));
+exit:
+	if (fp && fclose(fp))
+		success = 0;
+	free(packed);
+	free(raw);
+	free(index);
+	return success;
+}
+
+static FILE *ft4222_qspi_snapshot_open(const char *fileName, struct qspi_snap_header *header,
+									   struct qspi_snap_index **index)
+{
+	FILE *fp = fopen(fileName, "rb");
+
+	*index = NULL;
+	if (fp == NULL)
+	{
+		printf("Can't open snapshot %s: %s\n", fileName, strerror(errno));
+		return NULL;
+	}
+
+	if ((fread(header, sizeof(*header), 1, fp) != 1) || (header->magic != QSPI_SNAP_MAGIC) ||
+		(header->block_size != QSPI_SNAP_BLOCK) ||
+		(header->blocks != (header->size + QSPI_SNAP_BLOCK - 1) / QSPI_SNAP_BLOCK))
+	{
+		printf("%s is not a snapshot.\n", fileName);
+		goto fail;
+	}
+
+	*index = calloc(header->blocks ? header->blocks : 1, sizeof(**index));
+	if ((*index == NULL) || (fread(*index, sizeof(**index), header->blocks, fp) != header->blocks))
+	{
+		printf("Snapshot %s index is truncated.\n", fileName);
+		goto fail;
+	}
+	return fp;
+
+fail:
+	free(*index);
+	*index = NULL;
+	fclose(fp);
+	return NULL;
+}
+
+static int ft4222_qspi_snapshot_block(FILE *fp, const struct qspi_snap_index *index, uint32_t *packed,
+									  uint32_t *raw, uint32_t len)
+{
+	if ((index->length > QSPI_SNAP_BLOCK + sizeof(uint32_t)) ||
+		fseek(fp, index->offset, SEEK_SET) ||
+		(fread(packed, 1, index->length, fp) != index->length))
+		return 0;
+
+	return ft4222_qspi_snapshot_unpack(packed, index->length / sizeof(uint32_t), raw, len / QSPI_DUMP_WORD);
+}
+
+static void ft4222_qspi_snapshot_range_flush(struct qspi_snap_range *range)
+{
+	if (!range->open)
+		return;
+
+	printf("0x%08x-0x%08x (%u bytes)\n", range->start, range->end - 1, range->end - range->start);
+	range->count++;
+	range->open = 0;
+}
+
+// Word-compare one block and extend or emit the changed range
+static void ft4222_qspi_snapshot_range_diff(struct qspi_snap_range *range, uint32_t addr,
+											const uint32_t *a, const uint32_t *b, uint32_t len)
+{
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < len / QSPI_DUMP_WORD; cnt++, addr += QSPI_DUMP_WORD)
+	{
+		if (a[cnt] == b[cnt])
+			continue;
+		if (range->open && (range->end == addr))
+		{
+			range->end = addr + QSPI_DUMP_WORD;
+			continue;
+		}
+		ft4222_qspi_snapshot_range_flush(range);
+		range->open = 1;
+		range->start = addr;
+		range->end = addr + QSPI_DUMP_WORD;
+	}
+}
+
+// With a second snapshot only blocks whose index hashes differ are
+// unpacked. Against live memory every block is read, since the bridge
+// has no way to hash on the target, but again only blocks whose hash
+// changed are unpacked and compared word by word.
+static int ft4222_qspi_snapshot_diff(FT_HANDLE ftHandle, const char *fileA, const char *fileB)
+{
+	struct qspi_snap_header headerA, headerB;
+	struct qspi_snap_index *indexA = NULL, *indexB = NULL, live;
+	struct qspi_snap_range range = {0};
+	uint32_t *rawA = NULL, *rawB = NULL, *packed = NULL, blk, len, addr, changed = 0;
+	FILE *fpA = NULL, *fpB = NULL;
+	int success = 0;
+
+	fpA = ft4222_qspi_snapshot_open(fileA, &headerA, &indexA);
+	if (fpA == NULL)
+		goto exit;
+
+	if (fileB)
+	{
+		fpB = ft4222_qspi_snapshot_open(fileB, &headerB, &indexB);
+		if (fpB == NULL)
+			goto exit;
+		if ((headerA.mem_addr != headerB.mem_addr) || (headerA.size != headerB.size))
+		{
+			printf("Snapshots cover different ranges 0x%08x+0x%x and 0x%08x+0x%x.\n",
+				   headerA.mem_addr, headerA.size, headerB.mem_addr, headerB.size);
+			goto exit;
+		}
+	}
+
+	rawA = malloc(QSPI_SNAP_BLOCK);
+	rawB = malloc(QSPI_SNAP_BLOCK);
+	packed = malloc(QSPI_SNAP_BLOCK + sizeof(uint32_t));
+	if ((rawA == NULL) || (rawB == NULL) || (packed == NULL))
+	{
+		printf("Allocation failure.\n");
+		goto exit;
+	}
+
+	for (blk = 0; blk < headerA.blocks; blk++)
+	{
+		addr = headerA.mem_addr + blk * QSPI_SNAP_BLOCK;
+		len = headerA.size - blk * QSPI_SNAP_BLOCK;
+		if (len > QSPI_SNAP_BLOCK)
+			len = QSPI_SNAP_BLOCK;
+
+		if (fpB)
+		{
+			if (indexA[blk].hash == indexB[blk].hash)
+				continue;
+			if (!ft4222_qspi_snapshot_block(fpB, &indexB[blk], packed, rawB, len))
+			{
+				printf("Snapshot %s block 0x%08x is corrupt.\n", fileB, addr);
+				goto exit;
+			}
+		}
+		else
+		{
+			if (!ft4222_qspi_span_fetch(ftHandle, addr, (uint8_t *)rawB, len))
+			{
+				printf("Failed to read block 0x%08x.\n", addr);
+				goto exit;
+			}
+			live.hash = ft4222_qspi_hash((uint8_t *)rawB, len);
+			if (live.hash == indexA[blk].hash)
+				continue;
+		}
+
+		if (!ft4222_qspi_snapshot_block(fpA, &indexA[blk], packed, rawA, len))
+		{
+			printf("Snapshot %s block 0x%08x is corrupt.\n", fileA, addr);
+			goto exit;
+		}
+		ft4222_qspi_snapshot_range_diff(&range, addr, rawA, rawB, len);
+		changed++;
+	}
+	ft4222_qspi_snapshot_range_flush(&range);
+
+	printf("%u changed ranges in %u of %u blocks\n", range.count, changed, headerA.blocks);
+	success = 1;
+
+exit:
+	if (fpA)
+		fclose(fpA);
+	if (fpB)
+		fclose(fpB);
+	free(packed);
+	free(rawB);
+	free(rawA);
+	free(indexB);
+	free(indexA);
+	return success;
+}
+#endif
+
+// Write any byte span; ragged head and tail words are merged with what
+// the target holds so only whole words hit the bus.
+static int ft4222_qspi_span_write(FT_HANDLE ftHandle, uint32_t mem_addr, const uint8_t *data, uint32_t bytes)
+{
+	int success = 1;
+	uint32_t start, end, len, done = 0, chunk;
+	uint8_t *buf = NULL;
+
+	if (bytes == 0)
+		return success;
+
+	start = mem_addr & ~(QSPI_DUMP_WORD - 1);
+	end   = (mem_addr + bytes + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+	len   = end - start;
+	buf   = malloc(len);
+
+	if ((start != mem_addr) && !ft4222_qspi_span_read(ftHandle, start, buf, QSPI_DUMP_WORD))
+	{
+		success = 0;
+		goto exit;
+	}
+	if ((end != mem_addr + bytes) &&
+		!ft4222_qspi_span_read(ftHandle, end - QSPI_DUMP_WORD, buf + len - QSPI_DUMP_WORD, QSPI_DUMP_WORD))
+	{
+		success = 0;
+		goto exit;
+	}
+	memcpy(buf + (mem_addr - start), data, bytes);
+	ft4222_qspi_span_swap(buf, len, QSPI_W_SWAP_WORD);
+
+	while (done < len)
+	{
+		chunk = ft4222_qspi_burst_fit(len - done);
+		if (((start + done) % QSPI_ACCESS_WINDOW) + chunk > QSPI_ACCESS_WINDOW)
+			chunk = QSPI_DUMP_WORD;
+		if (!ft4222_qspi_memory_write(ftHandle, start + done, buf + done, chunk))
+		{
+			printf("%s: failed to write 0x%08x.\n", __func__, start + done);
+			success = 0;
+			goto exit;
+		}
+		done += chunk;
+	}
+
+exit:
+	free(buf);
+	return success;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+#ifdef FT4222_QSPI_FUSE
+#define QSPI_FUSE_FILE       "/mem"
+#define QSPI_FUSE_WBUF_MAX   4096
+#define QSPI_FUSE_READAHEAD  4096
+
+static FT_HANDLE qspi_fuse_handle;
+static uint32_t  qspi_fuse_base, qspi_fuse_size;
+static uint8_t   qspi_fuse_wbuf[QSPI_FUSE_WBUF_MAX];
+static uint32_t  qspi_fuse_wbuf_off, qspi_fuse_wbuf_len;
+static uint32_t  qspi_fuse_last_end;
+
+static int ft4222_qspi_fuse_flush_wbuf(void)
+{
+	int success = 1;
+
+	if (qspi_fuse_wbuf_len == 0)
+		return success;
+
+	success = ft4222_qspi_span_write(qspi_fuse_handle, qspi_fuse_base + qspi_fuse_wbuf_off, qspi_fuse_wbuf, qspi_fuse_wbuf_len);
+	qspi_fuse_wbuf_len = 0;
+	return success;
+}
+
+static int ft4222_qspi_fuse_getattr(const char *path, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	if (!strcmp(path, "/"))
+	{
+		st->st_mode  = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+	if (!strcmp(path, QSPI_FUSE_FILE))
+	{
+		st->st_mode  = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size  = qspi_fuse_size;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int ft4222_qspi_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+									off_t offset, struct fuse_file_info *fi)
+{
+	if (strcmp(path, "/"))
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	filler(buf, QSPI_FUSE_FILE + 1, NULL, 0);
+	return 0;
+}
+
+static int ft4222_qspi_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, QSPI_FUSE_FILE))
+		return -ENOENT;
+
+	// Target memory can change under us, let every read reach the tool
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int ft4222_qspi_fuse_truncate(const char *path, off_t size)
+{
+	return 0;
+}
+
+static int ft4222_qspi_fuse_read(const char *path, char *buf, size_t size, off_t offset,
+								 struct fuse_file_info *fi)
+{
+	uint32_t start, end, ra_end;
+	uint8_t *span;
+
+	if (offset >= qspi_fuse_size)
+		return 0;
+	if (offset + size > qspi_fuse_size)
+		size = qspi_fuse_size - offset;
+
+	if ((qspi_fuse_wbuf_len) && (offset < qspi_fuse_wbuf_off + qspi_fuse_wbuf_len) &&
+		(offset + size > qspi_fuse_wbuf_off) && !ft4222_qspi_fuse_flush_wbuf())
+		return -EIO;
+
+	start = offset & ~(QSPI_DUMP_WORD - 1);
+	end   = (offset + size + QSPI_DUMP_WORD - 1) & ~(QSPI_DUMP_WORD - 1);
+
+	// Sequential access pulls the next blocks into the cache in full
+	// bursts, when -c made that part of the range cacheable
+	ra_end = end;
+	if ((offset == qspi_fuse_last_end) && (end + QSPI_FUSE_READAHEAD <= qspi_fuse_size) &&
+		(ft4222_qspi_cache_policy(qspi_fuse_base + end, QSPI_FUSE_READAHEAD) != QSPI_CACHE_UNCACHED))
+		ra_end = end + QSPI_FUSE_READAHEAD;
+	qspi_fuse_last_end = offset + size;
+
+	span = malloc(ra_end - start);
+	if (!ft4222_qspi_span_read(qspi_fuse_handle, qspi_fuse_base + start, span, ra_end - start))
+	{
+		free(span);
+		return -EIO;
+	}
+	memcpy(buf, span + (offset - start), size);
+	free(span);
+	return size;
+}
+
+static int ft4222_qspi_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
+								  struct fuse_file_info *fi)
+{
+	size_t done = 0, chunk;
+
+	if (offset >= qspi_fuse_size)
+		return -ENOSPC;
+	if (offset + size > qspi_fuse_size)
+		size = qspi_fuse_size - offset;
+
+	while (done < size)
+	{
+		if (qspi_fuse_wbuf_len &&
+			((offset + done != qspi_fuse_wbuf_off + qspi_fuse_wbuf_len) || (qspi_fuse_wbuf_len == QSPI_FUSE_WBUF_MAX)) &&
+			!ft4222_qspi_fuse_flush_wbuf())
+			return -EIO;
+
+		if (qspi_fuse_wbuf_len == 0)
+			qspi_fuse_wbuf_off = offset + done;
+
+		chunk = QSPI_FUSE_WBUF_MAX - qspi_fuse_wbuf_len;
+		if (chunk > size - done)
+			chunk = size - done;
+		memcpy(qspi_fuse_wbuf + qspi_fuse_wbuf_len, buf + done, chunk);
+		qspi_fuse_wbuf_len += chunk;
+		done += chunk;
+	}
+	return size;
+}
+
+static int ft4222_qspi_fuse_flush(const char *path, struct fuse_file_info *fi)
+{
+	return ft4222_qspi_fuse_flush_wbuf() ? 0 : -EIO;
+}
+
+static int ft4222_qspi_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return ft4222_qspi_fuse_flush_wbuf() ? 0 : -EIO;
+}
+
+static struct fuse_operations ft4222_qspi_fuse_ops = {
+	.getattr  = ft4222_qspi_fuse_getattr,
+	.readdir  = ft4222_qspi_fuse_readdir,
+	.open     = ft4222_qspi_fuse_open,
+	.truncate = ft4222_qspi_fuse_truncate,
+	.read     = ft4222_qspi_fuse_read,
+	.write    = ft4222_qspi_fuse_write,
+	.flush    = ft4222_qspi_fuse_flush,
+	.release  = ft4222_qspi_fuse_flush,
+	.fsync    = ft4222_qspi_fuse_fsync,
+};
+#endif
+
+#define QSPI_GDB_PACKET_SIZE 0x4000
+
+struct qspi_gdb_conn {
+	int     fd;
+	int     noack;
+	uint8_t rbuf[4096];
+	int     rpos;
+	int     rlen;
+};
+
+static const char qspi_hex_digits[] = "0123456789abcdef";
+
+static int ft4222_qspi_gdb_getc(struct qspi_gdb_conn *conn)
+{
+	if (conn->rpos == conn->rlen)
+	{
+		conn->rlen = recv(conn->fd, conn->rbuf, sizeof(conn->rbuf), 0);
+		conn->rpos = 0;
+		if (conn->rlen <= 0)
+			return -1;
+	}
+	return conn->rbuf[conn->rpos++];
+}
+
+static int ft4222_qspi_gdb_hexval(int c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Returns the payload length, binary payloads are left escaped
+static int ft4222_qspi_gdb_recv(struct qspi_gdb_conn *conn, char *pkt, int max)
+{
+	int c, len, csum;
+
+	for (;;)
+	{
+		do {
+			if ((c = ft4222_qspi_gdb_getc(conn)) < 0)
+				return -1;
+		} while (c != '$');
+
+		for (len = 0, csum = 0; (c = ft4222_qspi_gdb_getc(conn)) != '#'; len++)
+		{
+			if ((c < 0) || (len >= max - 1))
+				return -1;
+			pkt[len] = c;
+			csum += c;
+		}
+		pkt[len] = 0;
+
+		c = ft4222_qspi_gdb_hexval(ft4222_qspi_gdb_getc(conn)) << 4;
+		c |= ft4222_qspi_gdb_hexval(ft4222_qspi_gdb_getc(conn));
+
+		if (conn->noack)
+			return len;
+		if ((csum & 0xFF) == c)
+		{
+			send(conn->fd, "+", 1, 0);
+			return len;
+		}
+		send(conn->fd, "-", 1, 0);
+	}
+}
+
+static int ft4222_qspi_gdb_send(struct qspi_gdb_conn *conn, const char *data, int len)
+{
+	static char out[QSPI_GDB_PACKET_SIZE + 4];
+	int i, csum = 0, c;
+
+	out[0] = '$';
+	for (i = 0; i < len; i++)
+	{
+		out[i + 1] = data[i];
+		csum += (uint8_t)data[i];
+	}
+	out[len + 1] = '#';
+	out[len + 2] = qspi_hex_digits[(csum >> 4) & 0xF];
+	out[len + 3] = qspi_hex_digits[csum & 0xF];
+
+	do {
+		if (send(conn->fd, out, len + 4, 0) != len + 4)
+			return 0;
+		if (conn->noack)
+			return 1;
+		c = ft4222_qspi_gdb_getc(conn);
+	} while (c == '-');
+
+	return c == '+';
+}
+
+static int ft4222_qspi_gdb_send_str(struct qspi_gdb_conn *conn, const char *str)
+{
+	return ft4222_qspi_gdb_send(conn, str, strlen(str));
+}
+
+static int ft4222_qspi_gdb_unescape(char *data, int len)
+{
+	int i, out = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if ((data[i] == 0x7d) && (i + 1 < len))
+			data[out++] = data[++i] ^ 0x20;
+		else
+			data[out++] = data[i];
+	}
+	return out;
+}
+
+// The target may run between stops, so re-verify what was cached
+static void ft4222_qspi_gdb_resume(void)
+{
+	ft4222_qspi_cache_flush();
+	qspi_base_valid[qspi_target] = 0;
+}
+
+static int ft4222_qspi_gdb_session(FT_HANDLE ftHandle, struct qspi_gdb_conn *conn, uint32_t map_addr, uint32_t map_size)
+{
+	static char pkt[QSPI_GDB_PACKET_SIZE + 1], reply[QSPI_GDB_PACKET_SIZE + 1];
+	static uint8_t data[QSPI_GDB_PACKET_SIZE];
+	char xml[256], *colon;
+	unsigned int addr, len, offset;
+	int plen, i, xml_len;
+
+	while ((plen = ft4222_qspi_gdb_recv(conn, pkt, sizeof(pkt))) >= 0)
+	{
+		switch (pkt[0])
+		{
+			case '?':
+				ft4222_qspi_gdb_send_str(conn, "S05");
+				break;
+			case 'g':
+				ft4222_qspi_gdb_send_str(conn, "xxxxxxxx");
+				break;
+			case 'p':
+				ft4222_qspi_gdb_send_str(conn, "xxxxxxxx");
+				break;
+			case 'H':
+			case 'T':
+				ft4222_qspi_gdb_send_str(conn, "OK");
+				break;
+			case 'c':
+			case 's':
+				ft4222_qspi_gdb_resume();
+				ft4222_qspi_gdb_send_str(conn, "S05");
+				break;
+			case 'm':
+				// Small reads are widened to words; -c regions let gdb's
+				// adjacent reads share full bursts through the block cache.
+				if ((sscanf(pkt + 1, "%x,%x", &addr, &len) != 2) || (len > QSPI_GDB_PACKET_SIZE/2))
+				{
+					ft4222_qspi_gdb_send_str(conn, "E01");
+					break;
+				}
+				if (!ft4222_qspi_span_read_any(ftHandle, addr, data, len))
+				{
+					ft4222_qspi_gdb_send_str(conn, "E05");
+					break;
+				}
+				for (i = 0; i < (int)len; i++)
+				{
+					reply[i*2]     = qspi_hex_digits[data[i] >> 4];
+					reply[i*2 + 1] = qspi_hex_digits[data[i] & 0xF];
+				}
+				ft4222_qspi_gdb_send(conn, reply, len * 2);
+				break;
+			case 'M':
+			case 'X':
+				colon = strchr(pkt, ':');
+				if ((colon == NULL) || (sscanf(pkt + 1, "%x,%x", &addr, &len) != 2) || (len > sizeof(data)))
+				{
+					ft4222_qspi_gdb_send_str(conn, "E01");
+					break;
+				}
+				if (pkt[0] == 'X')
+				{
+					if (ft4222_qspi_gdb_unescape(colon + 1, plen - (colon + 1 - pkt)) != (int)len)
+					{
+						ft4222_qspi_gdb_send_str(conn, "E01");
+						break;
+					}
+					memcpy(data, colon + 1, len);
+				}
+				else
+				{
+					if (plen - (colon + 1 - pkt) != (int)len * 2)
+					{
+						ft4222_qspi_gdb_send_str(conn, "E01");
+						break;
+					}
+					for (i = 0; i < (int)len * 2; i++)
+						if (ft4222_qspi_gdb_hexval(colon[1 + i]) < 0)
+							break;
+					if (i < (int)len * 2)
+					{
+						ft4222_qspi_gdb_send_str(conn, "E01");
+						break;
+					}
+					for (i = 0; i < (int)len; i++)
+						data[i] = (ft4222_qspi_gdb_hexval(colon[1 + i*2]) << 4) | ft4222_qspi_gdb_hexval(colon[2 + i*2]);
+				}
+				ft4222_qspi_gdb_send_str(conn, ft4222_qspi_span_write(ftHandle, addr, data, len) ? "OK" : "E05");
+				break;
+			case 'k':
+				return 1;
+			case 'D':
+				ft4222_qspi_gdb_send_str(conn, "OK");
+				return 1;
+			case 'q':
+				if (!strncmp(pkt, "qSupported", 10))
+				{
+					snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:memory-map:read+;QStartNoAckMode+", QSPI_GDB_PACKET_SIZE);
+					ft4222_qspi_gdb_send_str(conn, reply);
+				}
+				else if (!strcmp(pkt, "qAttached"))
+					ft4222_qspi_gdb_send_str(conn, "1");
+				else if (!strcmp(pkt, "qC"))
+					ft4222_qspi_gdb_send_str(conn, "QC1");
+				else if (!strcmp(pkt, "qfThreadInfo"))
+					ft4222_qspi_gdb_send_str(conn, "m1");
+				else if (!strcmp(pkt, "qsThreadInfo"))
+					ft4222_qspi_gdb_send_str(conn, "l");
+				else if (sscanf(pkt, "qXfer:memory-map:read::%x,%x", &offset, &len) == 2)
+				{
+					xml_len = snprintf(xml, sizeof(xml),
+							"<?xml version=\"1.0\"?><memory-map>"
+							"<memory type=\"ram\" start=\"0x%x\" length=\"0x%x\"/></memory-map>",
+							map_addr, map_size);
+					if (offset >= (unsigned int)xml_len)
+						ft4222_qspi_gdb_send_str(conn, "l");
+					else
+					{
+						if (len > xml_len - offset)
+							len = xml_len - offset;
+						reply[0] = (offset + len < (unsigned int)xml_len) ? 'm' : 'l';
+						memcpy(reply + 1, xml + offset, len);
+						ft4222_qspi_gdb_send(conn, reply, len + 1);
+					}
+				}
+				else
+					ft4222_qspi_gdb_send_str(conn, "");
+				break;
+			case 'Q':
+				if (!strcmp(pkt, "QStartNoAckMode"))
+				{
+					ft4222_qspi_gdb_send_str(conn, "OK");
+					conn->noack = 1;
+				}
+				else
+					ft4222_qspi_gdb_send_str(conn, "");
+				break;
+			case 'v':
+				if (!strncmp(pkt, "vCont", 5) && (pkt[5] == ';'))
+				{
+					ft4222_qspi_gdb_resume();
+					ft4222_qspi_gdb_send_str(conn, "S05");
+				}
+				else
+					ft4222_qspi_gdb_send_str(conn, "");
+				break;
+			default:
+				ft4222_qspi_gdb_send_str(conn, "");
+				break;
+		}
+	}
+	return 1;
+}
+
+static int ft4222_qspi_memory_gdbserver(FT_HANDLE ftHandle, int port, uint32_t map_addr, uint32_t map_size)
+{
+	int success = 1, listen_fd, one = 1;
+	struct sockaddr_in sa;
+	struct qspi_gdb_conn conn;
+
+	// Keep the advertised map inside the 32-bit space
+	if (map_addr && (map_size > 0 - map_addr))
+		map_size = 0 - map_addr;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+	{
+		printf("Failed to create gdb socket: %s\n", strerror(errno));
+		return 0;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if ((bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(listen_fd, 1) < 0))
+	{
+		printf("Failed to listen on port %d: %s\n", port, strerror(errno));
+		success = 0;
+		goto exit;
+	}
+
+	// The target keeps running while gdb thinks it is stopped, so memory
+	// stays uncached unless a -c region says otherwise
+	qspi_base_held = 1;
+
+	printf("Waiting for gdb on port %d ......\n", port);
+	for (;;)
+	{
+		memset(&conn, 0, sizeof(conn));
+		conn.fd = accept(listen_fd, NULL, NULL);
+		if (conn.fd < 0)
+			break;
+		setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		printf("gdb connected\n");
+		ft4222_qspi_gdb_session(ftHandle, &conn, map_addr, map_size);
+		close(conn.fd);
+		ft4222_qspi_cache_flush();
+		printf("gdb disconnected\n");
+	}
+
+exit:
+	qspi_base_held = 0;
+	close(listen_fd);
+	return success;
+}
+
+static int ft4222_qspi_memory_mount(FT_HANDLE ftHandle, uint32_t mem_addr, uint32_t size, char *mountpoint)
+{
+#ifdef FT4222_QSPI_FUSE
+	char *fuse_argv[] = {"ft4222-qspi", mountpoint, "-f", "-s", NULL};
+
+	if ((mem_addr % QSPI_DUMP_WORD) || (size % QSPI_DUMP_WORD) || (size == 0))
+	{
+		printf("QSPI mount needs a word aligned address and size.\n");
+		return 0;
+	}
+
+	qspi_fuse_handle = ftHandle;
+	qspi_fuse_base   = mem_addr;
+	qspi_fuse_size   = size;
+	qspi_fuse_last_end = 0;
+
+	printf("Serving 0x%08x-0x%08x at %s%s\n", mem_addr, mem_addr + size, mountpoint, QSPI_FUSE_FILE);
+	return fuse_main(4, fuse_argv, &ft4222_qspi_fuse_ops, NULL) == 0;
+#else
+	printf("%s was built without FUSE support.\n", "ft4222-qspi");
+	return 0;
+#endif
+}
+#endif
+
+// FTDI reports each interface as the chip serial plus its A/B letter
+static void ft4222_qspi_serial_base(char *base, const char *serial, size_t size)
+{
+	size_t len;
+
+	snprintf(base, size, "%s", serial);
+	len = strlen(base);
+	if ((len > 1) && ((base[len - 1] == 'A') || (base[len - 1] == 'B')))
+		base[len - 1] = '\0';
+}
+
+static int ft4222_qspi_serial_match(const char *base, const char *serial)
+{
+	size_t len = strlen(base);
+
+	if (strncmp(base, serial, len))
+		return 0;
+
+	return (serial[len] == '\0') ||
+		   (((serial[len] == 'A') || (serial[len] == 'B')) && (serial[len + 1] == '\0'));
+}
+
+static int ft4222_qspi_device_wanted(const char *serial, DWORD locId)
+{
+	char base[32];
+
+	if (qspi_serial_want)
+	{
+		ft4222_qspi_serial_base(base, serial, sizeof(base));
+		return ft4222_qspi_serial_match(base, qspi_serial_want) || !strcmp(serial, qspi_serial_want);
+	}
+	if (qspi_locid_want)
+		return locId == qspi_locid_want;
+
+	return 1;
+}
+
+// Device map and link records live in a directory only this user can
+// write, so nobody else can plant an entry that points -o/-O at another
+// chip or skips VIO, or redirect a save through a link. Returns the length
+// of the directory path, 0 when it is not private.
+static int ft4222_qspi_state_dir(char *path, size_t size)
+{
+	struct stat st;
+	int len;
+
+	len = snprintf(path, size, QSPI_STATE_DIR "/ft4222-qspi-%u", (unsigned int)getuid());
+	if (mkdir(path, 0700) && (errno != EEXIST))
+		return 0;
+	if (lstat(path, &st) || !S_ISDIR(st.st_mode) || (st.st_uid != getuid()) || (st.st_mode & 077))
+	{
+		printf("%s is not a private directory, device and link state are not kept.\n", path);
+		return 0;
+	}
+	return len;
+}
+
+static int ft4222_qspi_map_path(char *path, size_t size)
+{
+	int len = ft4222_qspi_state_dir(path, size);
+
+	if (len)
+		snprintf(path + len, size - len, "/" QSPI_DEVICE_MAP);
+	return len;
+}
+
+// The map file keeps "serial locA locB descA descB" per chip so -o/-O can
+// open the interfaces without building the device list.
+static int ft4222_qspi_map_lookup(DWORD *pLocIdA, DWORD *pLocIdB)
+{
+	FILE *fp;
+	char line[256], serial[32], descA[64], descB[64], path[160];
+	unsigned int locA, locB;
+	int found = 0;
+
+	if ((!qspi_serial_want && !qspi_locid_want) || !ft4222_qspi_map_path(path, sizeof(path)))
+		return 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+
+	while (!found && fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%31[^\t]\t%x\t%x\t%63[^\t]\t%63[^\n]", serial, &locA, &locB, descA, descB) != 5)
+			continue;
+		if (qspi_serial_want ? !ft4222_qspi_serial_match(serial, qspi_serial_want) : (locA != qspi_locid_want))
+			continue;
+
+		*pLocIdA = locA;
+		*pLocIdB = locB;
+		strcpy(qspi_serial, serial);
+		strcpy(ft4222A_desc, descA);
+		strcpy(ft4222B_desc, descB);
+		found = 1;
+	}
+
+	fclose(fp);
+	return found;
+}
+
+static void ft4222_qspi_map_save(DWORD locIdA, DWORD locIdB)
+{
+	FILE *in, *out;
+	char line[256], serial[32], path[160], tmpName[168];
+	unsigned int locA;
+	int fd;
+
+	if ((qspi_serial[0] == '\0') || !ft4222_qspi_map_path(path, sizeof(path)))
+		return;
+
+	snprintf(tmpName, sizeof(tmpName), "%s.XXXXXX", path);
+	fd = mkstemp(tmpName);
+	if (fd < 0)
+		return;
+	out = fdopen(fd, "w");
+	if (out == NULL)
+	{
+		close(fd);
+		unlink(tmpName);
+		return;
+	}
+
+	in = fopen(path, "r");
+	if (in)
+	{
+		while (fgets(line, sizeof(line), in))
+		{
+			if ((sscanf(line, "%31[^\t]\t%x", serial, &locA) == 2) &&
+				strcmp(serial, qspi_serial) && (locA != locIdA))
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s\t%08x\t%08x\t%s\t%s\n", qspi_serial, (unsigned int)locIdA, (unsigned int)locIdB,
+			ft4222A_desc, ft4222B_desc);
+	if (fclose(out) || rename(tmpName, path))
+		unlink(tmpName);
+}
+
+static int ft4222_qspi_read_sysfs(const char *path, char *value, size_t size)
+{
+	FILE *fp = fopen(path, "r");
+	int ok;
+
+	if (fp == NULL)
+		return 0;
+
+	ok = (fgets(value, size, fp) != NULL);
+	fclose(fp);
+	if (ok)
+		value[strcspn(value, "\n")] = '\0';
+	return ok;
+}
+
+// The kernel hands out a new device number on every plug-in, so boot id,
+// bus and device number name one plug-in of this chip.
+static int ft4222_qspi_plug_stamp(char *stamp, size_t size)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[320], value[64], bus[16], dev[16], boot[48];
+	int found = 0;
+
+	if ((qspi_serial[0] == '\0') ||
+		!ft4222_qspi_read_sysfs("/proc/sys/kernel/random/boot_id", boot, sizeof(boot)))
+		return 0;
+
+	dir = opendir(QSPI_USB_SYSFS);
+	if (dir == NULL)
+		return 0;
+
+	while (!found && ((ent = readdir(dir)) != NULL))
+	{
+		// Skip "." entries and interfaces, whose names carry a ':'
+		if ((ent->d_name[0] == '.') || strchr(ent->d_name, ':'))
+			continue;
+
+		snprintf(path, sizeof(path), QSPI_USB_SYSFS "/%s/serial", ent->d_name);
+		if (!ft4222_qspi_read_sysfs(path, value, sizeof(value)) || strcmp(value, qspi_serial))
+			continue;
+
+		snprintf(path, sizeof(path), QSPI_USB_SYSFS "/%s/busnum", ent->d_name);
+		if (!ft4222_qspi_read_sysfs(path, bus, sizeof(bus)))
+			continue;
+		snprintf(path, sizeof(path), QSPI_USB_SYSFS "/%s/devnum", ent->d_name);
+		if (!ft4222_qspi_read_sysfs(path, dev, sizeof(dev)))
+			continue;
+
+		snprintf(stamp, size, "%s:%s:%s", boot, bus, dev);
+		found = 1;
+	}
+
+	closedir(dir);
+	return found;
+}
+
+// Link records live in this user's state directory
+static int ft4222_qspi_link_state_path(char *path, size_t size)
+{
+	int len;
+
+	if (strchr(qspi_serial, '/') || !(len = ft4222_qspi_state_dir(path, size)))
+		return 0;
+	snprintf(path + len, size - len, "/%s.link", qspi_serial);
+	return 1;
+}
+
+static void ft4222_qspi_link_state_load(void)
+{
+	FILE *fp;
+	struct stat st;
+	char path[160], saved[96];
+	double vio;
+	int fd, drive;
+
+	memset(&qspi_link_state, 0, sizeof(qspi_link_state));
+	if (!ft4222_qspi_plug_stamp(qspi_link_state.stamp, sizeof(qspi_link_state.stamp)) ||
+		!ft4222_qspi_link_state_path(path, sizeof(path)))
+		return;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "r");
+	if (fp == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	// A record this user does not own is ignored, so VIO is applied again
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (st.st_uid == getuid()) &&
+		(fscanf(fp, "%95s %lf %d", saved, &vio, &drive) == 3) && !strcmp(saved, qspi_link_state.stamp))
+	{
+		qspi_link_state.valid = 1;
+		qspi_link_state.vio = vio;
+		qspi_link_state.drive = drive;
+	}
+	fclose(fp);
+}
+
+static void ft4222_qspi_link_state_save(double vio)
+{
+	FILE *fp;
+	char path[160], tmpName[168];
+	int fd;
+
+	if ((qspi_link_state.stamp[0] == '\0') || !ft4222_qspi_link_state_path(path, sizeof(path)))
+		return;
+
+	// mkstemp creates with O_EXCL, the rename replaces the record whole
+	snprintf(tmpName, sizeof(tmpName), "%s.XXXXXX", path);
+	fd = mkstemp(tmpName);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "w");
+	if (fp == NULL)
+	{
+		close(fd);
+		unlink(tmpName);
+		return;
+	}
+
+	fprintf(fp, "%s %.3f %d\n", qspi_link_state.stamp, vio, io_Loading);
+	if (fclose(fp) || rename(tmpName, path))
+	{
+		unlink(tmpName);
+		return;
+	}
+
+	qspi_link_state.valid = 1;
+	qspi_link_state.vio = vio;
+	qspi_link_state.drive = io_Loading;
+}
+
+// Config_Set_VIO re-inits GPIO and I2C on interface B and writes the DAC,
+// so it only runs when this plug-in has not seen the voltage yet or the
+// caller asked for it explicitly.
+static int ft4222_qspi_link_vio(FT_HANDLE ft4222BHandle, double vio, int force)
+{
+	if (!force && qspi_link_state.valid && (qspi_link_state.vio - vio < 0.001) && (vio - qspi_link_state.vio < 0.001))
+	{
+		// Later GPIO inits on interface B must keep the VIO enable driven
+		gpioDir[3] = GPIO_OUTPUT;
+		if (debug_printf == 'c')
+			printf("[QSPI LINK] VIO %.3fV already applied\n", vio);
+		return 1;
+	}
+
+	return Config_Set_VIO(ft4222BHandle, vio);
+}
+
+static int ft4222_qspi_find_device(DWORD *pLocIdA, DWORD *pLocIdB)
+{
+   int                       i, retCode = 0, found4222 = 0;
+   FT_STATUS                 ftStatus;
    FT_DEVICE_LIST_INFO_NODE  *devInfo = NULL;
-   FT4222_SPIClock           ftQspiClk = ft4222_convert_qspiclk(division); //Set QSPI CLK default CLK_DIV_128 80M/128=625Khz
    DWORD                     numDevs = 0;
-   DWORD                     ft4222A_LocId;
-   DWORD                     ft4222B_LocId;
-   size_t                    strLength;
-   char                      *strbuf = NULL;
-   char                      *scriptFile= NULL, *binaryFile= NULL;
-   unsigned int              addr,spi2ahb_base,data_value,tmp_value = 0x0;
 
     ftStatus = FT_CreateDeviceInfoList(&numDevs);
     if (ftStatus != FT_OK) 
@@ -1537,23 +6230,735 @@ int main(int argc, char **argv)
             // In mode 0, the FT4222H presents two interfaces: A and B.
             // In modes 1 and 2, it presents four interfaces: A, B, C and D.
 
-            size_t descLen = strlen(devInfo[i].Description);
-            
-            if ('A' == devInfo[i].Description[descLen - 1])
-            {
-				// Interface A may be configured as an SPI master.
-				ft4222A_LocId = devInfo[i].LocId;
-				strcpy(ft4222A_desc, devInfo[i].Description);
-            }
-            else if ('B' == devInfo[i].Description[descLen - 1])
-            {
-                // Interface B, C or D.
-                ft4222B_LocId = devInfo[i].LocId;
-				strcpy(ft4222B_desc, devInfo[i].Description);
-            }
-            found4222++;
-        }
-    }
+            size_t descLen = strlen(devInfo[i].Description);
+            
+            if ('A' == devInfo[i].Description[descLen - 1])
+            {
+				// Interface A may be configured as an SPI master.
+				if (!ft4222_qspi_device_wanted(devInfo[i].SerialNumber, devInfo[i].LocId))
+					continue;
+				*pLocIdA = devInfo[i].LocId;
+				strcpy(ft4222A_desc, devInfo[i].Description);
+				ft4222_qspi_serial_base(qspi_serial, devInfo[i].SerialNumber, sizeof(qspi_serial));
+				found4222++;
+            }
+        }
+    }
+
+    if (found4222 == 0)
+    {
+        printf("No FT4222H interface A found%s\n", (qspi_serial_want || qspi_locid_want) ? " for -o/-O" : "");
+        retCode = -20;
+        goto exit;
+    }
+
+    // Interface B comes from the same chip as the chosen interface A
+    for (i = 0, found4222 = 0; i < (int)numDevs; i++)
+    {
+        if (devInfo[i].Type == FT_DEVICE_4222H_0  ||
+            devInfo[i].Type == FT_DEVICE_4222H_1_2)
+        {
+            size_t descLen = strlen(devInfo[i].Description);
+
+            if (('B' == devInfo[i].Description[descLen - 1]) &&
+                ft4222_qspi_serial_match(qspi_serial, devInfo[i].SerialNumber))
+            {
+                *pLocIdB = devInfo[i].LocId;
+				strcpy(ft4222B_desc, devInfo[i].Description);
+				found4222++;
+            }
+        }
+    }
+
+    if (found4222 == 0)
+    {
+        printf("No FT4222H interface B found for %s\n", ft4222A_desc);
+        retCode = -20;
+        goto exit;
+    }
+
+    ft4222_qspi_map_save(*pLocIdA, *pLocIdB);
+
+exit:
+    free(devInfo);
+    return retCode;
+}
+
+static int ft4222_qspi_open_device(DWORD ft4222A_LocId, DWORD ft4222B_LocId,
+								   FT_HANDLE *pAHandle, FT_HANDLE *pBHandle)
+{
+    FT_STATUS                 ftStatus;
+
+    ftStatus = FT_OpenEx((PVOID)(uintptr_t)ft4222A_LocId,
+                         FT_OPEN_BY_LOCATION,
+                         pAHandle);
+    if (ftStatus != FT_OK)
+    {
+        printf("FT_OpenEx failed (error %d)\n",
+               (int)ftStatus);
+        return ftStatus;
+    }
+
+    ftStatus = FT_OpenEx((PVOID)(uintptr_t)ft4222B_LocId,
+                         FT_OPEN_BY_LOCATION,
+                         pBHandle);
+    if (ftStatus != FT_OK)
+    {
+        printf("FT_OpenEx failed (error %d)\n",
+               (int)ftStatus);
+        return ftStatus;
+    }
+    return 0;
+}
+
+// Open the cached interfaces straight away and confirm the chip serial on
+// both of them; a stale or missing entry falls back to the device list.
+static int ft4222_qspi_locate(FT_HANDLE *pAHandle, FT_HANDLE *pBHandle)
+{
+	DWORD ft4222A_LocId, ft4222B_LocId, devId;
+	FT_DEVICE devType;
+	char serial[64] = "", desc[64] = "";
+	int retCode;
+
+	if (ft4222_qspi_map_lookup(&ft4222A_LocId, &ft4222B_LocId))
+	{
+		if ((FT_OK == FT_OpenEx((PVOID)(uintptr_t)ft4222A_LocId, FT_OPEN_BY_LOCATION, pAHandle)) &&
+			(FT_OK == FT_GetDeviceInfo(*pAHandle, &devType, &devId, serial, desc, NULL)) &&
+			((devType == FT_DEVICE_4222H_0) || (devType == FT_DEVICE_4222H_1_2)) &&
+			ft4222_qspi_serial_match(qspi_serial, serial) &&
+			(FT_OK == FT_OpenEx((PVOID)(uintptr_t)ft4222B_LocId, FT_OPEN_BY_LOCATION, pBHandle)) &&
+			(FT_OK == FT_GetDeviceInfo(*pBHandle, &devType, &devId, serial, desc, NULL)) &&
+			ft4222_qspi_serial_match(qspi_serial, serial))
+			return 0;
+
+		if (debug_printf == 'c')
+			printf("[QSPI LINK] stale entry for %s, scanning devices\n", qspi_serial);
+		if (*pAHandle)
+			(void)FT_Close(*pAHandle);
+		if (*pBHandle)
+			(void)FT_Close(*pBHandle);
+		*pAHandle = NULL;
+		*pBHandle = NULL;
+		qspi_serial[0] = '\0';
+	}
+
+	retCode = ft4222_qspi_find_device(&ft4222A_LocId, &ft4222B_LocId);
+	if (retCode)
+		return retCode;
+
+	return ft4222_qspi_open_device(ft4222A_LocId, ft4222B_LocId, pAHandle, pBHandle);
+}
+
+// SPI master init on the SSxO of qspi_target
+static int ft4222_qspi_link_sso(FT_HANDLE ft4222AHandle, FT4222_SPIClock ftQspiClk)
+{
+    FT4222_STATUS             ft4222Status;
+
+    if (qspi_plan.enabled)
+    {
+        qspi_target_active = qspi_target;
+        return 1;
+    }
+
+    // Configure the FT4222 as an SPI Master.
+    ft4222Status = FT4222_SPIMaster_Init(
+                        ft4222AHandle,
+                        SPI_IO_QUAD, // 4 channel
+                        ftQspiClk, // 80 MHz / 128 == 625KHz
+                        CLK_IDLE_LOW, // clock idles at logic 0
+                        CLK_LEADING, // data captured on rising edge
+                        SLAVE_SELECT(qspi_target)); // Use SSxO of the selected target
+    if (FT4222_OK != ft4222Status)
+    {
+        printf("FT4222_SPIMaster_Init failed (error %d)\n",
+               (int)ft4222Status);
+        return 0;
+    }
+    qspi_target_active = qspi_target;
+    return 1;
+}
+
+static int ft4222_qspi_link_init(FT_HANDLE ft4222AHandle, FT4222_SPIClock ftQspiClk)
+{
+    FT4222_STATUS             ft4222Status;
+
+    if (qspi_wait_auto)
+        ft4222_qspi_wait_cycle_auto(ftQspiClk);
+
+    if (!ft4222_qspi_link_sso(ft4222AHandle, ftQspiClk))
+        return 0;
+    if (qspi_plan.enabled)
+        return 1;
+
+    // Drive strength stays in the chip until it is unplugged
+    if (qspi_link_state.valid && (qspi_link_state.drive == io_Loading))
+        return 1;
+
+    ft4222Status = FT4222_SPI_SetDrivingStrength(ft4222AHandle,
+                                                 io_Loading,
+                                                 io_Loading,
+                                                 io_Loading);
+    if (FT4222_OK != ft4222Status)
+    {
+        printf("FT4222_SPI_SetDrivingStrength failed (error %d)\n",
+               (int)ft4222Status);
+        return 0;
+    }
+    return 1;
+}
+
+struct qspi_map;
+
+struct ft4222_qspi_session {
+	FT_HANDLE        ft4222AHandle;
+	FT_HANDLE        ft4222BHandle;
+	// Serialises the bus between callers and the mapping fault threads
+	pthread_mutex_t  lock;
+	struct qspi_map *maps;
+	// Sends combined writes on their deadline while the caller is idle
+	pthread_cond_t   flush_cond;
+	pthread_t        flusher;
+	int              flusher_run;
+	int              flush_error;
+};
+
+// A target range behind a userfaultfd registered host range. Pages start
+// absent, are read in on first touch and, when the kernel can write
+// protect them, only turn dirty on the first write after each flush.
+struct qspi_map {
+	struct qspi_map     *next;
+	ft4222_qspi_session *session;
+	uint8_t             *host;
+	uint32_t             mem_addr;
+	uint32_t             size;
+	size_t               len;
+	size_t               page;
+	int                  uffd;
+	int                  wake[2];
+	int                  error;
+	pthread_t            thread;
+	uint8_t             *state;
+	uint8_t             *bounce;
+	size_t               next_seq;
+	size_t               readahead;
+};
+
+// Sleeps until the pending combined words are due and sends them. Runs
+// under the session lock except while waiting on flush_cond, which a
+// write that starts a pending run or a new timeout signals.
+static void *ft4222_qspi_session_flusher(void *arg)
+{
+	ft4222_qspi_session *session = arg;
+	struct timespec due;
+	uint64_t due_us;
+
+	pthread_mutex_lock(&session->lock);
+	while (session->flusher_run)
+	{
+		if (!qspi_combine.enabled || !qspi_combine.pending || !qspi_combine.timeout_ms)
+		{
+			pthread_cond_wait(&session->flush_cond, &session->lock);
+			continue;
+		}
+
+		due_us = qspi_combine.since_us + (uint64_t)qspi_combine.timeout_ms * 1000;
+		if (qspi_time_us() < due_us)
+		{
+			due.tv_sec = due_us / 1000000;
+			due.tv_nsec = (due_us % 1000000) * 1000;
+			pthread_cond_timedwait(&session->flush_cond, &session->lock, &due);
+			continue;
+		}
+		if (!ft4222_qspi_combine_flush(session->ft4222AHandle))
+			session->flush_error = 1;
+	}
+	pthread_mutex_unlock(&session->lock);
+	return NULL;
+}
+
+ft4222_qspi_session *ft4222_qspi_session_open(int division, double vio, int swap_word)
+{
+	ft4222_qspi_session *session = calloc(1, sizeof(*session));
+	pthread_condattr_t attr;
+	int vio_ok;
+
+	if (session == NULL)
+		return NULL;
+	pthread_mutex_init(&session->lock, NULL);
+	// Deadlines come from qspi_time_us, which is CLOCK_MONOTONIC
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&session->flush_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ft4222_qspi_locate(&session->ft4222AHandle, &session->ft4222BHandle))
+		goto fail;
+
+	ft4222_qspi_link_state_load();
+	vio_ok = ft4222_qspi_link_vio(session->ft4222BHandle, vio, 1);
+	if (!ft4222_qspi_link_init(session->ft4222AHandle, ft4222_convert_qspiclk(division)))
+		goto fail;
+	if (vio_ok)
+		ft4222_qspi_link_state_save(vio);
+
+	qspi_swapword = swap_word;
+	return session;
+
+fail:
+	ft4222_qspi_session_close(session);
+	return NULL;
+}
+
+void ft4222_qspi_session_close(ft4222_qspi_session *session)
+{
+	if (session == NULL)
+		return;
+
+	while (session->maps != NULL)
+		ft4222_qspi_session_unmap(session, session->maps->host);
+
+	if (session->flusher_run)
+	{
+		pthread_mutex_lock(&session->lock);
+		session->flusher_run = 0;
+		pthread_cond_signal(&session->flush_cond);
+		pthread_mutex_unlock(&session->lock);
+		pthread_join(session->flusher, NULL);
+	}
+
+	if (session->ft4222AHandle)
+		ft4222_qspi_combine_flush(session->ft4222AHandle);
+	qspi_combine.enabled = 0;
+
+	if (session->ft4222AHandle)
+		(void)FT_Close(session->ft4222AHandle);
+	if (session->ft4222BHandle)
+		(void)FT_Close(session->ft4222BHandle);
+	pthread_cond_destroy(&session->flush_cond);
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
+
+int ft4222_qspi_session_select(ft4222_qspi_session *session, int target)
+{
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	success = ft4222_qspi_select_target(session->ft4222AHandle, target);
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+int ft4222_qspi_session_combine(ft4222_qspi_session *session, int timeout_ms)
+{
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	success = ft4222_qspi_combine_flush(session->ft4222AHandle);
+	if (success)
+	{
+		qspi_combine.enabled = (timeout_ms >= 0);
+		qspi_combine.timeout_ms = (timeout_ms > 0) ? timeout_ms : 0;
+	}
+	if (success && qspi_combine.timeout_ms && !session->flusher_run)
+	{
+		session->flusher_run = 1;
+		if (pthread_create(&session->flusher, NULL, ft4222_qspi_session_flusher, session))
+		{
+			session->flusher_run = 0;
+			success = 0;
+		}
+	}
+	pthread_cond_signal(&session->flush_cond);
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+int ft4222_qspi_session_barrier(ft4222_qspi_session *session)
+{
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	success = ft4222_qspi_combine_flush(session->ft4222AHandle) && !session->flush_error;
+	session->flush_error = 0;
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+// Word aligned transfers burst straight in and out of the caller's
+// buffer, a -W swapped write through one burst on the stack; anything
+// else goes through a bounce buffer.
+static int ft4222_qspi_session_span_read(ft4222_qspi_session *session, uint32_t mem_addr, void *buf, uint32_t len)
+{
+	if ((mem_addr % QSPI_DUMP_WORD) || (len % QSPI_DUMP_WORD))
+		return ft4222_qspi_span_read_any(session->ft4222AHandle, mem_addr, buf, len);
+
+	return ft4222_qspi_span_read(session->ft4222AHandle, mem_addr, buf, len);
+}
+
+static int ft4222_qspi_session_span_write(ft4222_qspi_session *session, uint32_t mem_addr, const void *buf, uint32_t len)
+{
+	uint32_t done = 0, chunk;
+	uint8_t burst[QSPI_CMD_WRITE_MAX], *src;
+
+	if ((mem_addr % QSPI_DUMP_WORD) || (len % QSPI_DUMP_WORD))
+		return ft4222_qspi_span_write(session->ft4222AHandle, mem_addr, buf, len);
+
+	while (done < len)
+	{
+		chunk = ft4222_qspi_burst_fit(len - done);
+		if (((mem_addr + done) % QSPI_ACCESS_WINDOW) + chunk > QSPI_ACCESS_WINDOW)
+			chunk = QSPI_DUMP_WORD;
+		src = (uint8_t *)buf + done;
+		if (qspi_swapword & QSPI_W_SWAP_WORD)
+		{
+			memcpy(burst, src, chunk);
+			ft4222_qspi_span_swap(burst, chunk, QSPI_W_SWAP_WORD);
+			src = burst;
+		}
+		if (!ft4222_qspi_memory_write(session->ft4222AHandle, mem_addr + done, src, chunk))
+			return 0;
+		done += chunk;
+	}
+	return 1;
+}
+
+int ft4222_qspi_session_read(ft4222_qspi_session *session, uint32_t mem_addr, void *buf, uint32_t len)
+{
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	success = ft4222_qspi_session_span_read(session, mem_addr, buf, len);
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+int ft4222_qspi_session_write(ft4222_qspi_session *session, uint32_t mem_addr, const void *buf, uint32_t len)
+{
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	success = ft4222_qspi_session_span_write(session, mem_addr, buf, len);
+	if (qspi_combine.pending)
+		pthread_cond_signal(&session->flush_cond);
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+// Read the absent pages from index on, as many as the readahead allows,
+// and install them. A fault on the page after the previous fill doubles
+// the readahead, any other fault starts over at one page. A failed read
+// installs nothing; the faulting thread gets SIGBUS instead of zeros.
+static void ft4222_qspi_map_fill(struct qspi_map *map, size_t index, pid_t tid)
+{
+	struct uffdio_copy copy;
+	size_t npages = map->len / map->page, count, i;
+	uint32_t offset = index * map->page, bytes;
+
+	map->readahead = ((index == map->next_seq) && map->readahead) ? map->readahead * 2 : 1;
+	if (map->readahead > QSPI_MAP_READAHEAD)
+		map->readahead = QSPI_MAP_READAHEAD;
+
+	for (count = 0; (count < map->readahead) && (index + count < npages); count++)
+		if (map->state[index + count] != QSPI_MAP_ABSENT)
+			break;
+	if (count == 0)
+		return;
+
+	// The tail of the last page lies past the range and stays zero
+	bytes = count * map->page;
+	if (offset + bytes > map->size)
+		bytes = map->size - offset;
+	memset(map->bounce + bytes, 0, count * map->page - bytes);
+	if (!ft4222_qspi_session_span_read(map->session, map->mem_addr + offset, map->bounce, bytes))
+	{
+		printf("Failed to read mapped page at 0x%08x.\n", map->mem_addr + offset);
+		map->error = 1;
+		map->readahead = 0;
+		syscall(__NR_tgkill, getpid(), tid, SIGBUS);
+		return;
+	}
+
+	copy.dst = (uintptr_t)(map->host + offset);
+	copy.src = (uintptr_t)map->bounce;
+	copy.len = count * map->page;
+	copy.mode = UFFDIO_COPY_MODE_WP;
+	copy.copy = 0;
+	if (ioctl(map->uffd, UFFDIO_COPY, &copy) && (errno != EEXIST))
+		printf("UFFDIO_COPY at 0x%08x failed: %s\n", map->mem_addr + offset, strerror(errno));
+
+	for (i = 0; (copy.copy > 0) && (i < (size_t)copy.copy / map->page); i++)
+		map->state[index + i] = QSPI_MAP_CLEAN;
+	map->next_seq = index + count;
+}
+
+// First write to a clean page: note it and let the write through
+static void ft4222_qspi_map_dirty(struct qspi_map *map, size_t index)
+{
+	struct uffdio_writeprotect wp;
+
+	map->state[index] = QSPI_MAP_DIRTY;
+	wp.range.start = (uintptr_t)(map->host + index * map->page);
+	wp.range.len = map->page;
+	wp.mode = 0;
+	if (ioctl(map->uffd, UFFDIO_WRITEPROTECT, &wp))
+		printf("UFFDIO_WRITEPROTECT at 0x%08x failed: %s\n", map->mem_addr + (uint32_t)(index * map->page),
+			   strerror(errno));
+}
+
+static void *ft4222_qspi_map_thread(void *arg)
+{
+	struct qspi_map *map = arg;
+	struct uffd_msg msg;
+	struct pollfd fds[2];
+	size_t index;
+
+	fds[0].fd = map->uffd;
+	fds[0].events = POLLIN;
+	fds[1].fd = map->wake[0];
+	fds[1].events = POLLIN;
+
+	while (1)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (read(map->uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		index = (msg.arg.pagefault.address - (uintptr_t)map->host) / map->page;
+		pthread_mutex_lock(&map->session->lock);
+		if (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)
+			ft4222_qspi_map_dirty(map, index);
+		else
+			ft4222_qspi_map_fill(map, index, msg.arg.pagefault.feat.ptid);
+		pthread_mutex_unlock(&map->session->lock);
+	}
+	return NULL;
+}
+
+static struct qspi_map *ft4222_qspi_map_find(ft4222_qspi_session *session, void *host, struct qspi_map ***plink)
+{
+	struct qspi_map **link;
+
+	for (link = &session->maps; *link != NULL; link = &(*link)->next)
+		if ((*link)->host == host)
+		{
+			if (plink)
+				*plink = link;
+			return *link;
+		}
+	printf("%p is not a mapping of this session.\n", host);
+	return NULL;
+}
+
+void *ft4222_qspi_session_map(ft4222_qspi_session *session, uint32_t mem_addr, uint32_t len)
+{
+	struct qspi_map *map;
+	struct uffdio_api api;
+	struct uffdio_register reg;
+
+	if ((len == 0) || (mem_addr % QSPI_DUMP_WORD) || (len % QSPI_DUMP_WORD))
+	{
+		printf("Map range 0x%08x+0x%x is empty or not word aligned.\n", mem_addr, len);
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(*map));
+	if (map == NULL)
+		return NULL;
+	map->session = session;
+	map->mem_addr = mem_addr;
+	map->size = len;
+	map->page = sysconf(_SC_PAGESIZE);
+	map->len = ((size_t)len + map->page - 1) / map->page * map->page;
+	map->uffd = -1;
+	map->wake[0] = map->wake[1] = -1;
+	map->host = MAP_FAILED;
+
+	map->state = calloc(map->len / map->page, 1);
+	map->bounce = malloc(QSPI_MAP_READAHEAD * map->page);
+	if ((map->state == NULL) || (map->bounce == NULL))
+		goto fail;
+
+	// Kernel-mode faults need privilege; user-mode only still serves the
+	// caller's own loads and stores
+	map->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if ((map->uffd < 0) && (errno == EPERM))
+		map->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (map->uffd < 0)
+	{
+		printf("userfaultfd failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_THREAD_ID;
+	if (ioctl(map->uffd, UFFDIO_API, &api))
+	{
+		printf("UFFDIO_API failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	map->host = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->host == MAP_FAILED)
+	{
+		printf("Failed to reserve %zu bytes: %s\n", map->len, strerror(errno));
+		goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = (uintptr_t)map->host;
+	reg.range.len = map->len;
+	// Without write protection every page read would have to be written
+	// back, turning reads into writes
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+	if (!(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) || ioctl(map->uffd, UFFDIO_REGISTER, &reg))
+	{
+		printf("UFFDIO_REGISTER with write protection failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if (pipe(map->wake) || pthread_create(&map->thread, NULL, ft4222_qspi_map_thread, map))
+	{
+		printf("Failed to start the fault thread.\n");
+		goto fail;
+	}
+
+	pthread_mutex_lock(&session->lock);
+	map->next = session->maps;
+	session->maps = map;
+	pthread_mutex_unlock(&session->lock);
+	return map->host;
+
+fail:
+	if (map->host != MAP_FAILED)
+		munmap(map->host, map->len);
+	if (map->uffd >= 0)
+		close(map->uffd);
+	if (map->wake[0] >= 0)
+	{
+		close(map->wake[0]);
+		close(map->wake[1]);
+	}
+	free(map->state);
+	free(map->bounce);
+	free(map);
+	return NULL;
+}
+
+// Each run of dirty pages is protected again before it is copied out, so
+// a store racing the flush faults and dirties its page for the next sync.
+int ft4222_qspi_session_sync(ft4222_qspi_session *session, void *host)
+{
+	struct qspi_map *map;
+	struct uffdio_writeprotect wp;
+	size_t npages, first, last;
+	uint32_t offset, bytes;
+	int success;
+
+	pthread_mutex_lock(&session->lock);
+	map = ft4222_qspi_map_find(session, host, NULL);
+	if (map == NULL)
+	{
+		pthread_mutex_unlock(&session->lock);
+		return 0;
+	}
+
+	success = !map->error;
+	npages = map->len / map->page;
+	for (first = 0; first < npages; first = last)
+	{
+		if (map->state[first] != QSPI_MAP_DIRTY)
+		{
+			last = first + 1;
+			continue;
+		}
+		for (last = first; (last < npages) && (map->state[last] == QSPI_MAP_DIRTY); last++)
+			map->state[last] = QSPI_MAP_CLEAN;
+
+		wp.range.start = (uintptr_t)(map->host + first * map->page);
+		wp.range.len = (last - first) * map->page;
+		wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+		if (ioctl(map->uffd, UFFDIO_WRITEPROTECT, &wp))
+			printf("UFFDIO_WRITEPROTECT failed: %s\n", strerror(errno));
+
+		offset = first * map->page;
+		bytes = (last - first) * map->page;
+		if (offset + bytes > map->size)
+			bytes = map->size - offset;
+		if (!ft4222_qspi_session_span_write(session, map->mem_addr + offset, map->host + offset, bytes))
+		{
+			printf("Failed to write back mapped pages at 0x%08x.\n", map->mem_addr + offset);
+			for (; first < last; first++)
+				map->state[first] = QSPI_MAP_DIRTY;
+			success = 0;
+		}
+	}
+	if (success)
+		success = ft4222_qspi_combine_flush(session->ft4222AHandle);
+	pthread_mutex_unlock(&session->lock);
+	return success;
+}
+
+int ft4222_qspi_session_unmap(ft4222_qspi_session *session, void *host)
+{
+	struct qspi_map *map, **link;
+	int success;
+
+	success = ft4222_qspi_session_sync(session, host);
+
+	pthread_mutex_lock(&session->lock);
+	map = ft4222_qspi_map_find(session, host, &link);
+	if (map != NULL)
+		*link = map->next;
+	pthread_mutex_unlock(&session->lock);
+	if (map == NULL)
+		return 0;
+
+	if (write(map->wake[1], "", 1) == 1)
+		pthread_join(map->thread, NULL);
+	close(map->wake[0]);
+	close(map->wake[1]);
+	close(map->uffd);
+	munmap(map->host, map->len);
+	free(map->state);
+	free(map->bounce);
+	free(map);
+	return success;
+}
+
+#ifndef FT4222_QSPI_LIBRARY
+int main(int argc, char **argv)
+{
+   int division = QSPI_DEFAULT_DIV,write_op = 0, read_op = 0,
+       addr_set = 0, data_set = 0, show_base = 0,
+	   show_ft4222_ver = 0, dump_show = 0, dump_size = 0,
+	   string_send = 0, script_send = 0, binary_send = 0, stdin_send = 0,
+	   retCode = 0, ioVoltage_set = 0, verify_set = 0,
+	   poll_set = 0, poll_args = 0, size_set = 0, gdb_port = 0,
+	   target_num = 0, targets[QSPI_TARGET_MAX], ready_port = -1, vio_ok = 0,
+	   next_option;  /* getopt iteration var */
+   double                    ft4222IOVoltage = 1.8;
+   FT_HANDLE                 ft4222AHandle = (FT_HANDLE)NULL;
+   FT_HANDLE                 ft4222BHandle = (FT_HANDLE)NULL;
+   FT4222_SPIClock           ftQspiClk = ft4222_convert_qspiclk(division); //Set QSPI CLK default CLK_DIV_128 80M/128=625Khz
+   size_t                    strLength;
+   char                      *strbuf = NULL;
+   char                      *scriptFile= NULL, *binaryFile= NULL, *mountDir = NULL,
+                             *snapFile = NULL, *diffFile = NULL, *diffFile2 = NULL,
+                             *traceFile = NULL, *replayFile = NULL, *exportFile = NULL, *exportJson = NULL,
+                             *manifestFile = NULL, *planCost = NULL;
+   unsigned int              addr,spi2ahb_base,data_value,tmp_value = 0x0;
+   unsigned int              range_size = 0;
+   unsigned int              poll_mask = 0, poll_value = 0, poll_timeout = 0, poll_interval = 0;
 
    /* Parse options if any */
    do {
@@ -1563,6 +6968,9 @@ int main(int argc, char **argv)
       case 'b':
 			show_base = 1;
 		 break;
+	  case 'I':
+			stdin_send = 1;
+		 break;
 	  case 'B':
 			strLength = strlen(optarg);
 			binaryFile = malloc(strLength);
@@ -1573,20 +6981,125 @@ int main(int argc, char **argv)
 	     addr = get_ul_number(optarg);
 		 addr_set = 1;
          break;
+      case 'c':
+			if (!ft4222_qspi_cache_add_region(optarg))
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+         break;
       case 'D':
 	     data_value = get_ul_number(optarg);
 		 data_set =1;
          break;
+      case 'A':
+			qspi_adaptive = 1;
+         break;
       case 'd':
 	     division = atoi(optarg);
+			if (division < 2)
+			{
+				printf("QSPI clock divider '%s' is not 2~512\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
 		 ftQspiClk = ft4222_convert_qspiclk(division);
+			// Keep the power of two the FT4222 actually runs at
+			for (qspi_division = 2; (qspi_division * 2 <= division) && (qspi_division < QSPI_ADAPT_MAX_DIV); qspi_division *= 2)
+				;
+			qspi_division_min = qspi_division;
          break;
       case 'g':
 			debug_printf = atoi(optarg);
          break;
+      case 'G':
+			gdb_port = atoi(optarg);
+         break;
+      case 'i':
+			// GPIO0/1 carry the VIO DAC I2C and GPIO3 enables it
+			ready_port = atoi(optarg);
+			if (ready_port != 2)
+			{
+				printf("QSPI ready line must be on GPIO2\n");
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+			if (strchr(optarg, 'f'))
+				qspi_ready_trigger = GPIO_TRIGGER_FALLING;
+         break;
+      case 'j':
+			qspi_journal_name = optarg;
+         break;
+      case 'J':
+			qspi_journal_every = atoi(optarg);
+			if (qspi_journal_every <= 0)
+				qspi_journal_every = QSPI_JOURNAL_EVERY;
+         break;
+      case 'k':
+			if (!ft4222_qspi_wait_cycle_set(optarg))
+			{
+				printf("QSPI wait cycle '%s' is not auto or 0~%d\n", optarg, QSPI_WAIT_CYCLE_MAX);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
       case 'l':
 			delay_cycle = atoi(optarg);
          break;
+      case 'n':
+			snapFile = optarg;
+         break;
+      case 'C':
+			qspi_combine.enabled = 1;
+			qspi_combine.timeout_ms = get_int_number(optarg);
+			if (qspi_combine.timeout_ms < 0)
+			{
+				printf("Write combining timeout '%s' is not a number of ms\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
+      case 'E':
+			exportFile = optarg;
+			exportJson = strchr(optarg, ',');
+			if (exportJson == NULL)
+			{
+				printf("Trace export '%s' is not <trace>,<json>\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+			*exportJson++ = '\0';
+         break;
+      case 'T':
+			traceFile = optarg;
+         break;
+      case 'X':
+			{
+				char *mode = strchr(optarg, ',');
+
+				replayFile = optarg;
+				qspi_transport = ft4222_qspi_null_transport;
+				if (mode)
+				{
+					*mode++ = '\0';
+					if (strcmp(mode, "hw"))
+					{
+						printf("Replay target '%s' is not hw\n", mode);
+						print_usage(stderr, argv[0], EXIT_FAILURE);
+					}
+					qspi_transport = FT4222_SPIMaster_MultiReadWrite;
+				}
+			}
+         break;
+      case 'N':
+			diffFile = optarg;
+			diffFile2 = strchr(optarg, ',');
+			if (diffFile2)
+				*diffFile2++ = '\0';
+         break;
+      case 'o':
+			qspi_serial_want = optarg;
+         break;
+      case 'O':
+			qspi_locid_want = get_ul_number(optarg);
+			if ((qspi_locid_want == 0) || (qspi_locid_want == (DWORD)-1))
+			{
+				printf("FT4222H location ID '%s' is not hex\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
       case 'L':
 			io_Loading = atoi(optarg);
 			if ((io_Loading < DS_4MA) || (io_Loading > DS_16MA))
@@ -1597,13 +7110,93 @@ int main(int argc, char **argv)
          break;
       case 'h':
          print_usage(stdout, argv[0], EXIT_SUCCESS);
+      case 'm':
+			if (!ft4222_qspi_rmw_add(optarg))
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+         break;
+      case 'M':
+			mountDir = optarg;
+         break;
       case 'p':
 			dump_size = atoi(optarg);
 			dump_show = 1;
          break;
+      case 'f':
+			if (!ft4222_qspi_dump_format_set(optarg))
+			{
+				printf("Dump format '%s' is not words[:1~%d], hex, raw or ihex\n", optarg, QSPI_DUMP_COL_MAX);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
+      case 'F':
+			manifestFile = optarg;
+         break;
+      case 'u':
+			if (!ft4222_qspi_memtest_add(optarg))
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+         break;
+      case 'Y':
+			if (!ft4222_qspi_watch_add(optarg))
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+         break;
+      case 'U':
+			{
+				char *mode = strchr(optarg, ',');
+
+				qspi_watch.log = optarg;
+				if (mode)
+				{
+					*mode++ = '\0';
+					if (strcmp(mode, "bin"))
+					{
+						printf("Watch log format '%s' is not bin\n", mode);
+						print_usage(stderr, argv[0], EXIT_FAILURE);
+					}
+					qspi_watch.binary = 1;
+				}
+			}
+         break;
+      case 'Z':
+			qspi_watch.samples = strtoul(optarg, NULL, 0);
+         break;
+      case 'K':
+			if (sscanf(optarg, "%d,%d", &qspi_watch.rt_prio, &qspi_watch.cpu) < 1)
+			{
+				printf("Realtime '%s' is not <prio>[,<cpu>]\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
+      case 'Q':
+			qspi_plan.enabled = 1;
+         break;
+      case 'e':
+			planCost = optarg;
+			qspi_plan.enabled = 1;
+         break;
+      case 'q':
+			qspi_posted = get_int_number(optarg);
+			// One status read only answers for what the bridge still holds
+			if ((qspi_posted < 1) || (qspi_posted > QSPI_POST_DEPTH))
+			{
+				printf("Posted batch '%s' is not 1~%d bursts\n", optarg, QSPI_POST_DEPTH);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+         break;
+      case 'P':
+			poll_args = sscanf(optarg, "%x,%x,%u,%u", &poll_mask, &poll_value, &poll_timeout, &poll_interval);
+			if (poll_args < 3)
+			{
+				printf("QSPI poll '%s' is not <mask,value,timeout_ms[,interval_us]>\n", optarg);
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+			poll_set = 1;
+         break;
       case 'r':
 			read_op = 1;
          break;
+      case 'R':
+			qspi_resume = 1;
+         break;
       case 's':
 			strLength = strlen(optarg);
 			strbuf = malloc(strLength);
@@ -1630,15 +7223,37 @@ int main(int argc, char **argv)
 			printf("Setting QSPI IO Voltage %f done\n",(double)ft4222IOVoltage);
 			ioVoltage_set = 1;
 		break;
+      case 't':
+			{
+				char *tok, *saveptr = NULL;
+				for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr))
+				{
+					if ((target_num >= QSPI_TARGET_MAX) || (get_int_number(tok) < 0) || (get_int_number(tok) >= QSPI_TARGET_MAX))
+					{
+						printf("QSPI target '%s' is not SS0O ~ SS%dO\n", tok, QSPI_TARGET_MAX - 1);
+						print_usage(stderr, argv[0], EXIT_FAILURE);
+					}
+					targets[target_num++] = get_int_number(tok);
+				}
+				qspi_target = targets[0];
+			}
+         break;
       case 'w':
 			write_op = 1;
          break;
       case 'W':
 			qspi_swapword = atoi(optarg);
          break;
+      case 'x':
+			qspi_retry_max = atoi(optarg);
+         break;
       case 'y':
 			verify_set = 1;
          break;
+      case 'z':
+			range_size = get_ul_number(optarg);
+			size_set = 1;
+         break;
       case '?':   /* Invalid options */
          print_usage(stderr, argv[0], EXIT_FAILURE);
       case -1:   /* Done with options */
@@ -1648,44 +7263,73 @@ int main(int argc, char **argv)
       }
    } while (next_option != -1);
 
-	if (!ioVoltage_set)
+	// Two snapshots diff on the host alone
+	if (diffFile2)
 	{
-		printf("QSPI IO voltage is not setting\n");
-		print_usage(stderr, argv[0], EXIT_FAILURE);
+		retCode = ft4222_qspi_snapshot_diff(NULL, diffFile, diffFile2) ? 0 : -30;
+		goto exit;
 	}
 
-    ftStatus = FT_OpenEx((PVOID)(uintptr_t)ft4222A_LocId,
-                         FT_OPEN_BY_LOCATION,
-                         &ft4222AHandle);
-    if (ftStatus != FT_OK)
-    {
-        printf("FT_OpenEx failed (error %d)\n",
-               (int)ftStatus);
-		retCode = ftStatus;
-        goto exit;
-    }
-
-    ftStatus = FT_OpenEx((PVOID)(uintptr_t)ft4222B_LocId,
-                         FT_OPEN_BY_LOCATION,
-                         &ft4222BHandle);
-    if (ftStatus != FT_OK)
-    {
-        printf("FT_OpenEx failed (error %d)\n",
-               (int)ftStatus);
-		retCode = ftStatus;
-        goto exit;
-    }
+	if (exportFile)
+	{
+		retCode = ft4222_qspi_trace_export(exportFile, exportJson) ? 0 : -30;
+		goto exit;
+	}
 
-	if (ioVoltage_set)
+	if (replayFile && (qspi_transport == ft4222_qspi_null_transport))
 	{
-		Config_Set_VIO(ft4222BHandle, ft4222IOVoltage);
+		retCode = ft4222_qspi_trace_replay(NULL, replayFile) ? 0 : -30;
+		goto exit;
 	}
 
-	if (show_ft4222_ver)
+	if (qspi_plan.enabled)
 	{
-		printf("%s %s-%s\n", argv[0], FT4222_QSPI_TOOL_GIT_TAG, FT4222_QSPI_TOOL_GIT_COMMIT);
-		showVersion(ft4222AHandle,ft4222A_desc);
-		showVersion(ft4222BHandle,ft4222B_desc);
+		// Watch, gdb, mount, poll and modify loop on what they read back, the
+		// plan transport cannot model them and they must not reach the board
+		if (qspi_watch.num || gdb_port || mountDir || poll_set || qspi_rmw_num)
+		{
+			printf("Plan cannot model -Y, -G, -M, -P or -m\n");
+			print_usage(stderr, argv[0], EXIT_FAILURE);
+		}
+		// Nothing below touches the board, the handles stay NULL
+		qspi_transport = ft4222_qspi_plan_transport;
+		ft4222_qspi_plan_defaults();
+		if (planCost && !ft4222_qspi_plan_calibrate(planCost))
+		{
+			retCode = -30;
+			goto exit;
+		}
+		if (verify_set || qspi_memtest_num)
+			printf("Plan: reads return zeros, verify and memtest results are not meaningful.\n");
+	}
+	else
+	{
+		retCode = ft4222_qspi_locate(&ft4222AHandle, &ft4222BHandle);
+		if (retCode)
+			goto exit;
+
+		ft4222_qspi_link_state_load();
+		if (!ioVoltage_set)
+		{
+			if (!qspi_link_state.valid)
+			{
+				printf("QSPI IO voltage is not setting\n");
+				print_usage(stderr, argv[0], EXIT_FAILURE);
+			}
+			ft4222IOVoltage = qspi_link_state.vio;
+		}
+
+		vio_ok = ft4222_qspi_link_vio(ft4222BHandle, ft4222IOVoltage, ioVoltage_set);
+
+		if (ready_port >= 0)
+			ft4222_qspi_ready_init(ft4222BHandle, ready_port);
+
+		if (show_ft4222_ver)
+		{
+			printf("%s %s-%s\n", argv[0], FT4222_QSPI_TOOL_GIT_TAG, FT4222_QSPI_TOOL_GIT_COMMIT);
+			showVersion(ft4222AHandle,ft4222A_desc);
+			showVersion(ft4222BHandle,ft4222B_desc);
+		}
 	}
 
 	if (debug_printf == 'c')
@@ -1711,6 +7355,53 @@ int main(int argc, char **argv)
 	    }
     }
 
+    if (poll_set)
+    {
+	    if (addr_set == 0)
+	    {
+			printf("ft4222 work in poll mode,addr is missing\n");
+			retCode = -30;
+			goto ft4222_exit;
+	    }
+    }
+
+    if (snapFile)
+    {
+	    if ((addr_set == 0) || (size_set == 0))
+	    {
+			printf("ft4222 work in snapshot mode,%s %s\n",(addr_set ? "":"addr is missing"),(size_set ? "":"size is missing"));
+			retCode = -30;
+			goto ft4222_exit;
+	    }
+    }
+
+    if (manifestFile && (qspi_journal_name || (target_num > 1)))
+    {
+		printf("ft4222 manifest load can't be journaled or sent to several targets\n");
+		retCode = -30;
+		goto ft4222_exit;
+    }
+
+    if (qspi_memtest_num)
+    {
+	    if ((addr_set == 0) || (size_set == 0))
+	    {
+			printf("ft4222 work in memtest mode,%s %s\n",(addr_set ? "":"addr is missing"),(size_set ? "":"size is missing"));
+			retCode = -30;
+			goto ft4222_exit;
+	    }
+    }
+
+    if (mountDir)
+    {
+	    if ((addr_set == 0) || (size_set == 0))
+	    {
+			printf("ft4222 work in mount mode,%s %s\n",(addr_set ? "":"addr is missing"),(size_set ? "":"size is missing"));
+			retCode = -30;
+			goto ft4222_exit;
+	    }
+    }
+
     if (dump_show)
     {
 	    if (addr_set == 0)
@@ -1749,43 +7440,64 @@ int main(int argc, char **argv)
 			retCode = -30;
 			goto ft4222_exit;
 	    }
+	    // The journal and the adaptive steps follow one target's progress
+	    if ((target_num > 1) && (qspi_journal_name || qspi_resume || qspi_adaptive))
+	    {
+			printf("ft4222 binary load to several targets can't be journaled, resumed or adaptive\n");
+			retCode = -30;
+			goto ft4222_exit;
+	    }
     }
 
-    if (verify_set && binary_send)
+    if (qspi_resume && (qspi_journal_name == NULL))
+    {
+		printf("ft4222 resume needs a journal file\n");
+		retCode = -30;
+		goto ft4222_exit;
+    }
+
+    if (stdin_send)
     {
 	    if (addr_set == 0)
 	    {
-			printf("ft4222 work in binary file verfiy mode,addr is missing\n");
+			printf("ft4222 work in stdin load mode,addr is missing\n");
+			retCode = -30;
+			goto ft4222_exit;
+	    }
+	    if (qspi_journal_name || (target_num > 1))
+	    {
+			printf("ft4222 stdin load can't be journaled or sent to several targets\n");
 			retCode = -30;
 			goto ft4222_exit;
 	    }
     }
 
-    // Configure the FT4222 as an SPI Master.
-    ft4222Status = FT4222_SPIMaster_Init(
-                        ft4222AHandle,
-                        SPI_IO_QUAD, // 4 channel
-                        ftQspiClk, // 80 MHz / 128 == 625KHz
-                        CLK_IDLE_LOW, // clock idles at logic 0
-                        CLK_LEADING, // data captured on rising edge
-                        SLAVE_SELECT(0)); // Use SS0O for slave-select
-    if (FT4222_OK != ft4222Status)
+    if (verify_set && binary_send)
     {
-        printf("FT4222_SPIMaster_Init failed (error %d)\n",
-               (int)ft4222Status);
-        goto ft4222_exit;
+	    if (addr_set == 0)
+	    {
+			printf("ft4222 work in binary file verfiy mode,addr is missing\n");
+			retCode = -30;
+			goto ft4222_exit;
+	    }
     }
 
-    ft4222Status = FT4222_SPI_SetDrivingStrength(ft4222AHandle,
-                                                 io_Loading,
-                                                 io_Loading,
-                                                 io_Loading);
-    if (FT4222_OK != ft4222Status)
-    {
-        printf("FT4222_SPI_SetDrivingStrength failed (error %d)\n",
-               (int)ft4222Status);
-        goto ft4222_exit;
-    }
+	if (!ft4222_qspi_link_init(ft4222AHandle, ftQspiClk))
+		goto ft4222_exit;
+	if (vio_ok)
+		ft4222_qspi_link_state_save(ft4222IOVoltage);
+
+	if (replayFile)
+	{
+		retCode = ft4222_qspi_trace_replay(ft4222AHandle, replayFile) ? 0 : -30;
+		goto ft4222_exit;
+	}
+
+	if (traceFile && !ft4222_qspi_trace_open(traceFile))
+	{
+		retCode = -30;
+		goto ft4222_exit;
+	}
 
 	if (show_base) {
 		ft4222_qspi_get_base(ft4222AHandle, &tmp_value);
@@ -1803,9 +7515,27 @@ int main(int argc, char **argv)
 		ft4222_qspi_memory_write_scriptfile(ft4222AHandle, addr, scriptFile);
 	}
 
+	if (stdin_send) {
+		if (!ft4222_qspi_memory_write_stdin(ft4222AHandle, addr))
+			retCode = -30;
+	}
+
 	if (binary_send) {
 		printf("Loading  %s ......\n", binaryFile);
-		ft4222_qspi_memory_write_binaryfile(ft4222AHandle, addr, binaryFile);
+		if (target_num > 1)
+			ft4222_qspi_memory_write_binaryfile_multi(ft4222AHandle, addr, binaryFile, targets, target_num);
+		else
+			ft4222_qspi_memory_write_binaryfile(ft4222AHandle, addr, binaryFile);
+	}
+
+	if (manifestFile) {
+		if (!ft4222_qspi_memory_write_manifest(ft4222AHandle, manifestFile))
+			retCode = -30;
+	}
+
+	if (qspi_rmw_num) {
+		if (!ft4222_qspi_memory_modify(ft4222AHandle))
+			retCode = -30;
 	}
 
 	if (read_op) {
@@ -1817,6 +7547,21 @@ int main(int argc, char **argv)
 		ft4222_qspi_memory_dump(ft4222AHandle, addr, dump_size);
 	}
 
+	if (snapFile) {
+		if (!ft4222_qspi_snapshot_save(ft4222AHandle, addr, range_size, snapFile))
+			retCode = -30;
+	}
+
+	if (diffFile) {
+		if (!ft4222_qspi_snapshot_diff(ft4222AHandle, diffFile, NULL))
+			retCode = -30;
+	}
+
+	if (poll_set) {
+		if (!ft4222_qspi_memory_poll(ft4222AHandle, addr, poll_mask, poll_value, poll_timeout, poll_interval))
+			retCode = -40;
+	}
+
     if (verify_set && binary_send)
     {
 		printf("Verifing %s ......\n", binaryFile);
@@ -1825,12 +7570,40 @@ int main(int argc, char **argv)
 		ft4222_qspi_memory_write_binaryfile_verify(ft4222AHandle, addr, binaryFile);
     }
 
+	if (gdb_port) {
+		if (!ft4222_qspi_memory_gdbserver(ft4222AHandle, gdb_port, addr_set ? addr : 0,
+										  size_set ? range_size : 0xFFFFFFFF))
+			retCode = -30;
+	}
+
+	if (mountDir) {
+		ft4222_qspi_memory_mount(ft4222AHandle, addr, range_size, mountDir);
+	}
+
+	if (qspi_memtest_num) {
+		if (!ft4222_qspi_memory_test(ft4222AHandle, addr, range_size))
+			retCode = -30;
+	}
+
+	if (qspi_watch.num) {
+		if (!ft4222_qspi_memory_watch(ft4222AHandle))
+			retCode = -30;
+	}
+
+	if (!ft4222_qspi_combine_flush(ft4222AHandle))
+		retCode = -30;
+	ft4222_qspi_show_stats();
+	if (qspi_plan.enabled)
+		ft4222_qspi_plan_report();
+
 ft4222_exit:
+    ft4222_qspi_combine_flush(ft4222AHandle);
+    ft4222_qspi_trace_close();
     (void)FT_Close(ft4222AHandle);
     (void)FT_Close(ft4222BHandle);
 exit:
 	if (strbuf != NULL)
 		free(strbuf);
-    free(devInfo);
     return retCode;
 }
+#endif
@@ -13,6 +13,21 @@ git_tag_info=$(git describe --tags --abbrev=0)
 echo "#define FT4222_QSPI_TOOL_GIT_COMMIT \"$git_commit_dot \"" > version.h
 echo "#define FT4222_QSPI_TOOL_GIT_TAG \"$git_tag_info\"" >> version.h
 
+FUSE_CFLAGS=""
+FUSE_LIBS=""
+if pkg-config --exists fuse; then
+	FUSE_CFLAGS="-DFT4222_QSPI_FUSE $(pkg-config --cflags fuse)"
+	FUSE_LIBS=$(pkg-config --libs fuse)
+fi
+
 #cc ft4222_tool.c -lft4222 -Wl,-rpath,/usr/local/lib -o $FT4222_QSPI_TOOL
 
-cc -static ft4222_tool.c -lft4222 -Wl,-rpath,/usr/local/lib -ldl -lpthread -lrt -lstdc++ -o $FT4222_QSPI_TOOL
+cc -static $FUSE_CFLAGS ft4222_tool.c -lft4222 -Wl,-rpath,/usr/local/lib $FUSE_LIBS -ldl -lpthread -lrt -lstdc++ -o $FT4222_QSPI_TOOL
+
+# Protocol layer as a shared library, plus the Python extension on top of it
+cc -fPIC -shared -DFT4222_QSPI_LIBRARY ft4222_tool.c -lft4222 -Wl,-rpath,/usr/local/lib -ldl -lpthread -lrt -o libft4222qspi.so
+
+if command -v python3-config > /dev/null; then
+	cc -fPIC -shared $(python3-config --includes) -I. python/ft4222_qspi_module.c \
+		-L. -lft4222qspi -Wl,-rpath,'$ORIGIN/..' -o python/ft4222_qspi$(python3-config --extension-suffix)
+fi
@@ -0,0 +1,240 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "ft4222_qspi.h"
+
+// Python front end of libft4222qspi.so. Transfers work on the caller's
+// buffer through the buffer protocol: no copies, no text formatting.
+// The library keeps its bus state process wide, so calls hold the GIL.
+
+typedef struct {
+	PyObject_HEAD
+	ft4222_qspi_session *session;
+} SessionObject;
+
+static int Session_init(SessionObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"div", "voltage", "swap_word", NULL};
+	int division = 512, swap_word = 3;
+	double vio = 1.8;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|idi", kwlist, &division, &vio, &swap_word))
+		return -1;
+
+	if ((vio < 1.5) || (vio > 3.3))
+	{
+		PyErr_Format(PyExc_ValueError, "QSPI IO voltage %f is not @1.5 ~ 3.3V", vio);
+		return -1;
+	}
+
+	self->session = ft4222_qspi_session_open(division, vio, swap_word);
+
+	if (self->session == NULL)
+	{
+		PyErr_SetString(PyExc_IOError, "failed to open FT4222 QSPI session");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *Session_close(SessionObject *self, PyObject *unused)
+{
+	ft4222_qspi_session_close(self->session);
+	self->session = NULL;
+	Py_RETURN_NONE;
+}
+
+static void Session_dealloc(SessionObject *self)
+{
+	ft4222_qspi_session_close(self->session);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Session_check(SessionObject *self)
+{
+	if (self->session == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "session is closed");
+		return 0;
+	}
+	return 1;
+}
+
+static PyObject *Session_read_into(SessionObject *self, PyObject *args)
+{
+	unsigned int addr;
+	Py_buffer view;
+	int ok;
+
+	if (!Session_check(self) || !PyArg_ParseTuple(args, "Iw*", &addr, &view))
+		return NULL;
+
+	if (!PyBuffer_IsContiguous(&view, 'C'))
+	{
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_BufferError, "buffer is not contiguous");
+		return NULL;
+	}
+
+	ok = ft4222_qspi_session_read(self->session, addr, view.buf, (uint32_t)view.len);
+
+	PyBuffer_Release(&view);
+	if (!ok)
+		return PyErr_Format(PyExc_IOError, "read of 0x%08x failed", addr);
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_read(SessionObject *self, PyObject *args)
+{
+	unsigned int addr;
+	Py_ssize_t len;
+	PyObject *bytes;
+	int ok;
+
+	if (!Session_check(self) || !PyArg_ParseTuple(args, "In", &addr, &len))
+		return NULL;
+
+	bytes = PyBytes_FromStringAndSize(NULL, len);
+	if (bytes == NULL)
+		return NULL;
+
+	ok = ft4222_qspi_session_read(self->session, addr, PyBytes_AS_STRING(bytes), (uint32_t)len);
+
+	if (!ok)
+	{
+		Py_DECREF(bytes);
+		return PyErr_Format(PyExc_IOError, "read of 0x%08x failed", addr);
+	}
+	return bytes;
+}
+
+static PyObject *Session_write(SessionObject *self, PyObject *args)
+{
+	unsigned int addr;
+	Py_buffer view;
+	int ok;
+
+	if (!Session_check(self) || !PyArg_ParseTuple(args, "Iy*", &addr, &view))
+		return NULL;
+
+	if (!PyBuffer_IsContiguous(&view, 'C'))
+	{
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_BufferError, "buffer is not contiguous");
+		return NULL;
+	}
+
+	ok = ft4222_qspi_session_write(self->session, addr, view.buf, (uint32_t)view.len);
+
+	PyBuffer_Release(&view);
+	if (!ok)
+		return PyErr_Format(PyExc_IOError, "write of 0x%08x failed", addr);
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_select(SessionObject *self, PyObject *args)
+{
+	int target, ok;
+
+	if (!Session_check(self) || !PyArg_ParseTuple(args, "i", &target))
+		return NULL;
+
+	ok = ft4222_qspi_session_select(self->session, target);
+
+	if (!ok)
+		return PyErr_Format(PyExc_IOError, "failed to select target %d", target);
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_combine(SessionObject *self, PyObject *args)
+{
+	int timeout_ms = 0, ok;
+
+	if (!Session_check(self) || !PyArg_ParseTuple(args, "|i", &timeout_ms))
+		return NULL;
+
+	ok = ft4222_qspi_session_combine(self->session, timeout_ms);
+
+	if (!ok)
+		return PyErr_Format(PyExc_IOError, "failed to flush combined writes");
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_barrier(SessionObject *self, PyObject *unused)
+{
+	int ok;
+
+	if (!Session_check(self))
+		return NULL;
+
+	ok = ft4222_qspi_session_barrier(self->session);
+
+	if (!ok)
+		return PyErr_Format(PyExc_IOError, "failed to flush combined writes");
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_enter(SessionObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *Session_exit(SessionObject *self, PyObject *args)
+{
+	return Session_close(self, NULL);
+}
+
+static PyMethodDef Session_methods[] = {
+	{"read_into", (PyCFunction)Session_read_into, METH_VARARGS,
+	 "read_into(addr, buffer): fill a writable buffer from target memory."},
+	{"read", (PyCFunction)Session_read, METH_VARARGS,
+	 "read(addr, length) -> bytes"},
+	{"write", (PyCFunction)Session_write, METH_VARARGS,
+	 "write(addr, buffer): write a readable buffer to target memory."},
+	{"select", (PyCFunction)Session_select, METH_VARARGS,
+	 "select(cs): route following transfers to the target on SS<cs>O."},
+	{"combine", (PyCFunction)Session_combine, METH_VARARGS,
+	 "combine(timeout_ms=0): gather small writes into bursts; a negative timeout turns it off."},
+	{"barrier", (PyCFunction)Session_barrier, METH_NOARGS, "barrier(): send pending combined writes."},
+	{"close", (PyCFunction)Session_close, METH_NOARGS, "Close the FT4222 handles."},
+	{"__enter__", (PyCFunction)Session_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)Session_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SessionType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "ft4222_qspi.Session",
+	.tp_doc       = "Session(div=512, voltage=1.8, swap_word=3) keeping the FT4222 handles open.",
+	.tp_basicsize = sizeof(SessionObject),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_new       = PyType_GenericNew,
+	.tp_init      = (initproc)Session_init,
+	.tp_dealloc   = (destructor)Session_dealloc,
+	.tp_methods   = Session_methods,
+};
+
+static struct PyModuleDef ft4222_qspi_module = {
+	PyModuleDef_HEAD_INIT, "ft4222_qspi", "FT4222 SPI2AHB target memory access.", -1, NULL
+};
+
+PyMODINIT_FUNC PyInit_ft4222_qspi(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&SessionType) < 0)
+		return NULL;
+
+	m = PyModule_Create(&ft4222_qspi_module);
+	if (m == NULL)
+		return NULL;
+
+	Py_INCREF(&SessionType);
+	if (PyModule_AddObject(m, "Session", (PyObject *)&SessionType) < 0)
+	{
+		Py_DECREF(&SessionType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
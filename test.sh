@@ -0,0 +1,10 @@
+# Host-only tests; no FT4222 needs to be attached. Run make.sh first, it
+# generates version.h.
+
+if [ ! -f version.h ]; then
+	echo "version.h is missing, run make.sh first"
+	exit 1
+fi
+
+cc -I. tests/ft4222_pipe_test.c -lft4222 -Wl,-rpath,/usr/local/lib -ldl -lpthread -lrt -o tests/ft4222_pipe_test || exit 1
+./tests/ft4222_pipe_test
@@ -0,0 +1,314 @@
+// Host-only tests of the -B load pipeline: tail padding, 32MB window
+// cutting, word swap, streamed input, blocking ring waits and loads into
+// several targets. The bus is
+// a memory model behind qspi_transport, so no FT4222 has to be attached.
+// Build and run with test.sh.
+#define main ft4222_tool_main
+#include "../ft4222_tool.c"
+#undef main
+
+#define SIM_ORG          0x91fe0000
+#define SIM_SIZE         0x40000
+#define SIM_FILL         0xee
+
+static uint8_t sim_mem[QSPI_TARGET_MAX][SIM_SIZE];
+static uint32_t sim_base[QSPI_TARGET_MAX], sim_request;
+static int sim_error;
+
+// Bridge model, one per chip select: keeps the base register, serves
+// reads from sim_mem and fails the test on a burst that crosses a window
+// or leaves the model
+static FT4222_STATUS sim_transport(FT_HANDLE ftHandle, uint8 *readBuffer, uint8 *writeBuffer,
+								   uint8 singleWriteBytes, uint16 multiWriteBytes,
+								   uint16 multiReadBytes, uint32 *sizeOfRead)
+{
+	uint8_t *mem = sim_mem[qspi_target_active];
+	uint32_t *base = &sim_base[qspi_target_active];
+	uint32_t offset = (writeBuffer[1] << 18) | (writeBuffer[2] << 10) | (writeBuffer[3] << 2);
+	uint32_t len = multiWriteBytes - QSPI_FRAME_HDR, addr = *base + offset;
+
+	*sizeOfRead = multiReadBytes;
+	switch (writeBuffer[0] & (QSPI_WR_OP_MASK | QSPI_TRANS_TYPE_MASK))
+	{
+	case QSPI_TRANS_STATUS:
+	case QSPI_WR_OP_MASK | QSPI_TRANS_STATUS:
+		memset(readBuffer, QSPI_WR_READY, multiReadBytes);
+		break;
+	case QSPI_READ_REQUEST:
+		sim_request = offset;
+		break;
+	case QSPI_TRANS_DATA:
+		if (sim_request == QSPI_SET_BASE_ADDR)
+		{
+			readBuffer[0] = *base >> 24;
+			readBuffer[1] = *base >> 16;
+			readBuffer[2] = *base >> 8;
+			readBuffer[3] = *base;
+		}
+		else if ((*base + sim_request >= SIM_ORG) &&
+				 (*base + sim_request + multiReadBytes <= SIM_ORG + SIM_SIZE))
+			memcpy(readBuffer, mem + *base + sim_request - SIM_ORG, multiReadBytes);
+		else
+			memset(readBuffer, 0, multiReadBytes);
+		break;
+	case QSPI_WR_OP_MASK | QSPI_TRANS_DATA:
+		if (offset == QSPI_SET_BASE_ADDR)
+		{
+			*base = (writeBuffer[4] << 24) | (writeBuffer[5] << 16) | (writeBuffer[6] << 8) | writeBuffer[7];
+			break;
+		}
+		if (offset + len > QSPI_ACCESS_WINDOW)
+		{
+			printf("burst of %u bytes at 0x%08x crosses a window\n", len, addr);
+			sim_error = 1;
+		}
+		else if ((addr < SIM_ORG) || (addr + len > SIM_ORG + SIM_SIZE))
+		{
+			printf("burst of %u bytes at 0x%08x is outside the model\n", len, addr);
+			sim_error = 1;
+		}
+		else
+			memcpy(mem + addr - SIM_ORG, writeBuffer + QSPI_FRAME_HDR, len);
+		break;
+	}
+	return FT4222_OK;
+}
+
+static void sim_reset(void)
+{
+	memset(sim_mem, SIM_FILL, sizeof(sim_mem));
+	memset(qspi_base_valid, 0, sizeof(qspi_base_valid));
+	memset(sim_base, 0, sizeof(sim_base));
+	sim_error = 0;
+	qspi_swapword = 0;
+}
+
+static void image_make(uint8_t *image, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		image[i] = (uint8_t)((i * 131 + seed) ^ (i >> 8));
+}
+
+static int image_write(const char *fileName, const uint8_t *image, size_t len)
+{
+	FILE *fp = fopen(fileName, "wb");
+	int ok;
+
+	if (fp == NULL)
+		return 0;
+	ok = (fwrite(image, 1, len, fp) == len);
+	return !fclose(fp) && ok;
+}
+
+// The image must be on the target word for word, the tail word padded
+// with zeros and nothing past it touched
+static int image_check(const char *name, int target, uint32_t mem_addr, const uint8_t *image, size_t len, int swap)
+{
+	size_t padded = (len + QSPI_DUMP_WORD - 1) & ~(size_t)(QSPI_DUMP_WORD - 1), i, src;
+	uint8_t *mem = sim_mem[target] + mem_addr - SIM_ORG, expect;
+
+	if (sim_error)
+	{
+		printf("FAIL %s: bus model reported an error\n", name);
+		return 0;
+	}
+	for (i = 0; i < padded; i++)
+	{
+		src = swap ? ((i & ~(size_t)3) + 3 - (i & 3)) : i;
+		expect = (src < len) ? image[src] : 0;
+		if (mem[i] != expect)
+		{
+			printf("FAIL %s: byte %zu is 0x%02x, expected 0x%02x\n", name, i, mem[i], expect);
+			return 0;
+		}
+	}
+	for (i = padded; (mem_addr - SIM_ORG + i < SIM_SIZE) && (i < padded + QSPI_BURST_MAX); i++)
+	{
+		if (mem[i] != SIM_FILL)
+		{
+			printf("FAIL %s: byte %zu past the image was written\n", name, i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int test_file(const char *name, uint32_t mem_addr, size_t len, int swap)
+{
+	static uint8_t image[SIM_SIZE / 2];
+	const char *fileName = "/tmp/ft4222_pipe_test.bin";
+	int ok;
+
+	sim_reset();
+	qspi_swapword = swap ? QSPI_W_SWAP_WORD : 0;
+	image_make(image, len, (unsigned int)len);
+	if (!image_write(fileName, image, len))
+	{
+		printf("FAIL %s: can't write %s\n", name, fileName);
+		return 0;
+	}
+	ok = ft4222_qspi_memory_write_binaryfile(NULL, mem_addr, (char *)fileName) &&
+		 image_check(name, 0, mem_addr, image, len, swap);
+	unlink(fileName);
+	if (ok)
+		printf("PASS %s\n", name);
+	return ok;
+}
+
+struct stream_feed {
+	int            fd;
+	const uint8_t *image;
+	size_t         len;
+	size_t         piece;
+	unsigned int   pause_us;
+};
+
+static void *stream_writer(void *arg)
+{
+	struct stream_feed *feed = arg;
+	size_t done, piece;
+
+	for (done = 0; done < feed->len; done += piece)
+	{
+		piece = ((feed->len - done) < feed->piece) ? (feed->len - done) : feed->piece;
+		if (write(feed->fd, feed->image + done, piece) != (ssize_t)piece)
+			break;
+		if (feed->pause_us)
+			usleep(feed->pause_us);
+	}
+	close(feed->fd);
+	return NULL;
+}
+
+// Load an image fed through a pipe as -B - does; *pcpu returns the CPU
+// time the process spent per second of loading
+static int stream_load(const char *name, uint32_t mem_addr, const uint8_t *image, size_t len, size_t piece,
+					   unsigned int pause_us, double *pcpu)
+{
+	struct stream_feed feed;
+	struct timespec wall0, wall1, cpu0, cpu1;
+	pthread_t writer;
+	size_t done = 0, total = 0;
+	int fds[2], ok;
+
+	sim_reset();
+	if (pipe(fds))
+	{
+		printf("FAIL %s: no pipe\n", name);
+		return 0;
+	}
+	feed.fd = fds[1];
+	feed.image = image;
+	feed.len = len;
+	feed.piece = piece;
+	feed.pause_us = pause_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall0);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+	pthread_create(&writer, NULL, stream_writer, &feed);
+	ok = ft4222_qspi_pipe_load(NULL, fds[0], mem_addr, 0, &done, NULL, &total);
+	pthread_join(writer, NULL);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+	clock_gettime(CLOCK_MONOTONIC, &wall1);
+	close(fds[0]);
+
+	if (!ok || (total != len) || (done != ((len + 3) & ~(size_t)3)))
+	{
+		printf("FAIL %s: load %d, %zu bytes taken, %zu confirmed\n", name, ok, total, done);
+		return 0;
+	}
+	if (pcpu)
+		*pcpu = ((cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9) /
+				((wall1.tv_sec - wall0.tv_sec) + (wall1.tv_nsec - wall0.tv_nsec) / 1e9);
+	return image_check(name, 0, mem_addr, image, len, 0);
+}
+
+// Odd sized pieces, so bursts have to be carried across short reads
+static int test_stream(void)
+{
+	static uint8_t image[5003];
+
+	image_make(image, sizeof(image), 7);
+	if (!stream_load("stream", SIM_ORG + 0x1000, image, sizeof(image), 37, 0, NULL))
+		return 0;
+	printf("PASS stream\n");
+	return 1;
+}
+
+// A slow source leaves the frame builder and the bus thread waiting on
+// empty rings nearly all the time; they must sleep there, not spin
+static int test_blocking(void)
+{
+	static uint8_t image[QSPI_BURST_MAX * 100];
+	double cpu;
+
+	image_make(image, sizeof(image), 3);
+	if (!stream_load("blocking", SIM_ORG, image, sizeof(image), QSPI_BURST_MAX, 3000, &cpu))
+		return 0;
+	if (cpu > 0.25)
+	{
+		printf("FAIL blocking: %.0f%% of a CPU while waiting, the rings spin\n", cpu * 100);
+		return 0;
+	}
+	printf("PASS blocking (%.0f%% of a CPU)\n", cpu * 100);
+	return 1;
+}
+
+// One image into three targets: each gets all of it, a tail that is not
+// a legal burst is cut down rather than padded out, and no burst crosses
+// the window edge
+static int test_multi(const char *name, uint32_t mem_addr, size_t len)
+{
+	static uint8_t image[SIM_SIZE / 2];
+	static const int targets[] = {0, 2, 3};
+	const char *fileName = "/tmp/ft4222_pipe_test.bin";
+	int ok, t;
+
+	sim_reset();
+	image_make(image, len, (unsigned int)len);
+	if (!image_write(fileName, image, len))
+	{
+		printf("FAIL %s: can't write %s\n", name, fileName);
+		return 0;
+	}
+	ok = ft4222_qspi_memory_write_binaryfile_multi(NULL, mem_addr, (char *)fileName, targets, 3);
+	unlink(fileName);
+	for (t = 0; ok && (t < 3); t++)
+		ok = image_check(name, targets[t], mem_addr, image, len, 0);
+	if (ok)
+		printf("PASS %s\n", name);
+	return ok;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	qspi_transport = sim_transport;
+	qspi_target_active = 0;
+	delay_cycle = 0;
+
+	failed += !test_file("tail 1 byte", SIM_ORG + 0x100, 1, 0);
+	failed += !test_file("tail 3 bytes", SIM_ORG + 0x200, 3, 0);
+	failed += !test_file("tail 129 bytes", SIM_ORG + 0x400, 129, 0);
+	failed += !test_file("tail one block and a word", SIM_ORG, QSPI_PIPE_BLOCK + 5, 0);
+	failed += !test_file("swapped tail", SIM_ORG + 0x800, 1001, 1);
+	// 0x92000000 is a 32MB window edge
+	failed += !test_file("window edge", 0x92000000 - 0x1804, 0x3000 + 7, 0);
+	failed += !test_file("window edge swapped", 0x92000000 - 0x44, 0x200 + 2, 1);
+	qspi_posted = QSPI_POST_DEPTH;
+	failed += !test_file("posted batches", 0x92000000 - 0x404, 0x1000 + 1, 0);
+	qspi_posted = 0;
+	failed += !test_stream();
+	failed += !test_blocking();
+	// link_sso only records the target in plan mode, so no FT4222 is needed
+	qspi_plan.enabled = 1;
+	failed += !test_multi("multi tail", SIM_ORG + 0x100, QSPI_MULTI_STRIPE + 100);
+	failed += !test_multi("multi window edge", 0x92000000 - 0x804, 0x2000 + 3);
+	qspi_plan.enabled = 0;
+
+	printf("%d failed\n", failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}